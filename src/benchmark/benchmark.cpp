@@ -0,0 +1,366 @@
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "device.h"
+#include "render.h"
+#include "bitmap_utils.h"
+#include "image_writer.h"
+#include "thread_pool.h"
+#include "camera.h"
+#include "sceneobjects.h"
+#include "compiled_scene.h"
+#include "mandelbrot.h"
+#include "life.h"
+#include "benchmark.h"
+
+// Times the hot kernels of each sample at fixed sizes, and writes the results as JSON.
+// It links with the ray tracer sample, and drives its scene and camera directly; no window is needed.
+//
+// usage: benchmark [--width 640] [--height 480] [--warmup 2] [--repetitions 10] [--filter name] [--output results.json]
+
+// From the ray tracer
+extern std::vector<std::shared_ptr<SceneObject>> sceneObjects;
+extern std::shared_ptr<Camera> pCamera;
+extern CompiledScene compiledScene;
+bool FindNearestObject(const glm::vec3& rayorig, const glm::vec3& raydir, SceneHit& nearestHit);
+glm::vec3 TraceRay(const glm::vec3& ray_origin, const glm::vec3& ray_dir);
+
+namespace
+{
+int imageWidth = 640;
+int imageHeight = 480;
+}
+
+DeviceParams deviceParams;
+
+void device_buffer_ensure_screen_size(BufferData* pData)
+{
+    device_buffer_resize(pData, imageWidth, imageHeight);
+}
+
+void device_buffer_set_to_display(BufferData* data)
+{
+}
+
+bool device_is_key_down(DeviceKeyType type)
+{
+    return false;
+}
+
+void device_log(const char* pText)
+{
+    fprintf(stderr, "%s\n", pText);
+}
+
+// A grid of small spheres over the floor, with a few lights; many more primitives than the sample scene
+std::vector<std::shared_ptr<SceneObject>> build_sphere_grid()
+{
+    std::vector<std::shared_ptr<SceneObject>> objects;
+    const int GridSize = 20;
+    for (int z = 0; z < GridSize; z++)
+    {
+        for (int x = 0; x < GridSize; x++)
+        {
+            Material mat;
+            mat.albedo = glm::vec3(x / float(GridSize), 0.5f, z / float(GridSize));
+            mat.specular = glm::vec3(0.5f);
+            mat.specular_exponent = 20;
+            if ((x + z) % 5 == 0)
+            {
+                mat.opacity = 0.5f;
+                mat.refractive_index = 0.95f;
+            }
+            if (x % 7 == 3 && z % 7 == 3)
+            {
+                mat.emissive = glm::vec3(1.0f);
+            }
+            glm::vec3 center((x - GridSize / 2) * 0.6f, 0.25f, (z - GridSize / 2) * 0.6f);
+            objects.push_back(std::make_shared<Sphere>(mat, center, 0.25f));
+        }
+    }
+    objects.push_back(std::make_shared<TiledPlane>(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+    return objects;
+}
+
+void benchmark_raytracer(const BenchmarkSettings& settings, std::vector<BenchmarkResult>& results)
+{
+    render_init();
+    render_resized(imageWidth, imageHeight);
+    pCamera->PreRender();
+
+    // The primary rays through the pixel centres
+    std::vector<Ray> rays;
+    for (int y = 0; y < imageHeight; y++)
+    {
+        for (int x = 0; x < imageWidth; x++)
+        {
+            rays.push_back(pCamera->GetWorldRay(glm::vec2(x, y) + glm::vec2(0.5f)));
+        }
+    }
+
+    benchmark_run(settings, "camera/get_world_ray", rays.size(), [&]()
+    {
+        float sum = 0.0f;
+        for (int y = 0; y < imageHeight; y++)
+        {
+            for (int x = 0; x < imageWidth; x++)
+            {
+                sum += pCamera->GetWorldRay(glm::vec2(x, y) + glm::vec2(0.5f)).direction.x;
+            }
+        }
+        benchmark_keep(uint64_t(sum));
+    }, results);
+
+    // The sample scene, without any mesh.obj it picked up from the working directory, so the numbers don't
+    // depend on where it runs; and a bigger one
+    std::vector<std::pair<std::string, std::vector<std::shared_ptr<SceneObject>>>> scenes;
+    scenes.emplace_back("sample", std::vector<std::shared_ptr<SceneObject>>());
+    for (auto& pObject : sceneObjects)
+    {
+        if (pObject->GetSceneObjectType() != SceneObjectType::Mesh)
+        {
+            scenes.back().second.push_back(pObject);
+        }
+    }
+    scenes.emplace_back("sphere_grid", build_sphere_grid());
+
+    for (auto& scene : scenes)
+    {
+        compiled_scene_build(compiledScene, scene.second);
+
+        benchmark_run(settings, "raytracer/find_nearest_object/" + scene.first, rays.size(), [&]()
+        {
+            uint64_t hits = 0;
+            for (auto& ray : rays)
+            {
+                SceneHit hit;
+                hits += FindNearestObject(ray.position, ray.direction, hit) ? 1 : 0;
+            }
+            benchmark_keep(hits);
+        }, results);
+
+        benchmark_run(settings, "raytracer/trace_ray/" + scene.first, rays.size(), [&]()
+        {
+            float sum = 0.0f;
+            for (auto& ray : rays)
+            {
+                sum += TraceRay(ray.position, ray.direction).x;
+            }
+            benchmark_keep(uint64_t(sum));
+        }, results);
+    }
+
+    render_destroy();
+}
+
+void benchmark_mandelbrot(const BenchmarkSettings& settings, std::vector<BenchmarkResult>& results)
+{
+    // The sample's starting view, one point per pixel
+    const std::complex<double> topLeft(-2.0, -1.0);
+    const std::complex<double> bottomRight(2.0, 1.0);
+    benchmark_run(settings, "mandelbrot/escape_loop", uint64_t(imageWidth) * imageHeight, [&]()
+    {
+        uint64_t iterations = 0;
+        for (int y = 0; y < imageHeight; y++)
+        {
+            for (int x = 0; x < imageWidth; x++)
+            {
+                double xf = x / double(imageWidth);
+                double yf = y / double(imageHeight);
+                auto c = std::complex<double>(xf * (real(bottomRight) - real(topLeft)) + real(topLeft),
+                    yf * (imag(bottomRight) - imag(topLeft)) + imag(topLeft));
+                iterations += mandelbrot_iterations(c);
+            }
+        }
+        benchmark_keep(iterations);
+    }, results);
+}
+
+void benchmark_life(const BenchmarkSettings& settings, ThreadPool& threadPool, std::vector<BenchmarkResult>& results)
+{
+    // A fixed random soup; each run steps from the same start, so every run does the same work
+    std::vector<uint32_t> source(size_t(imageWidth) * imageHeight);
+    std::vector<uint32_t> target(source.size());
+    std::srand(0);
+    for (auto& cell : source)
+    {
+        cell = (std::rand() & 1) ? 1 : 0;
+    }
+
+    benchmark_run(settings, "game_of_life/generation", source.size(), [&]()
+    {
+        life_generation(threadPool, source, target, imageWidth, imageHeight);
+        benchmark_keep(target[target.size() / 2]);
+    }, results);
+}
+
+void benchmark_buffers(const BenchmarkSettings& settings, std::vector<BenchmarkResult>& results)
+{
+    // A gradient that covers the whole range, and a bit outside it for the clamping
+    BufferData* pBuffer = device_buffer_create(imageWidth, imageHeight);
+    for (int y = 0; y < imageHeight; y++)
+    {
+        for (int x = 0; x < imageWidth; x++)
+        {
+            pBuffer->buffer[y * imageWidth + x] = glm::vec4(x / float(imageWidth - 1) * 1.2f - 0.1f, y / float(imageHeight - 1), 0.5f, 1.0f);
+        }
+    }
+
+    std::vector<uint8_t> bgra(size_t(imageWidth) * imageHeight * 4);
+    benchmark_run(settings, "device/buffer_to_bgra8", uint64_t(imageWidth) * imageHeight, [&]()
+    {
+        device_buffer_to_bgra8(pBuffer, bgra.data(), imageWidth * 4);
+        benchmark_keep(bgra[bgra.size() / 2]);
+    }, results);
+
+    const std::pair<PixelEncoding, const char*> encodings[] = {
+        { PixelEncoding::SRGB, "srgb" },
+        { PixelEncoding::Tonemap, "tonemap" }
+    };
+    for (const auto& encoding : encodings)
+    {
+        benchmark_run(settings, std::string("device/buffer_convert/") + encoding.second, uint64_t(imageWidth) * imageHeight, [&]()
+        {
+            device_buffer_convert(pBuffer, bgra.data(), imageWidth * 4, PixelLayout::BGRA8, encoding.first);
+            benchmark_keep(bgra[bgra.size() / 2]);
+        }, results);
+    }
+
+    // The same image in each compact format: encoding it from vec4s, and converting it for display
+    const std::pair<BufferFormat, const char*> formats[] = {
+        { BufferFormat::RGB32F, "rgb32f" },
+        { BufferFormat::RGB16F, "rgb16f" },
+        { BufferFormat::RGB9E5, "rgb9e5" }
+    };
+    for (const auto& format : formats)
+    {
+        BufferData* pCompact = device_buffer_create(imageWidth, imageHeight, format.first);
+        benchmark_run(settings, std::string("device/buffer_write/") + format.second, uint64_t(imageWidth) * imageHeight, [&]()
+        {
+            for (int y = 0; y < imageHeight; y++)
+            {
+                device_buffer_write(pCompact, 0, y, imageWidth, pBuffer->buffer + y * imageWidth);
+            }
+            benchmark_keep(((uint8_t*)pCompact->pPixels)[0]);
+        }, results);
+
+        benchmark_run(settings, std::string("device/buffer_to_bgra8/") + format.second, uint64_t(imageWidth) * imageHeight, [&]()
+        {
+            device_buffer_to_bgra8(pCompact, bgra.data(), imageWidth * 4);
+            benchmark_keep(bgra[bgra.size() / 2]);
+        }, results);
+        device_buffer_destroy(pCompact);
+    }
+
+    benchmark_run(settings, "bitmap/create_from_buffer", uint64_t(imageWidth) * imageHeight, [&]()
+    {
+        auto pBitmap = bitmap_create_from_buffer(pBuffer);
+        benchmark_keep(pBitmap->pData[0].red);
+        bitmap_destroy(pBitmap);
+    }, results);
+
+    const char* pBitmapPath = "benchmark_out.bmp";
+    auto pBitmap = bitmap_create_from_buffer(pBuffer);
+    benchmark_run(settings, "bitmap/write", uint64_t(imageWidth) * imageHeight, [&]()
+    {
+        benchmark_keep(bitmap_write(pBitmap, pBitmapPath) ? 1 : 0);
+    }, results);
+    bitmap_destroy(pBitmap);
+    remove(pBitmapPath);
+
+    // Each file format, converted and written on this thread
+    const char* imagePaths[] = { "benchmark_out.bmp", "benchmark_out.ppm", "benchmark_out.pfm", "benchmark_out.png" };
+    for (const char* pPath : imagePaths)
+    {
+        benchmark_run(settings, std::string("image/write/") + (strchr(pPath, '.') + 1), uint64_t(imageWidth) * imageHeight, [&]()
+        {
+            benchmark_keep(image_write(pBuffer, pPath) ? 1 : 0);
+        }, results);
+        remove(pPath);
+    }
+
+    ImageWriteOptions stored = image_write_options("benchmark_out.png");
+    stored.compress = false;
+    benchmark_run(settings, "image/write/png_stored", uint64_t(imageWidth) * imageHeight, [&]()
+    {
+        benchmark_keep(image_write(pBuffer, "benchmark_out.png", stored) ? 1 : 0);
+    }, results);
+    remove("benchmark_out.png");
+
+    device_buffer_destroy(pBuffer);
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkSettings settings;
+    std::string output;
+    for (int arg = 1; arg < argc; arg++)
+    {
+        bool hasValue = arg + 1 < argc;
+        if (strcmp(argv[arg], "--width") == 0 && hasValue)
+        {
+            imageWidth = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--height") == 0 && hasValue)
+        {
+            imageHeight = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--warmup") == 0 && hasValue)
+        {
+            settings.warmup = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--repetitions") == 0 && hasValue)
+        {
+            settings.repetitions = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--filter") == 0 && hasValue)
+        {
+            settings.filter = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--output") == 0 && hasValue)
+        {
+            output = argv[++arg];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--width 640] [--height 480] [--warmup 2] [--repetitions 10] [--filter name] [--output results.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (imageWidth <= 0 || imageHeight <= 0 || settings.warmup < 0 || settings.repetitions <= 0)
+    {
+        fprintf(stderr, "Width, height and repetitions must be at least 1\n");
+        return 1;
+    }
+
+    ThreadPool threadPool;
+    std::vector<BenchmarkResult> results;
+    benchmark_raytracer(settings, results);
+    benchmark_mandelbrot(settings, results);
+    benchmark_life(settings, threadPool, results);
+    benchmark_buffers(settings, results);
+
+    std::vector<std::pair<std::string, std::string>> info;
+    info.emplace_back("width", std::to_string(imageWidth));
+    info.emplace_back("height", std::to_string(imageHeight));
+    info.emplace_back("threads", std::to_string(threadPool.GetThreadCount()));
+
+    // The JSON goes to stdout unless there's a file for it
+    FILE* pFile = stdout;
+    if (!output.empty() && (pFile = fopen(output.c_str(), "w")) == nullptr)
+    {
+        fprintf(stderr, "Failed to write %s\n", output.c_str());
+        return 1;
+    }
+    benchmark_write_json(pFile, settings, info, results);
+    if (pFile != stdout)
+    {
+        fclose(pFile);
+    }
+    return 0;
+}
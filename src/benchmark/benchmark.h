@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A small timing harness for the kernel benchmarks: a few untimed warmup runs, then timed repetitions,
+// reported as a table and as JSON so runs can be compared before and after a change
+
+struct BenchmarkSettings
+{
+    int warmup = 2;                                         // Untimed runs, to fill the caches and wake the threads
+    int repetitions = 10;
+    std::string filter;                                     // Only benchmarks with this in their name run
+};
+
+struct BenchmarkResult
+{
+    std::string name;
+    uint64_t items;                                         // Work done by one run; rays, pixels, cells...
+    double minMs;
+    double medianMs;
+    double meanMs;
+    double maxMs;
+};
+
+// Stores results the compiler can't see through, so the benchmarked work isn't optimized away
+static volatile uint64_t benchmarkSink;
+
+inline void benchmark_keep(uint64_t value)
+{
+    benchmarkSink = benchmarkSink + value;
+}
+
+inline bool benchmark_enabled(const BenchmarkSettings& settings, const std::string& name)
+{
+    return settings.filter.empty() || name.find(settings.filter) != std::string::npos;
+}
+
+// Time fn, which does 'items' worth of work each call, and add the result
+inline void benchmark_run(const BenchmarkSettings& settings, const std::string& name, uint64_t items, const std::function<void()>& fn, std::vector<BenchmarkResult>& results)
+{
+    if (!benchmark_enabled(settings, name))
+    {
+        return;
+    }
+
+    for (int run = 0; run < settings.warmup; run++)
+    {
+        fn();
+    }
+
+    std::vector<double> times;
+    for (int run = 0; run < std::max(1, settings.repetitions); run++)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        fn();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+
+    BenchmarkResult result;
+    result.name = name;
+    result.items = items;
+    result.minMs = times.front();
+    result.medianMs = times[times.size() / 2];
+    result.maxMs = times.back();
+    result.meanMs = 0.0;
+    for (auto time : times)
+    {
+        result.meanMs += time;
+    }
+    result.meanMs /= double(times.size());
+
+    fprintf(stderr, "%-44s %10.3fms median %10.3fms min %14.0f items/s\n", name.c_str(), result.medianMs, result.minMs, items / (result.medianMs * 0.001));
+    results.push_back(result);
+}
+
+// Throughput is worked out from the median, which is steadier than the mean on a busy machine
+inline void benchmark_write_json(FILE* pFile, const BenchmarkSettings& settings, const std::vector<std::pair<std::string, std::string>>& info, const std::vector<BenchmarkResult>& results)
+{
+    fprintf(pFile, "{\n");
+    fprintf(pFile, "  \"warmup\": %d,\n", settings.warmup);
+    fprintf(pFile, "  \"repetitions\": %d,\n", settings.repetitions);
+    for (auto& entry : info)
+    {
+        fprintf(pFile, "  \"%s\": %s,\n", entry.first.c_str(), entry.second.c_str());
+    }
+    fprintf(pFile, "  \"benchmarks\": [");
+    for (size_t index = 0; index < results.size(); index++)
+    {
+        const BenchmarkResult& result = results[index];
+        fprintf(pFile, "%s\n    { \"name\": \"%s\", \"items\": %llu, \"min_ms\": %.4f, \"median_ms\": %.4f, \"mean_ms\": %.4f, \"max_ms\": %.4f, \"items_per_second\": %.1f }",
+            index == 0 ? "" : ",",
+            result.name.c_str(),
+            (unsigned long long)result.items,
+            result.minMs,
+            result.medianMs,
+            result.meanMs,
+            result.maxMs,
+            result.items / (result.medianMs * 0.001));
+    }
+    fprintf(pFile, "\n  ]\n}\n");
+}
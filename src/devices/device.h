@@ -0,0 +1,100 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+
+class ThreadPool;
+struct BufferMapping;
+
+enum class DeviceKeyType
+{
+    Ctrl
+};
+
+// How a buffer stores its pixels; the samples pick one when they create it.
+// The compact formats halve or quarter the memory traffic of a frame, which is what limits it at 4K and up
+enum class BufferFormat
+{
+    RGBA32F,                                                // glm::vec4; 16 bytes
+    RGB32F,                                                 // glm::vec3; 12 bytes, for accumulation, where alpha is always 1
+    RGB16F,                                                 // 3 half floats; 6 bytes
+    RGB9E5                                                  // 9 bit mantissas sharing a 5 bit exponent; 4 bytes, no negatives
+};
+
+struct BufferData
+{
+    int BufferWidth;
+    int BufferHeight;
+    glm::vec4* buffer;                                      // The pixels if the format is RGBA32F, else nullptr
+    BufferFormat format;
+    void* pPixels;                                          // The pixels, in rows of BufferWidth, whatever the format
+    BufferMapping* pMapping;                                // The file the pixels live in, if it is mapped; else nullptr
+};
+
+// How float pixels are encoded as 8 bit ones
+enum class PixelEncoding
+{
+    Linear,                                                 // Clamped and scaled; the samples' colours are authored for this
+    SRGB,                                                   // Clamped, then the sRGB curve
+    Tonemap                                                 // Reinhard tonemapped, then the sRGB curve; keeps highlights
+};
+
+// Order of the channels in an 8 bit pixel
+enum class PixelLayout
+{
+    BGRA8,
+    BGR8,
+    RGB8
+};
+
+struct DeviceParams
+{
+    float zoomFactor = 1.0f;
+    glm::vec2 offset = glm::vec2(0.0f);
+    const char* pName = "EasyRender";
+    PixelEncoding encoding = PixelEncoding::Linear;         // For the display, and for saved images
+    const char* pMappedOutput = nullptr;                    // Set by a device for samples to render into; see device_buffer_map
+    const char* pCheckpointPath = nullptr;                  // Where samples that save their progress do so: nullptr for their own
+                                                            // choice, "" for nowhere
+};
+extern DeviceParams deviceParams;
+
+BufferData* device_buffer_create(int width = 0, int height = 0, BufferFormat format = BufferFormat::RGBA32F);
+void device_buffer_destroy(BufferData* pData);
+
+// Create a buffer whose pixels live in a file mapped into memory, so whatever is rendered into it is already saved,
+// with no copy to export it.  The file is a TIFF of 32 or 16 bit floats, BigTIFF past 4GB, with the header in front
+// of the pixels and the rows top to bottom, just as they are in memory.  The system pages the pixels in and out as
+// the tiles being worked on touch them, so the image can be bigger than memory.  Resizing the buffer rewrites the
+// file at the new size.  Returns nullptr, and logs why, for RGB9E5 or if the file can't be mapped
+BufferData* device_buffer_map(const char* pPath, int width = 0, int height = 0, BufferFormat format = BufferFormat::RGB32F);
+void device_buffer_ensure_screen_size(BufferData* pData);
+void device_buffer_resize(BufferData* pData, int width, int height);
+size_t device_buffer_pixel_size(BufferFormat format);
+
+// Resize the target to match the source, and copy its pixels and format
+void device_buffer_copy(BufferData* pTarget, const BufferData* pSource);
+
+// Read 'count' pixels from (x, y) as vec4s, with alpha 1 when the format has none
+void device_buffer_read(const BufferData* pData, int x, int y, int count, glm::vec4* pTarget);
+
+// Write 'count' pixels to (x, y), converting them to the buffer's format; alpha is dropped when it has none
+void device_buffer_write(BufferData* pData, int x, int y, int count, const glm::vec4* pSource);
+void device_buffer_set_to_display(BufferData* buffer);
+bool device_is_key_down(DeviceKeyType type);
+
+// Convert the buffer to rows of 8 bit pixels, stride bytes apart.  The rows are shared out over the device's thread
+// pool, if it has been given one and this is the thread that gave it; any other thread converts them on its own
+void device_buffer_convert(const BufferData* pData, uint8_t* pTarget, int stride, PixelLayout layout, PixelEncoding encoding);
+
+// Convert the buffer to 8 bit BGRA rows for display, with the encoding in deviceParams
+void device_buffer_to_bgra8(const BufferData* pData, uint8_t* pTarget, int stride);
+
+// Lend the device a thread pool to convert buffers with; samples that have one share it
+void device_set_thread_pool(const std::shared_ptr<ThreadPool>& spPool);
+
+// Write a line of diagnostics where the user can see it
+void device_log(const char* pText);
+
+
@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <glm/gtc/packing.hpp>
+
+#include "device.h"
+#include "mapped_file.h"
+
+// Buffer management and pixel formats shared by all the devices; only device_buffer_ensure_screen_size depends on the display
+
+// Half floats go through F16C when the build has it (USE_AVX2 turns it on), 4 at a time; otherwise through glm
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#include <immintrin.h>
+#define BUFFER_F16C 1
+#endif
+
+namespace
+{
+
+// Pixels are converted in spans of this many, through a staging array on the stack
+const int ConvertSpan = 64;
+
+void floats_to_half(const float* pSource, uint16_t* pTarget, int count)
+{
+    int i = 0;
+#ifdef BUFFER_F16C
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i packed = _mm_cvtps_ph(_mm_loadu_ps(pSource + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storel_epi64((__m128i*)(pTarget + i), packed);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        pTarget[i] = glm::packHalf1x16(pSource[i]);
+    }
+}
+
+void half_to_floats(const uint16_t* pSource, float* pTarget, int count)
+{
+    int i = 0;
+#ifdef BUFFER_F16C
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(pTarget + i, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(pSource + i))));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        pTarget[i] = glm::unpackHalf1x16(pSource[i]);
+    }
+}
+
+float float_from_bits(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+uint32_t bits_from_float(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// The shared exponent encoding of EXT_texture_shared_exponent.  The powers of 2 are built from the float bits,
+// rather than with log2 and pow as glm does
+uint32_t pack_rgb9e5(const glm::vec4& color)
+{
+    const float MaxValue = 65408.0f;                        // 511/512 * 2^16
+    float r = std::min(std::max(color.r, 0.0f), MaxValue);
+    float g = std::min(std::max(color.g, 0.0f), MaxValue);
+    float b = std::min(std::max(color.b, 0.0f), MaxValue);
+    float maxChannel = std::max(std::max(r, g), b);
+
+    // Exponent is the biased exponent of the largest channel, plus one for the 9 bit mantissa; at most 31
+    int exponent = std::max(-16, int((bits_from_float(maxChannel) >> 23) & 0xff) - 127) + 16;
+    float scale = float_from_bits(uint32_t(127 + 24 - exponent) << 23);
+    if (uint32_t(maxChannel * scale + 0.5f) == 512)
+    {
+        exponent++;
+        scale *= 0.5f;
+    }
+
+    return uint32_t(r * scale + 0.5f) |
+        (uint32_t(g * scale + 0.5f) << 9) |
+        (uint32_t(b * scale + 0.5f) << 18) |
+        (uint32_t(exponent) << 27);
+}
+
+glm::vec4 unpack_rgb9e5(uint32_t packed)
+{
+    float scale = float_from_bits(uint32_t(127 + int(packed >> 27) - 24) << 23);
+    return glm::vec4(float(packed & 0x1ff) * scale,
+        float((packed >> 9) & 0x1ff) * scale,
+        float((packed >> 18) & 0x1ff) * scale,
+        1.0f);
+}
+
+// A field of a TIFF directory
+struct TiffField
+{
+    uint16_t tag;
+    uint16_t type;                                          // 3 for SHORT, 4 for LONG, 16 for LONG8
+    std::vector<uint64_t> values;
+};
+
+size_t tiff_type_size(uint16_t type)
+{
+    return type == 3 ? 2 : type == 4 ? 4 : 8;
+}
+
+void tiff_put(std::vector<uint8_t>& out, size_t offset, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        out[offset + i] = uint8_t(value >> (i * 8));
+    }
+}
+
+// The TIFF header for a buffer's pixels, which follow it in the file: a single directory of little endian fields,
+// padded to a page, so the pixels are page aligned.  The rows are split into contiguous strips of about a megabyte,
+// so readers needn't take a huge image in one piece
+std::vector<uint8_t> tiff_header(int width, int height, BufferFormat format)
+{
+    uint64_t samples = format == BufferFormat::RGBA32F ? 4 : 3;
+    uint64_t bits = format == BufferFormat::RGB16F ? 16 : 32;
+    uint64_t rowBytes = uint64_t(width) * device_buffer_pixel_size(format);
+    uint64_t rowsPerStrip = std::min(uint64_t(height), std::max(uint64_t(1), (uint64_t(1) << 20) / rowBytes));
+    uint64_t strips = (uint64_t(height) + rowsPerStrip - 1) / rowsPerStrip;
+
+    // Classic TIFF offsets are 32 bit; leave plenty of room for the header
+    bool bigTiff = rowBytes * height + (uint64_t(1) << 24) > 0xffffffffull;
+    uint16_t offsetType = bigTiff ? 16 : 4;
+
+    std::vector<TiffField> fields = {
+        { 256, 4, { uint64_t(width) } },                    // ImageWidth
+        { 257, 4, { uint64_t(height) } },                   // ImageLength
+        { 258, 3, std::vector<uint64_t>(samples, bits) },   // BitsPerSample
+        { 259, 3, { 1 } },                                  // Compression: none
+        { 262, 3, { 2 } },                                  // PhotometricInterpretation: RGB
+        { 273, offsetType, std::vector<uint64_t>(strips) }, // StripOffsets, filled in below
+        { 277, 3, { samples } },                            // SamplesPerPixel
+        { 278, 4, { rowsPerStrip } },                       // RowsPerStrip
+        { 279, 4, std::vector<uint64_t>(strips) },          // StripByteCounts
+        { 284, 3, { 1 } },                                  // PlanarConfiguration: interleaved
+    };
+    if (samples == 4)
+    {
+        fields.push_back({ 338, 3, { 2 } });                // ExtraSamples: unassociated alpha
+    }
+    fields.push_back({ 339, 3, std::vector<uint64_t>(samples, 3) }); // SampleFormat: IEEE float
+
+    // Values that don't fit in their field go after the directory
+    size_t headerSize = bigTiff ? 16 : 8;
+    size_t entrySize = bigTiff ? 20 : 12;
+    size_t inlineSize = bigTiff ? 8 : 4;
+    size_t countSize = bigTiff ? 8 : 2;
+    size_t directoryEnd = headerSize + countSize + fields.size() * entrySize + inlineSize;
+    std::vector<size_t> valueOffsets(fields.size(), 0);
+    size_t end = directoryEnd;
+    for (size_t field = 0; field < fields.size(); field++)
+    {
+        size_t bytes = fields[field].values.size() * tiff_type_size(fields[field].type);
+        if (bytes > inlineSize)
+        {
+            valueOffsets[field] = end;
+            end += (bytes + 7) & ~size_t(7);
+        }
+    }
+    size_t dataOffset = (end + 4095) & ~size_t(4095);
+
+    for (uint64_t strip = 0; strip < strips; strip++)
+    {
+        uint64_t rows = std::min(rowsPerStrip, uint64_t(height) - strip * rowsPerStrip);
+        fields[5].values[strip] = dataOffset + strip * rowsPerStrip * rowBytes;
+        fields[8].values[strip] = rows * rowBytes;
+    }
+
+    std::vector<uint8_t> header(dataOffset, 0);
+    header[0] = 'I';
+    header[1] = 'I';
+    if (bigTiff)
+    {
+        tiff_put(header, 2, 43, 2);
+        tiff_put(header, 4, 8, 2);
+        tiff_put(header, 8, headerSize, 8);
+    }
+    else
+    {
+        tiff_put(header, 2, 42, 2);
+        tiff_put(header, 4, headerSize, 4);
+    }
+
+    tiff_put(header, headerSize, fields.size(), countSize);
+    for (size_t field = 0; field < fields.size(); field++)
+    {
+        const TiffField& f = fields[field];
+        size_t entry = headerSize + countSize + field * entrySize;
+        size_t typeSize = tiff_type_size(f.type);
+        tiff_put(header, entry, f.tag, 2);
+        tiff_put(header, entry + 2, f.type, 2);
+        tiff_put(header, entry + 4, f.values.size(), bigTiff ? 8 : 4);
+
+        size_t valueField = entry + 4 + (bigTiff ? 8 : 4);
+        size_t valueOffset = valueOffsets[field] ? valueOffsets[field] : valueField;
+        if (valueOffsets[field])
+        {
+            tiff_put(header, valueField, valueOffsets[field], inlineSize);
+        }
+        for (size_t value = 0; value < f.values.size(); value++)
+        {
+            tiff_put(header, valueOffset + value * typeSize, f.values[value], typeSize);
+        }
+    }
+    return header;
+}
+
+}
+
+// Where a mapped buffer's pixels live
+struct BufferMapping
+{
+    std::string path;
+    MappedFile* pFile = nullptr;
+};
+
+namespace
+{
+
+// Give a buffer pixels for its size and format, from its file if it is mapped, and from the heap if not.  A mapping
+// that fails is dropped, so the buffer carries on in memory
+void buffer_allocate(BufferData* pData)
+{
+    size_t size = device_buffer_pixel_size(pData->format) * pData->BufferHeight * pData->BufferWidth;
+    if (pData->pMapping && size != 0)
+    {
+        BufferMapping* pMapping = pData->pMapping;
+        std::vector<uint8_t> header = tiff_header(pData->BufferWidth, pData->BufferHeight, pData->format);
+        if (pData->format != BufferFormat::RGB9E5)
+        {
+            pMapping->pFile = mapped_file_create(pMapping->path.c_str(), header.size() + size);
+        }
+        if (pMapping->pFile)
+        {
+            memcpy(pMapping->pFile->pData, header.data(), header.size());
+            pData->pPixels = (uint8_t*)pMapping->pFile->pData + header.size();
+        }
+        else
+        {
+            device_log(("Failed to map " + pMapping->path + "; the pixels are kept in memory").c_str());
+            delete pMapping;
+            pData->pMapping = nullptr;
+        }
+    }
+
+    if (!pData->pPixels)
+    {
+        pData->pPixels = malloc(size);
+    }
+    pData->buffer = pData->format == BufferFormat::RGBA32F ? (glm::vec4*)pData->pPixels : nullptr;
+}
+
+void buffer_release(BufferData* pData)
+{
+    if (pData->pMapping)
+    {
+        mapped_file_close(pData->pMapping->pFile);
+        pData->pMapping->pFile = nullptr;
+    }
+    else
+    {
+        free(pData->pPixels);
+    }
+    pData->pPixels = nullptr;
+    pData->buffer = nullptr;
+}
+
+BufferData* buffer_new(BufferFormat format, BufferMapping* pMapping, int width, int height)
+{
+    auto pBuffer = (BufferData*)malloc(sizeof(BufferData));
+    pBuffer->buffer = nullptr;
+    pBuffer->pPixels = nullptr;
+    pBuffer->pMapping = pMapping;
+    pBuffer->format = format;
+    pBuffer->BufferWidth = 0;
+    pBuffer->BufferHeight = 0;
+
+    if (width == 0 || height == 0)
+    {
+        device_buffer_ensure_screen_size(pBuffer);
+    }
+    else
+    {
+        device_buffer_resize(pBuffer, width, height);
+    }
+    return pBuffer;
+}
+
+}
+
+size_t device_buffer_pixel_size(BufferFormat format)
+{
+    switch (format)
+    {
+    case BufferFormat::RGB32F:
+        return sizeof(glm::vec3);
+    case BufferFormat::RGB16F:
+        return sizeof(uint16_t) * 3;
+    case BufferFormat::RGB9E5:
+        return sizeof(uint32_t);
+    default:
+        return sizeof(glm::vec4);
+    }
+}
+
+BufferData* device_buffer_create(int width, int height, BufferFormat format)
+{
+    return buffer_new(format, nullptr, width, height);
+}
+
+BufferData* device_buffer_map(const char* pPath, int width, int height, BufferFormat format)
+{
+    if (format == BufferFormat::RGB9E5)
+    {
+        device_log("RGB9E5 buffers can't be mapped to a file");
+        return nullptr;
+    }
+
+    auto pMapping = new BufferMapping;
+    pMapping->path = pPath;
+    BufferData* pBuffer = buffer_new(format, pMapping, width, height);
+    if (!pBuffer->pMapping)
+    {
+        device_buffer_destroy(pBuffer);
+        return nullptr;
+    }
+    return pBuffer;
+}
+
+void device_buffer_destroy(BufferData* pBuffer)
+{
+    if (!pBuffer)
+    {
+        return;
+    }
+    buffer_release(pBuffer);
+    delete pBuffer->pMapping;
+    free(pBuffer);
+}
+
+void device_buffer_resize(BufferData* pData, int width, int height)
+{
+    if (pData->pPixels == nullptr ||
+        pData->BufferWidth != width ||
+        pData->BufferHeight != height)
+    {
+        pData->BufferHeight = height;
+        pData->BufferWidth = width;
+        buffer_release(pData);
+        buffer_allocate(pData);
+    }
+}
+
+void device_buffer_copy(BufferData* pTarget, const BufferData* pSource)
+{
+    if (pTarget->format != pSource->format)
+    {
+        buffer_release(pTarget);
+        pTarget->format = pSource->format;
+    }
+    device_buffer_resize(pTarget, pSource->BufferWidth, pSource->BufferHeight);
+    memcpy(pTarget->pPixels, pSource->pPixels, device_buffer_pixel_size(pSource->format) * pSource->BufferWidth * pSource->BufferHeight);
+}
+
+void device_buffer_read(const BufferData* pData, int x, int y, int count, glm::vec4* pTarget)
+{
+    size_t first = size_t(y) * pData->BufferWidth + x;
+    switch (pData->format)
+    {
+    case BufferFormat::RGBA32F:
+        memcpy(pTarget, (const glm::vec4*)pData->pPixels + first, sizeof(glm::vec4) * count);
+        break;
+    case BufferFormat::RGB32F:
+    {
+        auto pSource = (const glm::vec3*)pData->pPixels + first;
+        for (int i = 0; i < count; i++)
+        {
+            pTarget[i] = glm::vec4(pSource[i], 1.0f);
+        }
+        break;
+    }
+    case BufferFormat::RGB16F:
+    {
+        auto pSource = (const uint16_t*)pData->pPixels + first * 3;
+        float rgb[ConvertSpan * 3];
+        for (int span = 0; span < count; span += ConvertSpan)
+        {
+            int spanCount = std::min(ConvertSpan, count - span);
+            half_to_floats(pSource + span * 3, rgb, spanCount * 3);
+            for (int i = 0; i < spanCount; i++)
+            {
+                pTarget[span + i] = glm::vec4(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2], 1.0f);
+            }
+        }
+        break;
+    }
+    case BufferFormat::RGB9E5:
+    {
+        auto pSource = (const uint32_t*)pData->pPixels + first;
+        for (int i = 0; i < count; i++)
+        {
+            pTarget[i] = unpack_rgb9e5(pSource[i]);
+        }
+        break;
+    }
+    }
+}
+
+void device_buffer_write(BufferData* pData, int x, int y, int count, const glm::vec4* pSource)
+{
+    size_t first = size_t(y) * pData->BufferWidth + x;
+    switch (pData->format)
+    {
+    case BufferFormat::RGBA32F:
+        memcpy((glm::vec4*)pData->pPixels + first, pSource, sizeof(glm::vec4) * count);
+        break;
+    case BufferFormat::RGB32F:
+    {
+        auto pTarget = (glm::vec3*)pData->pPixels + first;
+        for (int i = 0; i < count; i++)
+        {
+            pTarget[i] = glm::vec3(pSource[i]);
+        }
+        break;
+    }
+    case BufferFormat::RGB16F:
+    {
+        auto pTarget = (uint16_t*)pData->pPixels + first * 3;
+        float rgb[ConvertSpan * 3];
+        for (int span = 0; span < count; span += ConvertSpan)
+        {
+            int spanCount = std::min(ConvertSpan, count - span);
+            for (int i = 0; i < spanCount; i++)
+            {
+                rgb[i * 3] = pSource[span + i].r;
+                rgb[i * 3 + 1] = pSource[span + i].g;
+                rgb[i * 3 + 2] = pSource[span + i].b;
+            }
+            floats_to_half(rgb, pTarget + span * 3, spanCount * 3);
+        }
+        break;
+    }
+    case BufferFormat::RGB9E5:
+    {
+        auto pTarget = (uint32_t*)pData->pPixels + first;
+        for (int i = 0; i < count; i++)
+        {
+            pTarget[i] = pack_rgb9e5(pSource[i]);
+        }
+        break;
+    }
+    }
+}
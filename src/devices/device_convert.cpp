@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#include "device.h"
+#include "thread_pool.h"
+
+// Conversion of float buffers to 8 bit pixels, for the display and for image files.
+// Pixels are clamped, optionally tonemapped and sRGB encoded, rounded and swizzled 4 at a time with SSE2, or 8 at
+// a time with AVX2.  The sRGB curve is a table lookup; AVX2 gathers from it.  Buffers that aren't RGBA32F are
+// decoded a span at a time first.  Bands of rows are spread over the device's thread pool, when the conversion is
+// on the thread that lent it; background threads convert on their own
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CONVERT_AVX2 1
+#define CONVERT_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CONVERT_SSE2 1
+#endif
+
+namespace
+{
+
+const int ConvertSpan = 64;                                 // Pixels converted at a time, through the stack
+const int ConvertRows = 16;                                 // Rows in each job given to the thread pool
+const int EncodeTableSize = 16384;                          // Steps of the linear value in each curve of the table
+
+std::shared_ptr<ThreadPool> spConvertPool;
+std::thread::id convertPoolThread;                          // The thread that lent the pool, and may use it
+
+// The 8 bit value for each step of the linear value: the sRGB curve, then a straight line for alpha, which is never
+// encoded.  Padded so that a 32 bit gather from the last entry stays inside
+struct EncodeTable
+{
+    uint8_t values[EncodeTableSize * 2 + 4];
+
+    EncodeTable()
+    {
+        for (int i = 0; i < EncodeTableSize; i++)
+        {
+            float linear = i / float(EncodeTableSize - 1);
+            float srgb = linear <= 0.0031308f ? linear * 12.92f : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+            values[i] = uint8_t(srgb * 255.0f + 0.5f);
+            values[EncodeTableSize + i] = uint8_t(linear * 255.0f + 0.5f);
+        }
+        memset(values + EncodeTableSize * 2, 0, 4);
+    }
+};
+
+const EncodeTable& encode_table()
+{
+    static EncodeTable table;
+    return table;
+}
+
+// One pixel; the reference the SIMD versions must match.  The clamps are written the way max_ps and min_ps
+// compare, so a NaN becomes 0 before tonemapping and 1 after it, as it does there
+template<PixelEncoding Encoding, bool Swap>
+void encode_pixel(const glm::vec4& source, uint8_t* pTarget, const uint8_t* pTable)
+{
+    glm::vec4 value;
+    for (int channel = 0; channel < 4; channel++)
+    {
+        value[channel] = source[channel] > 0.0f ? source[channel] : 0.0f;
+    }
+    if (Encoding == PixelEncoding::Tonemap)
+    {
+        value = glm::vec4(glm::vec3(value) / (glm::vec3(value) + 1.0f), value.a);
+    }
+    for (int channel = 0; channel < 4; channel++)
+    {
+        value[channel] = value[channel] < 1.0f ? value[channel] : 1.0f;
+    }
+
+    uint8_t channels[4];
+    for (int channel = 0; channel < 4; channel++)
+    {
+        if (Encoding == PixelEncoding::Linear)
+        {
+            channels[channel] = uint8_t(value[channel] * 255.0f + 0.5f);
+        }
+        else
+        {
+            int index = int(value[channel] * float(EncodeTableSize - 1) + 0.5f);
+            channels[channel] = pTable[index + (channel == 3 ? EncodeTableSize : 0)];
+        }
+    }
+
+    pTarget[0] = channels[Swap ? 2 : 0];
+    pTarget[1] = channels[1];
+    pTarget[2] = channels[Swap ? 0 : 2];
+    pTarget[3] = channels[3];
+}
+
+#ifdef CONVERT_SSE2
+// One pixel to 4 ints in the target order
+template<PixelEncoding Encoding, bool Swap>
+__m128i encode_pixel_sse2(__m128 value, const uint8_t* pTable)
+{
+    if (Swap)
+    {
+        value = _mm_shuffle_ps(value, value, _MM_SHUFFLE(3, 0, 1, 2));
+    }
+    value = _mm_max_ps(value, _mm_setzero_ps());
+    if (Encoding == PixelEncoding::Tonemap)
+    {
+        const __m128 colorMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+        __m128 mapped = _mm_div_ps(value, _mm_add_ps(value, _mm_set1_ps(1.0f)));
+        value = _mm_or_ps(_mm_and_ps(colorMask, mapped), _mm_andnot_ps(colorMask, value));
+    }
+    value = _mm_min_ps(value, _mm_set1_ps(1.0f));
+
+    if (Encoding == PixelEncoding::Linear)
+    {
+        return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f)));
+    }
+
+    __m128i index = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, _mm_set1_ps(float(EncodeTableSize - 1))), _mm_set1_ps(0.5f)));
+    index = _mm_add_epi32(index, _mm_set_epi32(EncodeTableSize, 0, 0, 0));
+    alignas(16) int32_t indices[4];
+    _mm_store_si128((__m128i*)indices, index);
+    return _mm_set_epi32(pTable[indices[3]], pTable[indices[2]], pTable[indices[1]], pTable[indices[0]]);
+}
+#endif
+
+#ifdef CONVERT_AVX2
+// Two pixels, one in each 128 bit lane, to 4 ints each
+template<PixelEncoding Encoding, bool Swap>
+__m256i encode_pixels_avx2(__m256 value, const uint8_t* pTable)
+{
+    if (Swap)
+    {
+        value = _mm256_shuffle_ps(value, value, _MM_SHUFFLE(3, 0, 1, 2));
+    }
+    value = _mm256_max_ps(value, _mm256_setzero_ps());
+    if (Encoding == PixelEncoding::Tonemap)
+    {
+        __m256 mapped = _mm256_div_ps(value, _mm256_add_ps(value, _mm256_set1_ps(1.0f)));
+        value = _mm256_blend_ps(mapped, value, 0x88);
+    }
+    value = _mm256_min_ps(value, _mm256_set1_ps(1.0f));
+
+    if (Encoding == PixelEncoding::Linear)
+    {
+        return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(value, _mm256_set1_ps(255.0f)), _mm256_set1_ps(0.5f)));
+    }
+
+    __m256i index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(value, _mm256_set1_ps(float(EncodeTableSize - 1))), _mm256_set1_ps(0.5f)));
+    index = _mm256_add_epi32(index, _mm256_set_epi32(EncodeTableSize, 0, 0, 0, EncodeTableSize, 0, 0, 0));
+    __m256i gathered = _mm256_i32gather_epi32((const int*)pTable, index, 1);
+    return _mm256_and_si256(gathered, _mm256_set1_epi32(0xff));
+}
+#endif
+
+// 'count' pixels to 4 bytes each
+template<PixelEncoding Encoding, bool Swap>
+void encode_span(const glm::vec4* pSource, int count, uint8_t* pTarget)
+{
+    const uint8_t* pTable = encode_table().values;
+    const float* pFloats = (const float*)pSource;
+    int i = 0;
+#ifdef CONVERT_AVX2
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i p01 = encode_pixels_avx2<Encoding, Swap>(_mm256_loadu_ps(pFloats + i * 4), pTable);
+        __m256i p23 = encode_pixels_avx2<Encoding, Swap>(_mm256_loadu_ps(pFloats + i * 4 + 8), pTable);
+        __m256i p45 = encode_pixels_avx2<Encoding, Swap>(_mm256_loadu_ps(pFloats + i * 4 + 16), pTable);
+        __m256i p67 = encode_pixels_avx2<Encoding, Swap>(_mm256_loadu_ps(pFloats + i * 4 + 24), pTable);
+
+        // The packs work within lanes, leaving pixels 0 2 4 6 in the low lane and 1 3 5 7 in the high one
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(p01, p23), _mm256_packs_epi32(p45, p67));
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        _mm256_storeu_si256((__m256i*)(pTarget + i * 4), packed);
+    }
+#endif
+#ifdef CONVERT_SSE2
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i p0 = encode_pixel_sse2<Encoding, Swap>(_mm_loadu_ps(pFloats + i * 4), pTable);
+        __m128i p1 = encode_pixel_sse2<Encoding, Swap>(_mm_loadu_ps(pFloats + i * 4 + 4), pTable);
+        __m128i p2 = encode_pixel_sse2<Encoding, Swap>(_mm_loadu_ps(pFloats + i * 4 + 8), pTable);
+        __m128i p3 = encode_pixel_sse2<Encoding, Swap>(_mm_loadu_ps(pFloats + i * 4 + 12), pTable);
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+        _mm_storeu_si128((__m128i*)(pTarget + i * 4), packed);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        encode_pixel<Encoding, Swap>(pSource[i], pTarget + i * 4, pTable);
+    }
+}
+
+template<PixelEncoding Encoding>
+void encode_span(const glm::vec4* pSource, int count, uint8_t* pTarget, bool swap)
+{
+    if (swap)
+    {
+        encode_span<Encoding, true>(pSource, count, pTarget);
+    }
+    else
+    {
+        encode_span<Encoding, false>(pSource, count, pTarget);
+    }
+}
+
+void convert_rows(const BufferData* pData, int firstRow, int endRow, uint8_t* pTarget, int stride, PixelLayout layout, PixelEncoding encoding)
+{
+    glm::vec4 decoded[ConvertSpan];
+    uint8_t encoded[ConvertSpan * 4];
+    bool swap = layout != PixelLayout::RGB8;
+    for (int y = firstRow; y < endRow; y++)
+    {
+        uint8_t* pRow = pTarget + size_t(y) * stride;
+        for (int x = 0; x < pData->BufferWidth; x += ConvertSpan)
+        {
+            int count = std::min(ConvertSpan, pData->BufferWidth - x);
+            const glm::vec4* pSource = decoded;
+            if (pData->buffer)
+            {
+                pSource = pData->buffer + size_t(y) * pData->BufferWidth + x;
+            }
+            else
+            {
+                device_buffer_read(pData, x, y, count, decoded);
+            }
+
+            // 4 byte pixels go straight to the row; 3 byte ones are packed down from the staging span
+            uint8_t* pEncoded = layout == PixelLayout::BGRA8 ? pRow + x * 4 : encoded;
+            switch (encoding)
+            {
+            case PixelEncoding::Linear:
+                encode_span<PixelEncoding::Linear>(pSource, count, pEncoded, swap);
+                break;
+            case PixelEncoding::SRGB:
+                encode_span<PixelEncoding::SRGB>(pSource, count, pEncoded, swap);
+                break;
+            case PixelEncoding::Tonemap:
+                encode_span<PixelEncoding::Tonemap>(pSource, count, pEncoded, swap);
+                break;
+            }
+
+            if (layout != PixelLayout::BGRA8)
+            {
+                uint8_t* pPacked = pRow + x * 3;
+                for (int i = 0; i < count; i++)
+                {
+                    pPacked[i * 3] = encoded[i * 4];
+                    pPacked[i * 3 + 1] = encoded[i * 4 + 1];
+                    pPacked[i * 3 + 2] = encoded[i * 4 + 2];
+                }
+            }
+        }
+    }
+}
+
+}
+
+void device_set_thread_pool(const std::shared_ptr<ThreadPool>& spPool)
+{
+    spConvertPool = spPool;
+    convertPoolThread = std::this_thread::get_id();
+}
+
+void device_buffer_convert(const BufferData* pData, uint8_t* pTarget, int stride, PixelLayout layout, PixelEncoding encoding)
+{
+    int bands = (pData->BufferHeight + ConvertRows - 1) / ConvertRows;
+    if (!spConvertPool || bands < 2 || std::this_thread::get_id() != convertPoolThread)
+    {
+        convert_rows(pData, 0, pData->BufferHeight, pTarget, stride, layout, encoding);
+        return;
+    }
+
+    spConvertPool->ParallelFor(uint32_t(bands), [&](uint32_t band)
+    {
+        int firstRow = int(band) * ConvertRows;
+        convert_rows(pData, firstRow, std::min(firstRow + ConvertRows, pData->BufferHeight), pTarget, stride, layout, encoding);
+    });
+}
+
+void device_buffer_to_bgra8(const BufferData* pData, uint8_t* pTarget, int stride)
+{
+    device_buffer_convert(pData, pTarget, stride, PixelLayout::BGRA8, deviceParams.encoding);
+}
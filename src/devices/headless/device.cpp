@@ -0,0 +1,255 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "device.h"
+#include "render.h"
+#include "image_writer.h"
+#include "frame_recorder.h"
+#include "frame_stats.h"
+#include "remote_workers.h"
+
+// A device with no window, for rendering on servers.
+// It runs the sample for a fixed number of frames at a fixed size, then writes the last frame it was shown to a file;
+// the extension of the file picks its format, from .bmp, .ppm, .pfm and .png.
+//
+// The frame stats are logged every --stats-interval seconds, and summed up at the end.
+// --record writes every frame to a Y4M stream, raw RGB, or numbered images; see frame_recorder_settings.  Frames are
+// dropped if the writer can't keep up, unless --record-wait is given.
+// --map asks the sample to render straight into a float TIFF, mapped into memory; see device_buffer_map.  For renders
+// too big to hold twice, or at all: nothing is copied for the display, and nothing is written at the end unless
+// --output is given too.  Samples that can't render into a file are written to --output as usual.
+// Samples that save their progress, like the raytracer, only do so with --checkpoint, so a render is never quietly
+// resumed from an earlier one; --checkpoint off turns it off again.
+// --workers starts worker processes on this machine, and --listen takes workers from other machines, started there
+// with --worker coordinator:port; the samples that can share each frame out between them.  See remote_workers.h.
+//
+// usage: <sample> [--width 640] [--height 480] [--frames 1] [--output out.bmp] [--stats-interval 1] [--record out.y4m] [--record-wait]
+//     [--map out.tif] [--checkpoint path|off] [--workers 4] [--listen 7878] [--worker host:port]
+namespace
+{
+int displayWidth = 640;
+int displayHeight = 480;
+BufferData* pDisplayBuffer = nullptr;                       // Copy of the last buffer set to the display, in its format
+const BufferData* pMappedDisplay = nullptr;                 // or the last one, if it was a mapped buffer
+}
+
+DeviceParams deviceParams;
+
+void device_buffer_ensure_screen_size(BufferData* pData)
+{
+    device_buffer_resize(pData, displayWidth, displayHeight);
+}
+
+void device_buffer_set_to_display(BufferData* data)
+{
+    FrameStageTimer timer(FrameStage::Display);
+    frame_stats_count(FrameCounter::Pixels, uint64_t(data->BufferWidth) * data->BufferHeight);
+    frame_recorder_capture(data);
+
+    // The pixels of a mapped buffer are already where they are going, and may not fit in memory again
+    if (data->pMapping)
+    {
+        pMappedDisplay = data;
+        return;
+    }
+    pMappedDisplay = nullptr;
+    if (!pDisplayBuffer)
+    {
+        pDisplayBuffer = device_buffer_create(data->BufferWidth, data->BufferHeight, data->format);
+    }
+    device_buffer_copy(pDisplayBuffer, data);
+}
+
+bool device_is_key_down(DeviceKeyType type)
+{
+    return false;
+}
+
+void device_log(const char* pText)
+{
+    fprintf(stderr, "%s\n", pText);
+}
+
+int main(int argc, char** argv)
+{
+    int frames = 1;
+    std::string output = "out.bmp";
+    bool outputGiven = false;
+    std::string map;
+    std::string checkpoint;
+    int workers = 0;
+    int listenPort = 0;
+    std::string worker;
+    std::string record;
+    bool recordWait = false;
+    for (int arg = 1; arg < argc; arg++)
+    {
+        bool hasValue = arg + 1 < argc;
+        if (strcmp(argv[arg], "--width") == 0 && hasValue)
+        {
+            displayWidth = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--height") == 0 && hasValue)
+        {
+            displayHeight = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--frames") == 0 && hasValue)
+        {
+            frames = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--output") == 0 && hasValue)
+        {
+            output = argv[++arg];
+            outputGiven = true;
+        }
+        else if (strcmp(argv[arg], "--stats-interval") == 0 && hasValue)
+        {
+            frame_stats_set_log_interval(float(atof(argv[++arg])));
+        }
+        else if (strcmp(argv[arg], "--record") == 0 && hasValue)
+        {
+            record = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--record-wait") == 0)
+        {
+            recordWait = true;
+        }
+        else if (strcmp(argv[arg], "--map") == 0 && hasValue)
+        {
+            map = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--checkpoint") == 0 && hasValue)
+        {
+            checkpoint = argv[++arg];
+            if (checkpoint == "off")
+            {
+                checkpoint.clear();
+            }
+        }
+        else if (strcmp(argv[arg], "--workers") == 0 && hasValue)
+        {
+            workers = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--listen") == 0 && hasValue)
+        {
+            listenPort = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--worker") == 0 && hasValue)
+        {
+            worker = argv[++arg];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--width 640] [--height 480] [--frames 1] [--output out.bmp] [--stats-interval 1] [--record out.y4m] [--record-wait] [--map out.tif]"
+                " [--checkpoint path|off] [--workers 4] [--listen 7878] [--worker host:port]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (displayWidth <= 0 || displayHeight <= 0 || frames <= 0)
+    {
+        fprintf(stderr, "Width, height and frames must be at least 1\n");
+        return 1;
+    }
+    if (workers < 0 || listenPort < 0 || listenPort > 65535)
+    {
+        fprintf(stderr, "Workers and the port can't be negative, and the port must be under 65536\n");
+        return 1;
+    }
+
+    deviceParams.pCheckpointPath = checkpoint.c_str();
+
+    // A worker only answers the coordinator's requests, until it goes away
+    if (!worker.empty())
+    {
+        render_init();
+        int result = remote_worker_serve(worker.c_str()) ? 0 : 1;
+        render_destroy();
+        return result;
+    }
+
+    if (!map.empty())
+    {
+        deviceParams.pMappedOutput = map.c_str();
+    }
+
+    render_init();
+    render_resized(displayWidth, displayHeight);
+
+    if (workers > 0 || listenPort > 0)
+    {
+        if (!remote_workers_listen(uint16_t(listenPort)) ||
+            !remote_workers_spawn(uint32_t(workers), argv[0]))
+        {
+            remote_workers_stop();
+            return 1;
+        }
+
+        // Local workers are waited for, so every frame is shared the same way; remote ones join when they can
+        if (remote_workers_wait(uint32_t(workers), 10.0f) < uint32_t(workers))
+        {
+            fprintf(stderr, "Only %u of %d workers started\n", remote_workers_count(), workers);
+        }
+    }
+
+    if (!record.empty())
+    {
+        RecordSettings settings = frame_recorder_settings(record.c_str());
+        settings.overflow = recordWait ? RecordOverflow::Wait : RecordOverflow::Drop;
+        if (!frame_recorder_start(settings))
+        {
+            remote_workers_stop();
+            return 1;
+        }
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        {
+            FrameStageTimer timer(FrameStage::Update);
+            render_update();
+        }
+        {
+            FrameStageTimer timer(FrameStage::Redraw);
+            render_redraw();
+        }
+        frame_stats_end_frame();
+    }
+    float milliseconds = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    frame_recorder_stop();
+    remote_workers_stop();
+    printf("%s: %d frames of %dx%d in %.1fms, %.2fms per frame\n", deviceParams.pName, frames, displayWidth, displayHeight, milliseconds, milliseconds / frames);
+    printf("%s\n", frame_stats_report(frame_stats_total()).c_str());
+
+    int result = 0;
+    const BufferData* pShown = pMappedDisplay ? pMappedDisplay : pDisplayBuffer;
+    if (!pShown)
+    {
+        fprintf(stderr, "Nothing was displayed\n");
+        result = 1;
+    }
+    else if (pMappedDisplay && !outputGiven)
+    {
+        printf("Rendered into %s\n", map.c_str());
+    }
+    else
+    {
+        if (!map.empty() && !pMappedDisplay)
+        {
+            fprintf(stderr, "%s doesn't render into a mapped file; writing %s instead\n", deviceParams.pName, output.c_str());
+        }
+        if (!image_write(pShown, output.c_str()))
+        {
+            fprintf(stderr, "Failed to write %s\n", output.c_str());
+            result = 1;
+        }
+    }
+
+    device_buffer_destroy(pDisplayBuffer);
+    render_destroy();
+    return result;
+}
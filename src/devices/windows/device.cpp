@@ -13,6 +13,8 @@ using namespace Gdiplus;
 
 #include "device.h"
 #include "render.h"
+#include "frame_stats.h"
+#include "frame_recorder.h"
 
 namespace
 {
@@ -22,81 +24,32 @@ std::shared_ptr<Bitmap> spDisplayBitmap;
 
 DeviceParams deviceParams;
 
-BufferData* device_buffer_create(int width, int height)
-{
-    auto pBuffer = (BufferData*)malloc(sizeof(BufferData));
-    pBuffer->buffer = nullptr;
-    pBuffer->BufferWidth = 0;
-    pBuffer->BufferHeight = 0;
-
-    if (width == 0 || height == 0)
-    {
-        device_buffer_ensure_screen_size(pBuffer);
-    }
-    else
-    {
-        device_buffer_resize(pBuffer, width, height);
-    }
-    return pBuffer;
-}
-
-void device_buffer_destroy(BufferData* pBuffer)
-{
-    free(pBuffer->buffer);
-    free(pBuffer);
-}
-
 void device_buffer_ensure_screen_size(BufferData* pData)
 {
     if (pData->BufferHeight != spDisplayBitmap->GetHeight() ||
         pData->BufferWidth != spDisplayBitmap->GetWidth() ||
-        pData->buffer == nullptr)
+        pData->pPixels == nullptr)
     {
         device_buffer_resize(pData, spDisplayBitmap->GetWidth(), spDisplayBitmap->GetHeight());
     }
 }
 
-void device_buffer_resize(BufferData* pData, int width, int height)
-{
-    if (pData->buffer == nullptr ||
-        pData->BufferWidth != width ||
-        pData->BufferHeight != height)
-    {
-        pData->BufferHeight = height;
-        pData->BufferWidth = width;
-        if (pData->buffer)
-        {
-            free(pData->buffer);
-        }
-        pData->buffer = (glm::vec4*)malloc(sizeof(glm::vec4) * pData->BufferHeight * pData->BufferWidth);
-    }
-}
-
 void device_buffer_set_to_display(BufferData* data)
 {
+    FrameStageTimer timer(FrameStage::Display);
+    frame_stats_count(FrameCounter::Pixels, uint64_t(data->BufferWidth) * data->BufferHeight);
     if (spDisplayBitmap)
     {
         BitmapData writeData;
         Rect lockRect(0, 0, data->BufferWidth, data->BufferHeight);
         if (spDisplayBitmap->LockBits(&lockRect, ImageLockModeWrite, PixelFormat32bppARGB, &writeData) == 0)
         {
-            for (int y = 0; y < int(writeData.Height); y++)
-            {
-                for (auto x = 0; x < int(writeData.Width); x++)
-                {
-                    glm::u8vec4* pTarget = (glm::u8vec4*)((uint8_t*)writeData.Scan0 + (y * writeData.Stride) + (x * 4));
-                    glm::vec4 source = data->buffer[(y * data->BufferWidth) + x];
-                    source = glm::clamp(source, glm::vec4(0.0f), glm::vec4(1.0f));
-
-                    glm::u8vec4 val = glm::u8vec4(source * 255.0f);
-                    *pTarget = glm::u8vec4(val.z, val.y, val.x, val.w);
-                }
-            }
-
+            device_buffer_to_bgra8(data, (uint8_t*)writeData.Scan0, writeData.Stride);
             spDisplayBitmap->UnlockBits(&writeData);
         }
     }
     InvalidateRect(hWnd, NULL, TRUE);
+    frame_recorder_capture(data);
 }
 
 VOID OnPaint(HDC hdc)
@@ -153,6 +106,12 @@ bool device_is_key_down(DeviceKeyType type)
     return false;
 }
 
+void device_log(const char* pText)
+{
+    OutputDebugStringA(pText);
+    OutputDebugStringA("\n");
+}
+
 //  SetWindowTextA(hWnd, std::to_string(currentSample).c_str());
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message,
     WPARAM wParam, LPARAM lParam)
@@ -170,6 +129,19 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message,
 
     case WM_KEYDOWN:
     {
+        // F9 records every frame to capture.y4m, until it is pressed again
+        if (wParam == VK_F9)
+        {
+            if (frame_recorder_is_recording())
+            {
+                frame_recorder_stop();
+            }
+            else
+            {
+                frame_recorder_start(frame_recorder_settings("capture.y4m"));
+            }
+            break;
+        }
         render_key_down(char(wParam));
     }
     break;
@@ -312,10 +284,18 @@ INT WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, PSTR, INT iCmdShow)
             {
                 size_changed();
             }
-            render_update();
-            render_redraw();
+            {
+                FrameStageTimer timer(FrameStage::Update);
+                render_update();
+            }
+            {
+                FrameStageTimer timer(FrameStage::Redraw);
+                render_redraw();
+            }
+            frame_stats_end_frame();
         }
     }
+    frame_recorder_stop();
     render_destroy();
 
     GdiplusShutdown(gdiplusToken);
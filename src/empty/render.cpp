@@ -3,7 +3,7 @@
 #include <glm/gtc/noise.hpp>
 
 #include "device.h"
-#include "bitmap_utils.h"
+#include "image_writer.h"
 
 BufferData* screenBufferData;
 
@@ -74,8 +74,7 @@ void render_key_pressed(char key)
 {
     if (key == 'b')
     {
-        auto pBitmap = bitmap_create_from_buffer(screenBufferData->buffer, screenBufferData->BufferWidth, screenBufferData->BufferHeight);
-        bitmap_write(pBitmap, "empty_out.bmp");
+        image_write_async(screenBufferData, "empty_out.bmp");
     }
     else if (key == '+')
     {
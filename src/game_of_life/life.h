@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "thread_pool.h"
+
+// The life rules on a wrapping grid of 0/1 cells, shared by the sample and the benchmarks
+
+// Get a life value from a grid; coordinates one step outside the grid wrap to the other side
+inline uint32_t life_cell(const std::vector<uint32_t>& cells, int width, int height, int x, int y)
+{
+    if (x < 0) x = width - 1;
+    if (y < 0) y = height - 1;
+    if (y >= height) y = 0;
+    if (x >= width) x = 0;
+    return cells[width * y + x];
+}
+
+// Write the next generation of one row
+inline void life_generation_row(const std::vector<uint32_t>& source, std::vector<uint32_t>& target, int width, int height, int y)
+{
+    for (int x = 0; x < width; x++)
+    {
+        int count = 0;
+        const int coords[] = { -1, 0, 1 };
+
+        // Count surrounds
+        for (auto xx : coords)
+        {
+            for (auto yy : coords)
+            {
+                count += life_cell(source, width, height, xx + x, yy + y);
+            }
+        }
+
+        // Get center, subract from count
+        auto val = life_cell(source, width, height, x, y);
+        count -= val;
+
+        // Less than 2, greater than 3 cell dies
+        if (count < 2 || count > 3)
+        {
+            val = 0;
+        }
+        // Exactly 3, cell lives
+        else if (count == 3)
+        {
+            val = 1;
+        }
+        target[width * y + x] = val;
+    }
+}
+
+// Write the next generation of the whole grid; each row only writes to itself, so rows can run in parallel
+inline void life_generation(ThreadPool& threadPool, const std::vector<uint32_t>& source, std::vector<uint32_t>& target, int width, int height)
+{
+    threadPool.ParallelFor(uint32_t(height), [&](uint32_t row)
+    {
+        life_generation_row(source, target, width, height, int(row));
+    });
+}
@@ -1,16 +1,23 @@
-#include <thread>
+#include <algorithm>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/noise.hpp>
 #include <glm/gtc/functions.hpp>
 
 #include "device.h"
-#include "bitmap_utils.h"
+#include "image_writer.h"
+#include "thread_pool.h"
+#include "life.h"
 
 BufferData* screenBufferData;
+std::shared_ptr<ThreadPool> pThreadPool;
 
 uint32_t displayLifeBuffer = 0;
 std::vector<uint32_t> lifeBuffers[2];
 
+// Rows are written to the display buffer in spans of this many pixels, from the stack
+const int MaxSpanSize = 256;
+
 // Get a life value from a life buffer
 uint32_t& life_at(uint32_t buffer, int x, int y)
 { 
@@ -24,12 +31,17 @@ uint32_t& life_at(uint32_t buffer, int x, int y)
 void render_init()
 {
     deviceParams.pName = "Game Of Life";
+
+    pThreadPool = std::make_shared<ThreadPool>();
+    device_set_thread_pool(pThreadPool);
 }
 
 void render_destroy()
 {
     device_buffer_destroy(screenBufferData);
     screenBufferData = nullptr;
+    device_set_thread_pool(nullptr);
+    pThreadPool.reset();
 }
 
 void render_update()
@@ -42,39 +54,7 @@ void render_update()
     auto sourceBuffer = displayLifeBuffer;
 
     // Copy the life data to the new generation
-    for (int y = 0; y < screenBufferData->BufferHeight; y++)
-    {
-        for (int x = 0; x < screenBufferData->BufferWidth; x++)
-        {
-            int count = 0;
-            const int coords[] = { -1, 0, 1 };
-           
-            // Count surrounds
-            for (auto xx : coords)
-            {
-                for (auto yy : coords)
-                {
-                    count += life_at(sourceBuffer, xx + x, yy + y);
-                }
-            }
-
-            // Get center, subract from count
-            auto val = life_at(sourceBuffer, x, y);
-            count -= val;
-
-            // Less than 2, greater than 3 cell dies
-            if (count < 2 || count > 3)
-            {
-                val = 0;
-            }
-            // Exactly 3, cell lives
-            else if (count == 3)
-            {
-                val = 1;
-            }
-            life_at(targetBuffer, x, y) = val;
-        }
-    }
+    life_generation(*pThreadPool, lifeBuffers[sourceBuffer], lifeBuffers[targetBuffer], screenBufferData->BufferWidth, screenBufferData->BufferHeight);
 
     // Swap the displayed buffer
     displayLifeBuffer = targetBuffer;
@@ -82,22 +62,21 @@ void render_update()
 
 void render_redraw()
 {
-    auto pData = screenBufferData->buffer;
-
-    // Access a single value
-    auto at = [pData](int x, int y) -> glm::vec4& 
+    // Fill the display buffer with black or white pixels; it is shared exponent, so they go in a span at a time
+    pThreadPool->ParallelFor(uint32_t(screenBufferData->BufferHeight), [&](uint32_t row)
     {
-        return pData[y * screenBufferData->BufferWidth + x];
-    };
-
-    // Fill the display buffer with black or white pixels
-    for (int y = 0; y < screenBufferData->BufferHeight; y++)
-    {
-        for (int x = 0; x < screenBufferData->BufferWidth; x++)
+        int y = int(row);
+        glm::vec4 colors[MaxSpanSize];
+        for (int spanX = 0; spanX < screenBufferData->BufferWidth; spanX += MaxSpanSize)
         {
-            at(x, y) = glm::vec4(glm::vec3(life_at(displayLifeBuffer, x, y) ? 1.0f : 0.0f), 1.0f);
+            int count = std::min(MaxSpanSize, screenBufferData->BufferWidth - spanX);
+            for (int x = 0; x < count; x++)
+            {
+                colors[x] = glm::vec4(glm::vec3(life_at(displayLifeBuffer, spanX + x, y) ? 1.0f : 0.0f), 1.0f);
+            }
+            device_buffer_write(screenBufferData, spanX, y, count, colors);
         }
-    }
+    });
 
     // Copy the buffer to the display staging area
     device_buffer_set_to_display(screenBufferData);
@@ -107,7 +86,7 @@ void render_resized(int x, int y)
 {
     if (!screenBufferData)
     {
-        screenBufferData = device_buffer_create();
+        screenBufferData = device_buffer_create(0, 0, BufferFormat::RGB9E5);
     }
     device_buffer_ensure_screen_size(screenBufferData);
 
@@ -135,8 +114,7 @@ void render_key_pressed(char key)
 {
     if (key == 'b')
     {
-        auto pBitmap = bitmap_create_from_buffer(screenBufferData->buffer, screenBufferData->BufferWidth, screenBufferData->BufferHeight);
-        bitmap_write(pBitmap, "empty_out.bmp");
+        image_write_async(screenBufferData, "empty_out.bmp");
     }
     else if (key == '+')
     {
@@ -1,13 +1,21 @@
-#include <thread>
 #include <glm/glm.hpp>
 #include <glm/gtc/noise.hpp>
 #include <complex>
 #include <algorithm>
 
 #include "device.h"
-#include "bitmap_utils.h"
+#include "mandelbrot.h"
+#include "image_writer.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+#include "frame_stats.h"
 
 BufferData* screenBufferData;
+std::shared_ptr<ThreadPool> pThreadPool;
+TileScheduler tileScheduler;
+int tileSize = 32;                                          // '[' and ']' change it
+const int MaxTileSize = 256;
+bool logTileTimings = false;                                // 't' logs a summary of the tile timings every frame
 
 std::complex<double> TopLeft = std::complex<double>(-2.0f, -1.0f);
 std::complex<double> BottomRight = std::complex<double>(2.0f, 1.0f);
@@ -15,12 +23,17 @@ std::complex<double> BottomRight = std::complex<double>(2.0f, 1.0f);
 void render_init()
 {
     deviceParams.pName = "Sample Empty Demo";
+
+    pThreadPool = std::make_shared<ThreadPool>();
+    device_set_thread_pool(pThreadPool);
 }
 
 void render_destroy()
 {
     device_buffer_destroy(screenBufferData);
     screenBufferData = nullptr;
+    device_set_thread_pool(nullptr);
+    pThreadPool.reset();
 }
 
 void render_update()
@@ -36,52 +49,27 @@ std::complex<double> screen_to_complex(int x, int y)
 }
 void render_redraw()
 {
-    auto pData = screenBufferData->buffer;
-    
-    // Access a single value
-    auto at = [pData](int x, int y) -> glm::vec4&
-    {
-        return pData[y * screenBufferData->BufferWidth + x];
-    };
-
-
     auto scale = float(std::abs(std::hypot(real(BottomRight - TopLeft), imag(BottomRight - TopLeft))));
-    int partitions = 32;
-    std::vector<std::thread> threads;
-    for (int t = 0; t < partitions; t++)
+    auto tiles = tiles_build(screenBufferData->BufferWidth, screenBufferData->BufferHeight, tileSize);
+    tileScheduler.Run(*pThreadPool, tiles, [&](const Tile& tile)
     {
-        threads.push_back(std::thread([=]() {
-            for (int y = t; y < screenBufferData->BufferHeight; y+=partitions)
+        FrameStageTimer timer(FrameStage::Trace);
+        frame_stats_count(FrameCounter::Samples, uint64_t(tile.width) * tile.height);
+        // The display buffer is half float, so each row of the tile is written in one go
+        glm::vec4 row[MaxTileSize];
+        for (int y = tile.y; y < tile.y + tile.height; y++)
+        {
+            for (int x = tile.x; x < tile.x + tile.width; x++)
             {
-                for (int x = 0; x < screenBufferData->BufferWidth; x++)
-                {
-                    auto c = screen_to_complex(x, y);
-                    auto current = std::complex<double>(0.0f, 0.0f);
-                    int i = 0;
-                    while (i < 1000)
-                    {
-                        current = current * current + c;
-                        if (std::norm(current) > 4.0)
-                            break;
-                        i++;
-                    }
-
-                    if (i < 100)
-                    {
-                        at(x, y) = glm::vec4(std::min(1.0f, i / 10.0f), std::min(1.0f, i / 100.0f), 1.0f - std::min(1.0f, i / 20.0f), 1.0f);
-                    }
-                    else
-                    {
-                        at(x, y) = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
-                    }
-                }
+                row[x - tile.x] = mandelbrot_color(mandelbrot_iterations(screen_to_complex(x, y)));
             }
-            }));
-    }
-    
-    for (auto& t : threads)
+            device_buffer_write(screenBufferData, tile.x, y, tile.width, row);
+        }
+    });
+
+    if (logTileTimings)
     {
-        t.join();
+        device_log(tileScheduler.GetReport().c_str());
     }
 
     device_buffer_set_to_display(screenBufferData);
@@ -91,7 +79,7 @@ void render_resized(int x, int y)
 {
     if (!screenBufferData)
     {
-        screenBufferData = device_buffer_create();
+        screenBufferData = device_buffer_create(0, 0, BufferFormat::RGB16F);
     }
     device_buffer_ensure_screen_size(screenBufferData);
 }
@@ -100,14 +88,19 @@ void render_key_pressed(char key)
 {
     if (key == 'b')
     {
-        auto pBitmap = bitmap_create_from_buffer(screenBufferData->buffer, screenBufferData->BufferWidth, screenBufferData->BufferHeight);
-        bitmap_write(pBitmap, "empty_out.bmp");
+        image_write_async(screenBufferData, "empty_out.bmp");
+    }
+    else if (key == '[')
+    {
+        tileSize = std::max(8, tileSize / 2);
     }
-    else if (key == '+')
+    else if (key == ']')
     {
+        tileSize = std::min(MaxTileSize, tileSize * 2);
     }
-    else if (key == '-')
+    else if (key == 't')
     {
+        logTileTimings = !logTileTimings;
     }
     else if (key == 'd')
     {
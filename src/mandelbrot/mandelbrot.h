@@ -0,0 +1,32 @@
+#pragma once
+
+#include <algorithm>
+#include <complex>
+#include <glm/glm.hpp>
+
+// The escape time loop, shared by the sample and the benchmarks
+const int MandelbrotMaxIterations = 1000;
+
+// Number of iterations before c escapes, or maxIterations if it doesn't
+inline int mandelbrot_iterations(const std::complex<double>& c, int maxIterations = MandelbrotMaxIterations)
+{
+    auto current = std::complex<double>(0.0f, 0.0f);
+    int i = 0;
+    while (i < maxIterations)
+    {
+        current = current * current + c;
+        if (std::norm(current) > 4.0)
+            break;
+        i++;
+    }
+    return i;
+}
+
+inline glm::vec4 mandelbrot_color(int iterations)
+{
+    if (iterations < 100)
+    {
+        return glm::vec4(std::min(1.0f, iterations / 10.0f), std::min(1.0f, iterations / 100.0f), 1.0f - std::min(1.0f, iterations / 20.0f), 1.0f);
+    }
+    return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// An axis aligned bounding box
+struct AABB
+{
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+
+    void Grow(const glm::vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void Grow(const AABB& box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    float Area() const
+    {
+        glm::vec3 extent = max - min;
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
+    bool Overlaps(const AABB& box) const
+    {
+        return glm::all(glm::lessThanEqual(min, box.max)) && glm::all(glm::lessThanEqual(box.min, max));
+    }
+
+    bool Contains(const AABB& box) const
+    {
+        return glm::all(glm::lessThanEqual(min, box.min)) && glm::all(glm::lessThanEqual(box.max, max));
+    }
+};
+
+// A node in the hierarchy.  Children of an interior node are always allocated next to each other,
+// so only the left one is stored.
+struct BVHNode
+{
+    AABB bounds;
+    uint32_t leftOrFirst;                                   // Left child index, or first primitive for a leaf
+    uint32_t count;                                         // Number of primitives in a leaf, 0 for interior nodes
+
+    bool IsLeaf() const
+    {
+        return count != 0;
+    }
+};
+
+// A bounding volume hierarchy over a set of boxes.
+// The tree doesn't know what the primitives are; 'primitives' maps leaf ranges back to the caller's indices
+struct BVH
+{
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> primitives;
+};
+
+#define BVH_BIN_COUNT 16
+#define BVH_STACK_SIZE 64
+
+// Walking a node at depth d can leave d + 2 entries on the traversal stack, so nodes deeper than this are
+// always leaves
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 2)
+
+// Relative costs used by the surface area heuristic
+const float BVHTraversalCost = 1.0f;
+const float BVHIntersectCost = 1.0f;
+
+inline void bvh_update_node_bounds(BVH& bvh, const std::vector<AABB>& bounds, uint32_t nodeIndex)
+{
+    auto& node = bvh.nodes[nodeIndex];
+    node.bounds = AABB();
+    for (uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++)
+    {
+        node.bounds.Grow(bounds[bvh.primitives[i]]);
+    }
+}
+
+// Find the cheapest binned split of a node using the surface area heuristic.
+// Returns false if the centroids are all coincident and there is nothing to split
+inline bool bvh_find_split(const BVH& bvh, const std::vector<AABB>& bounds, const std::vector<glm::vec3>& centroids, const BVHNode& node, int& bestAxis, float& bestPosition, float& bestCost)
+{
+    AABB centroidBounds;
+    for (uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++)
+    {
+        centroidBounds.Grow(centroids[bvh.primitives[i]]);
+    }
+
+    bestAxis = -1;
+    bestCost = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float axisMin = centroidBounds.min[axis];
+        float extent = centroidBounds.max[axis] - axisMin;
+        if (extent <= 0.0f)
+        {
+            continue;
+        }
+
+        // Drop each primitive into a bin along this axis
+        AABB binBounds[BVH_BIN_COUNT];
+        uint32_t binCounts[BVH_BIN_COUNT] = { 0 };
+        float scale = BVH_BIN_COUNT / extent;
+        for (uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++)
+        {
+            auto prim = bvh.primitives[i];
+            int bin = std::min(BVH_BIN_COUNT - 1, int((centroids[prim][axis] - axisMin) * scale));
+            binCounts[bin]++;
+            binBounds[bin].Grow(bounds[prim]);
+        }
+
+        // Sweep from both ends to get the area and count either side of each bin boundary
+        float leftArea[BVH_BIN_COUNT - 1];
+        float rightArea[BVH_BIN_COUNT - 1];
+        uint32_t leftCount[BVH_BIN_COUNT - 1];
+        uint32_t rightCount[BVH_BIN_COUNT - 1];
+        AABB leftBox;
+        AABB rightBox;
+        uint32_t leftSum = 0;
+        uint32_t rightSum = 0;
+        for (int i = 0; i < BVH_BIN_COUNT - 1; i++)
+        {
+            leftSum += binCounts[i];
+            leftCount[i] = leftSum;
+            leftBox.Grow(binBounds[i]);
+            leftArea[i] = leftSum ? leftBox.Area() : 0.0f;
+
+            rightSum += binCounts[BVH_BIN_COUNT - 1 - i];
+            rightCount[BVH_BIN_COUNT - 2 - i] = rightSum;
+            rightBox.Grow(binBounds[BVH_BIN_COUNT - 1 - i]);
+            rightArea[BVH_BIN_COUNT - 2 - i] = rightSum ? rightBox.Area() : 0.0f;
+        }
+
+        for (int i = 0; i < BVH_BIN_COUNT - 1; i++)
+        {
+            if (leftCount[i] == 0 || rightCount[i] == 0)
+            {
+                continue;
+            }
+
+            float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPosition = axisMin + (i + 1) / scale;
+            }
+        }
+    }
+    return bestAxis != -1;
+}
+
+inline void bvh_subdivide(BVH& bvh, const std::vector<AABB>& bounds, const std::vector<glm::vec3>& centroids, uint32_t nodeIndex, uint32_t maxLeafSize, uint32_t depth)
+{
+    // Note: take copies, the node array grows below
+    BVHNode node = bvh.nodes[nodeIndex];
+    if (node.count <= 1 || depth >= BVH_MAX_DEPTH)
+    {
+        return;
+    }
+
+    int axis;
+    float position;
+    float splitCost;
+    uint32_t* pFirst = bvh.primitives.data() + node.leftOrFirst;
+    uint32_t* pLast = pFirst + node.count;
+    uint32_t* pMiddle;
+    if (bvh_find_split(bvh, bounds, centroids, node, axis, position, splitCost))
+    {
+        // Stop if splitting costs more than just testing every primitive, unless the leaf is too big
+        splitCost = BVHTraversalCost + BVHIntersectCost * splitCost / node.bounds.Area();
+        if (splitCost >= BVHIntersectCost * node.count && node.count <= maxLeafSize)
+        {
+            return;
+        }
+
+        pMiddle = std::partition(pFirst, pLast, [&](uint32_t prim) { return centroids[prim][axis] < position; });
+    }
+    else
+    {
+        if (node.count <= maxLeafSize)
+        {
+            return;
+        }
+
+        // Everything is in the same place; just split the list in half
+        pMiddle = pFirst + node.count / 2;
+    }
+
+    // Can happen with rounding at a bin edge
+    if (pMiddle == pFirst || pMiddle == pLast)
+    {
+        pMiddle = pFirst + node.count / 2;
+    }
+
+    uint32_t leftCount = uint32_t(pMiddle - pFirst);
+    uint32_t leftIndex = uint32_t(bvh.nodes.size());
+
+    BVHNode child;
+    child.leftOrFirst = node.leftOrFirst;
+    child.count = leftCount;
+    bvh.nodes.push_back(child);
+
+    child.leftOrFirst = node.leftOrFirst + leftCount;
+    child.count = node.count - leftCount;
+    bvh.nodes.push_back(child);
+
+    bvh.nodes[nodeIndex].leftOrFirst = leftIndex;
+    bvh.nodes[nodeIndex].count = 0;
+
+    bvh_update_node_bounds(bvh, bounds, leftIndex);
+    bvh_update_node_bounds(bvh, bounds, leftIndex + 1);
+    bvh_subdivide(bvh, bounds, centroids, leftIndex, maxLeafSize, depth + 1);
+    bvh_subdivide(bvh, bounds, centroids, leftIndex + 1, maxLeafSize, depth + 1);
+}
+
+// Build a hierarchy over the given boxes.  Primitive i in the caller's list has bounds[i]
+inline void bvh_build(BVH& bvh, const std::vector<AABB>& bounds, uint32_t maxLeafSize = 4)
+{
+    bvh.nodes.clear();
+    bvh.primitives.resize(bounds.size());
+    if (bounds.empty())
+    {
+        return;
+    }
+
+    std::vector<glm::vec3> centroids(bounds.size());
+    for (uint32_t i = 0; i < uint32_t(bounds.size()); i++)
+    {
+        bvh.primitives[i] = i;
+        centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+    }
+
+    bvh.nodes.reserve(bounds.size() * 2);
+
+    BVHNode root;
+    root.leftOrFirst = 0;
+    root.count = uint32_t(bounds.size());
+    bvh.nodes.push_back(root);
+    bvh_update_node_bounds(bvh, bounds, 0);
+    bvh_subdivide(bvh, bounds, centroids, 0, maxLeafSize, 0);
+}
+
+// Inverse ray direction for the slab test, with zero components nudged so we never multiply 0 by infinity
+inline glm::vec3 bvh_inverse_direction(const glm::vec3& dir)
+{
+    const float tiny = 1e-20f;
+    glm::vec3 d;
+    for (int i = 0; i < 3; i++)
+    {
+        d[i] = std::abs(dir[i]) < tiny ? (dir[i] < 0.0f ? -tiny : tiny) : dir[i];
+    }
+    return 1.0f / d;
+}
+
+// Slab test.  Returns the entry distance, or infinity if the ray misses the box or enters it beyond maxDistance
+inline float bvh_intersect_box(const AABB& box, const glm::vec3& origin, const glm::vec3& invDir, float maxDistance)
+{
+    glm::vec3 t0 = (box.min - origin) * invDir;
+    glm::vec3 t1 = (box.max - origin) * invDir;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    float tEntry = std::max(std::max(tNear.x, tNear.y), tNear.z);
+    float tExit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+    if (tEntry <= tExit && tExit >= 0.0f && tEntry <= maxDistance)
+    {
+        return tEntry;
+    }
+    return std::numeric_limits<float>::infinity();
+}
+
+// Walk the tree front to back.  intersectLeaf(first, count, maxDistance) is called for each leaf the ray
+// reaches, and should reduce maxDistance when it finds a closer hit; subtrees beyond it are then skipped.
+template <typename LeafFunction>
+inline void bvh_intersect(const BVHNode* pNodes, const glm::vec3& origin, const glm::vec3& dir, float& maxDistance, LeafFunction&& intersectLeaf)
+{
+    glm::vec3 invDir = bvh_inverse_direction(dir);
+    if (bvh_intersect_box(pNodes[0].bounds, origin, invDir, maxDistance) == std::numeric_limits<float>::infinity())
+    {
+        return;
+    }
+
+    struct StackEntry
+    {
+        uint32_t node;
+        float distance;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = StackEntry{ 0, 0.0f };
+
+    while (stackSize > 0)
+    {
+        auto entry = stack[--stackSize];
+
+        // A closer hit may have been found since this node was pushed
+        if (entry.distance > maxDistance)
+        {
+            continue;
+        }
+
+        const BVHNode* pNode = &pNodes[entry.node];
+        if (pNode->IsLeaf())
+        {
+            intersectLeaf(pNode->leftOrFirst, pNode->count, maxDistance);
+            continue;
+        }
+
+        uint32_t nearChild = pNode->leftOrFirst;
+        uint32_t farChild = nearChild + 1;
+        float nearDistance = bvh_intersect_box(pNodes[nearChild].bounds, origin, invDir, maxDistance);
+        float farDistance = bvh_intersect_box(pNodes[farChild].bounds, origin, invDir, maxDistance);
+        if (farDistance < nearDistance)
+        {
+            std::swap(nearChild, farChild);
+            std::swap(nearDistance, farDistance);
+        }
+
+        // Push the far child first so the near one is visited next
+        if (farDistance != std::numeric_limits<float>::infinity())
+        {
+            assert(stackSize < BVH_STACK_SIZE);
+            stack[stackSize++] = StackEntry{ farChild, farDistance };
+        }
+        if (nearDistance != std::numeric_limits<float>::infinity())
+        {
+            assert(stackSize < BVH_STACK_SIZE);
+            stack[stackSize++] = StackEntry{ nearChild, nearDistance };
+        }
+    }
+}
+
+template <typename LeafFunction>
+inline void bvh_intersect(const BVH& bvh, const glm::vec3& origin, const glm::vec3& dir, float& maxDistance, LeafFunction&& intersectLeaf)
+{
+    if (!bvh.nodes.empty())
+    {
+        bvh_intersect(bvh.nodes.data(), origin, dir, maxDistance, intersectLeaf);
+    }
+}
+
+// Walk the leaves the ray reaches before maxDistance, for queries that don't need the nearest hit, such as shadows.
+// The order doesn't matter, so children aren't sorted.  Stops as soon as intersectLeaf(first, count) returns true,
+// and returns true if it did
+template <typename LeafFunction>
+inline bool bvh_intersect_any(const BVHNode* pNodes, const glm::vec3& origin, const glm::vec3& dir, float maxDistance, LeafFunction&& intersectLeaf)
+{
+    glm::vec3 invDir = bvh_inverse_direction(dir);
+    uint32_t stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BVHNode* pNode = &pNodes[stack[--stackSize]];
+        if (bvh_intersect_box(pNode->bounds, origin, invDir, maxDistance) == std::numeric_limits<float>::infinity())
+        {
+            continue;
+        }
+
+        if (pNode->IsLeaf())
+        {
+            if (intersectLeaf(pNode->leftOrFirst, pNode->count))
+            {
+                return true;
+            }
+            continue;
+        }
+
+        assert(stackSize < BVH_STACK_SIZE);
+        stack[stackSize++] = pNode->leftOrFirst + 1;
+        assert(stackSize < BVH_STACK_SIZE);
+        stack[stackSize++] = pNode->leftOrFirst;
+    }
+    return false;
+}
+
+template <typename LeafFunction>
+inline bool bvh_intersect_any(const BVH& bvh, const glm::vec3& origin, const glm::vec3& dir, float maxDistance, LeafFunction&& intersectLeaf)
+{
+    return !bvh.nodes.empty() && bvh_intersect_any(bvh.nodes.data(), origin, dir, maxDistance, intersectLeaf);
+}
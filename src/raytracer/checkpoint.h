@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "compiled_scene.h"
+#include "camera.h"
+#include "mapped_file.h"
+
+// Checkpoints of a progressive render, so a long accumulation survives the program stopping.
+// The file is a header, then 2 slots, each holding a whole copy of the accumulation: the slot header, the mean
+// colour of every pixel, then the sample counts, then the mean squared luminances.  Saves alternate between the
+// slots, and a slot's generation is only filled in once everything else in it is, so if the program dies part way
+// through a save the other slot is still there to resume from.
+// The file stays mapped between saves; a save is a few copies into the mapping, and the system writes the pages
+// back in its own time.
+#define CHECKPOINT_VERSION 1
+
+struct CheckpointHeader
+{
+    char magic[4];                                          // "ERCK"
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct CheckpointSlotHeader
+{
+    uint64_t generation;                                    // 0 if the slot was never completely written
+    uint64_t sceneHash;
+    CameraPose camera;
+    uint32_t sampleCount;                                   // Frames of samples accumulated
+    uint32_t reserved;
+};
+
+// The accumulation saved in, or restored from, a checkpoint.  The arrays are width * height, and are the
+// caller's; they are filled in on a read
+struct CheckpointState
+{
+    int width = 0;
+    int height = 0;
+    uint64_t sceneHash = 0;
+    CameraPose camera;
+    uint32_t sampleCount = 0;
+    glm::vec3* pColors = nullptr;
+    uint32_t* pSamples = nullptr;
+    float* pLuminanceMoments = nullptr;
+};
+
+// A checkpoint file open for saving
+struct CheckpointFile
+{
+    MappedFile* pMapping = nullptr;
+    int width = 0;
+    int height = 0;
+    uint64_t generation = 0;                                // Of the latest complete slot
+};
+
+// FNV-1a, for hashing the things a checkpoint depends on
+inline uint64_t checkpoint_hash(uint64_t hash, const void* pData, size_t size)
+{
+    auto pBytes = (const uint8_t*)pData;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ pBytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+template<typename T>
+inline uint64_t checkpoint_hash_vector(uint64_t hash, const std::vector<T>& values)
+{
+    uint64_t count = values.size();
+    hash = checkpoint_hash(hash, &count, sizeof(count));
+    return checkpoint_hash(hash, values.data(), values.size() * sizeof(T));
+}
+
+// A hash of everything in a compiled scene that changes what the pixels converge to.  The acceleration
+// structures are left out, as they follow from the rest; a mesh is known by the hash of its contents, so copies
+// of the same OBJ on other machines match
+inline uint64_t checkpoint_scene_hash(const CompiledScene& scene)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = checkpoint_hash_vector(hash, scene.sphereCenterX);
+    hash = checkpoint_hash_vector(hash, scene.sphereCenterY);
+    hash = checkpoint_hash_vector(hash, scene.sphereCenterZ);
+    hash = checkpoint_hash_vector(hash, scene.sphereRadiusSquared);
+    hash = checkpoint_hash_vector(hash, scene.sphereMaterial);
+    hash = checkpoint_hash_vector(hash, scene.planes);
+    hash = checkpoint_hash_vector(hash, scene.materials);
+    for (auto& mesh : scene.meshes)
+    {
+        const MeshCacheHeader& header = *mesh.data.pHeader;
+        hash = checkpoint_hash(hash, &header.contentHash, sizeof(header.contentHash));
+        hash = checkpoint_hash(hash, &mesh.position, sizeof(mesh.position));
+        hash = checkpoint_hash(hash, &mesh.scale, sizeof(mesh.scale));
+        hash = checkpoint_hash(hash, &mesh.material, sizeof(mesh.material));
+    }
+    return hash;
+}
+
+inline size_t checkpoint_slot_size(int width, int height)
+{
+    size_t pixelCount = size_t(width) * height;
+    return sizeof(CheckpointSlotHeader) + pixelCount * (sizeof(glm::vec3) + sizeof(uint32_t) + sizeof(float));
+}
+
+inline size_t checkpoint_file_size(int width, int height)
+{
+    return sizeof(CheckpointHeader) + 2 * checkpoint_slot_size(width, height);
+}
+
+// The slots aren't necessarily 8 byte aligned, so their headers are copied in and out
+inline uint8_t* checkpoint_slot(void* pData, int width, int height, uint32_t slot)
+{
+    return (uint8_t*)pData + sizeof(CheckpointHeader) + slot * checkpoint_slot_size(width, height);
+}
+
+inline CheckpointSlotHeader checkpoint_slot_header(void* pData, int width, int height, uint32_t slot)
+{
+    CheckpointSlotHeader header;
+    memcpy(&header, checkpoint_slot(pData, width, height, slot), sizeof(header));
+    return header;
+}
+
+inline bool checkpoint_header_valid(const void* pData, size_t size, int width, int height)
+{
+    CheckpointHeader header;
+    if (size != checkpoint_file_size(width, height))
+    {
+        return false;
+    }
+    memcpy(&header, pData, sizeof(header));
+    return memcmp(header.magic, "ERCK", 4) == 0 &&
+        header.version == CHECKPOINT_VERSION &&
+        header.width == uint32_t(width) &&
+        header.height == uint32_t(height);
+}
+
+// Restore the newest complete slot saved from the same scene, for an image of state.width x state.height.
+// Returns false, leaving the arrays alone, if there isn't one
+inline bool checkpoint_read(const char* pPath, CheckpointState& state)
+{
+    MappedFile* pFile = mapped_file_open(pPath);
+    if (!pFile || !checkpoint_header_valid(pFile->pData, pFile->size, state.width, state.height))
+    {
+        mapped_file_close(pFile);
+        return false;
+    }
+
+    int found = -1;
+    CheckpointSlotHeader best = {};
+    for (uint32_t slot = 0; slot < 2; slot++)
+    {
+        CheckpointSlotHeader header = checkpoint_slot_header(pFile->pData, state.width, state.height, slot);
+        if (header.generation > best.generation && header.sceneHash == state.sceneHash && header.sampleCount > 0)
+        {
+            best = header;
+            found = int(slot);
+        }
+    }
+    if (found < 0)
+    {
+        mapped_file_close(pFile);
+        return false;
+    }
+
+    size_t pixelCount = size_t(state.width) * state.height;
+    const uint8_t* pSlot = checkpoint_slot(pFile->pData, state.width, state.height, uint32_t(found)) + sizeof(CheckpointSlotHeader);
+    memcpy(state.pColors, pSlot, pixelCount * sizeof(glm::vec3));
+    pSlot += pixelCount * sizeof(glm::vec3);
+    memcpy(state.pSamples, pSlot, pixelCount * sizeof(uint32_t));
+    pSlot += pixelCount * sizeof(uint32_t);
+    memcpy(state.pLuminanceMoments, pSlot, pixelCount * sizeof(float));
+
+    state.camera = best.camera;
+    state.sampleCount = best.sampleCount;
+    mapped_file_close(pFile);
+    return true;
+}
+
+inline void checkpoint_close(CheckpointFile& file)
+{
+    mapped_file_close(file.pMapping);
+    file.pMapping = nullptr;
+    file.generation = 0;
+}
+
+// Save the accumulation over the older slot.  The file is mapped on the first save, and again if the image size
+// changes; an existing checkpoint for the same size is kept, and saving carries on from its newest slot.
+// Returns false if the file can't be mapped
+inline bool checkpoint_write(CheckpointFile& file, const char* pPath, const CheckpointState& state)
+{
+    if (file.pMapping && (file.width != state.width || file.height != state.height))
+    {
+        checkpoint_close(file);
+    }
+
+    if (!file.pMapping)
+    {
+        file.pMapping = mapped_file_create(pPath, checkpoint_file_size(state.width, state.height));
+        if (!file.pMapping)
+        {
+            return false;
+        }
+        file.width = state.width;
+        file.height = state.height;
+
+        if (checkpoint_header_valid(file.pMapping->pData, file.pMapping->size, state.width, state.height))
+        {
+            file.generation = std::max(checkpoint_slot_header(file.pMapping->pData, state.width, state.height, 0).generation,
+                checkpoint_slot_header(file.pMapping->pData, state.width, state.height, 1).generation);
+        }
+        else
+        {
+            CheckpointHeader header = { { 'E', 'R', 'C', 'K' }, CHECKPOINT_VERSION, uint32_t(state.width), uint32_t(state.height) };
+            memcpy(file.pMapping->pData, &header, sizeof(header));
+            CheckpointSlotHeader empty = {};
+            memcpy(checkpoint_slot(file.pMapping->pData, state.width, state.height, 0), &empty, sizeof(empty));
+            memcpy(checkpoint_slot(file.pMapping->pData, state.width, state.height, 1), &empty, sizeof(empty));
+            file.generation = 0;
+        }
+    }
+
+    // The slot is marked incomplete while it is overwritten
+    CheckpointSlotHeader header = {};
+    uint64_t generation = file.generation + 1;
+    uint8_t* pSlot = checkpoint_slot(file.pMapping->pData, state.width, state.height, uint32_t(generation % 2));
+    memcpy(pSlot, &header, sizeof(header));
+
+    size_t pixelCount = size_t(state.width) * state.height;
+    uint8_t* pArrays = pSlot + sizeof(CheckpointSlotHeader);
+    memcpy(pArrays, state.pColors, pixelCount * sizeof(glm::vec3));
+    pArrays += pixelCount * sizeof(glm::vec3);
+    memcpy(pArrays, state.pSamples, pixelCount * sizeof(uint32_t));
+    pArrays += pixelCount * sizeof(uint32_t);
+    memcpy(pArrays, state.pLuminanceMoments, pixelCount * sizeof(float));
+
+    header.sceneHash = state.sceneHash;
+    header.camera = state.camera;
+    header.sampleCount = state.sampleCount;
+    header.generation = generation;
+    memcpy(pSlot, &header, sizeof(header));
+    file.generation = generation;
+
+    mapped_file_flush(file.pMapping);
+    return true;
+}
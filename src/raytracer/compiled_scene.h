@@ -0,0 +1,329 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <glm/glm.hpp>
+
+#include "sceneobjects.h"
+#include "bvh.h"
+#include "mesh.h"
+
+// A flat, read only view of the scene for the render threads.
+// It is rebuilt from the SceneObject list whenever that changes, so that tracing never touches a
+// shared_ptr or makes a virtual call.  Spheres are stored as arrays of components, in BVH leaf order,
+// so a leaf is a contiguous range of spheres.  Meshes keep their own BVH and are tested one after another.
+enum class PrimitiveType : uint32_t
+{
+    Sphere,
+    Plane,
+    Mesh
+};
+
+// Identifies one primitive in the compiled scene
+struct PrimitiveRef
+{
+    PrimitiveType type;
+    uint32_t index;                                         // Index into the sphere, plane or mesh arrays
+    uint32_t triangle;                                      // Triangle hit within a mesh
+
+    PrimitiveRef() = default;
+    PrimitiveRef(PrimitiveType primitiveType, uint32_t primitiveIndex, uint32_t meshTriangle = 0)
+        : type(primitiveType),
+        index(primitiveIndex),
+        triangle(meshTriangle)
+    {
+    }
+};
+
+struct SceneHit
+{
+    PrimitiveRef primitive;
+    float distance;
+};
+
+// The widest batch of spheres the intersection kernels test at once
+#define SPHERE_BATCH_SIZE 8
+
+// A plane with a checker of 2 materials, as TiledPlane
+struct CompiledPlane
+{
+    glm::vec3 normal;
+    glm::vec3 origin;
+    uint32_t whiteMaterial;
+    uint32_t blackMaterial;
+    uint32_t object;                                        // Index of the SceneObject it came from
+};
+
+// A mesh placed in the scene.  The triangles are not copied; they stay in the TriangleMesh, which lives at
+// least as long as the compiled scene since the scene is rebuilt whenever the objects change
+struct CompiledMesh
+{
+    MeshData data;
+    glm::vec3 position;                                     // World = mesh * scale + position
+    float scale;
+    AABB bounds;                                            // In world space
+    uint32_t material;
+    uint32_t object;
+};
+
+// Something that gives off light, with what the light sampling needs to know about it
+struct CompiledEmitter
+{
+    PrimitiveRef primitive;
+    glm::vec3 center;                                       // Where shadow rays towards it are aimed
+    uint32_t object;
+};
+
+struct CompiledScene
+{
+    std::vector<float> sphereCenterX;
+    std::vector<float> sphereCenterY;
+    std::vector<float> sphereCenterZ;
+    std::vector<float> sphereRadiusSquared;
+    std::vector<uint32_t> sphereMaterial;
+    std::vector<uint32_t> sphereObject;                     // Index of the SceneObject each sphere came from
+    BVH sphereBvh;
+
+    std::vector<CompiledPlane> planes;
+    std::vector<CompiledMesh> meshes;
+
+    std::vector<Material> materials;
+
+    // Bounds of everything but the planes, which go on forever
+    AABB bounds;
+
+    // Only the emissive primitives, so shading doesn't visit every object in the scene
+    std::vector<CompiledEmitter> emitters;
+
+    uint32_t SphereCount() const
+    {
+        return uint32_t(sphereMaterial.size());
+    }
+};
+
+inline uint32_t compiled_scene_add_material(CompiledScene& scene, const Material& material)
+{
+    scene.materials.push_back(material);
+    return uint32_t(scene.materials.size() - 1);
+}
+
+inline bool compiled_scene_is_emissive(const CompiledScene& scene, uint32_t material)
+{
+    return scene.materials[material].emissive != glm::vec3(0.0f);
+}
+
+// Collect the emitters, spheres first, then planes, then meshes
+inline void compiled_scene_build_emitters(CompiledScene& scene)
+{
+    scene.emitters.clear();
+    for (uint32_t i = 0; i < scene.SphereCount(); i++)
+    {
+        if (compiled_scene_is_emissive(scene, scene.sphereMaterial[i]))
+        {
+            glm::vec3 center(scene.sphereCenterX[i], scene.sphereCenterY[i], scene.sphereCenterZ[i]);
+            scene.emitters.push_back(CompiledEmitter{ PrimitiveRef{ PrimitiveType::Sphere, i }, center, scene.sphereObject[i] });
+        }
+    }
+
+    // A plane may only glow on one colour of its checker; the shading checks the material where it is hit
+    for (uint32_t i = 0; i < uint32_t(scene.planes.size()); i++)
+    {
+        const auto& plane = scene.planes[i];
+        if (compiled_scene_is_emissive(scene, plane.whiteMaterial) || compiled_scene_is_emissive(scene, plane.blackMaterial))
+        {
+            scene.emitters.push_back(CompiledEmitter{ PrimitiveRef{ PrimitiveType::Plane, i }, plane.origin, plane.object });
+        }
+    }
+
+    for (uint32_t i = 0; i < uint32_t(scene.meshes.size()); i++)
+    {
+        const auto& mesh = scene.meshes[i];
+        if (compiled_scene_is_emissive(scene, mesh.material))
+        {
+            scene.emitters.push_back(CompiledEmitter{ PrimitiveRef{ PrimitiveType::Mesh, i }, (mesh.bounds.min + mesh.bounds.max) * 0.5f, mesh.object });
+        }
+    }
+}
+
+inline void compiled_scene_build(CompiledScene& scene, const std::vector<std::shared_ptr<SceneObject>>& objects)
+{
+    scene = CompiledScene();
+
+    std::vector<const Sphere*> spheres;
+    std::vector<uint32_t> sphereObjects;
+    std::vector<AABB> bounds;
+    for (uint32_t object = 0; object < uint32_t(objects.size()); object++)
+    {
+        auto& pObject = objects[object];
+        if (pObject->GetSceneObjectType() == SceneObjectType::Sphere)
+        {
+            auto pSphere = static_cast<const Sphere*>(pObject.get());
+            AABB box;
+            pSphere->GetBounds(box);
+            spheres.push_back(pSphere);
+            sphereObjects.push_back(object);
+            bounds.push_back(box);
+            scene.bounds.Grow(box);
+        }
+        else if (pObject->GetSceneObjectType() == SceneObjectType::Plane)
+        {
+            // TiledPlane is the only plane we have
+            auto pPlane = static_cast<const TiledPlane*>(pObject.get());
+            CompiledPlane plane;
+            plane.normal = pPlane->normal;
+            plane.origin = pPlane->origin;
+            plane.whiteMaterial = compiled_scene_add_material(scene, pPlane->whiteMat);
+            plane.blackMaterial = compiled_scene_add_material(scene, pPlane->blackMat);
+            plane.object = object;
+            scene.planes.push_back(plane);
+        }
+        else if (pObject->GetSceneObjectType() == SceneObjectType::Mesh)
+        {
+            auto pMesh = static_cast<const TriangleMesh*>(pObject.get());
+            CompiledMesh mesh;
+            mesh.data = pMesh->data;
+            mesh.position = pMesh->position;
+            mesh.scale = pMesh->scale;
+            pMesh->GetBounds(mesh.bounds);
+            mesh.material = compiled_scene_add_material(scene, pMesh->material);
+            mesh.object = object;
+            scene.bounds.Grow(mesh.bounds);
+            scene.meshes.push_back(mesh);
+        }
+    }
+
+    // Leaves hold up to a full SIMD batch of spheres
+    bvh_build(scene.sphereBvh, bounds, SPHERE_BATCH_SIZE);
+
+    // Store the spheres in leaf order, so the leaves can index them directly
+    for (auto prim : scene.sphereBvh.primitives)
+    {
+        auto pSphere = spheres[prim];
+        scene.sphereCenterX.push_back(pSphere->center.x);
+        scene.sphereCenterY.push_back(pSphere->center.y);
+        scene.sphereCenterZ.push_back(pSphere->center.z);
+        scene.sphereRadiusSquared.push_back(pSphere->radius * pSphere->radius);
+        scene.sphereMaterial.push_back(compiled_scene_add_material(scene, pSphere->material));
+        scene.sphereObject.push_back(sphereObjects[prim]);
+    }
+
+    // Pad the arrays so a whole batch can be loaded starting from any sphere; the padding never hits anything
+    for (int i = 0; i < SPHERE_BATCH_SIZE - 1; i++)
+    {
+        scene.sphereCenterX.push_back(0.0f);
+        scene.sphereCenterY.push_back(0.0f);
+        scene.sphereCenterZ.push_back(0.0f);
+        scene.sphereRadiusSquared.push_back(-1.0f);
+    }
+
+    compiled_scene_build_emitters(scene);
+}
+
+inline glm::vec3 compiled_scene_sphere_center(const CompiledScene& scene, uint32_t index)
+{
+    return glm::vec3(scene.sphereCenterX[index], scene.sphereCenterY[index], scene.sphereCenterZ[index]);
+}
+
+// As glm::intersectRaySphere, but the direction must already be normalized
+inline bool compiled_scene_intersect_sphere(const CompiledScene& scene, uint32_t index, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance)
+{
+    const float epsilon = std::numeric_limits<float>::epsilon();
+    glm::vec3 diff = compiled_scene_sphere_center(scene, index) - rayOrigin;
+    float t0 = glm::dot(diff, rayDir);
+    float dSquared = glm::dot(diff, diff) - t0 * t0;
+    float radiusSquared = scene.sphereRadiusSquared[index];
+    if (dSquared > radiusSquared)
+    {
+        return false;
+    }
+    float t1 = sqrt(radiusSquared - dSquared);
+    distance = t0 > t1 + epsilon ? t0 - t1 : t0 + t1;
+    return distance > epsilon;
+}
+
+// Intersect a mesh with a ray in world space, testing the leaves with intersectTriangles as for mesh_intersect.
+// The direction must be normalized.  distance is the furthest hit to look for, and is updated with the hit
+template <typename TriangleFunction>
+inline bool compiled_scene_intersect_mesh(const CompiledMesh& mesh, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance, uint32_t& triangle, TriangleFunction&& intersectTriangles)
+{
+    // The scale is uniform, so the direction stays normalized in mesh space and only distances change
+    float meshDistance = distance / mesh.scale;
+    if (!mesh_intersect(mesh.data, (rayOrigin - mesh.position) / mesh.scale, rayDir, meshDistance, triangle, intersectTriangles))
+    {
+        return false;
+    }
+    distance = meshDistance * mesh.scale;
+    return true;
+}
+
+// True if the ray hits the mesh closer than maxDistance; as compiled_scene_intersect_mesh
+template <typename TriangleFunction>
+inline bool compiled_scene_intersect_mesh_any(const CompiledMesh& mesh, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance, TriangleFunction&& intersectTriangles)
+{
+    return mesh_intersect_any(mesh.data, (rayOrigin - mesh.position) / mesh.scale, rayDir, maxDistance / mesh.scale, intersectTriangles);
+}
+
+inline bool compiled_scene_intersect_plane(const CompiledPlane& plane, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance)
+{
+    return glm::intersectRayPlane(rayOrigin, rayDir, plane.origin, plane.normal, distance);
+}
+
+// Intersect any primitive; like SceneObject::Intersects the direction need not be normalized
+inline bool compiled_scene_intersect(const CompiledScene& scene, const PrimitiveRef& primitive, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance)
+{
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        return compiled_scene_intersect_sphere(scene, primitive.index, rayOrigin, glm::normalize(rayDir), distance);
+    }
+    else if (primitive.type == PrimitiveType::Mesh)
+    {
+        uint32_t triangle;
+        distance = std::numeric_limits<float>::max();
+        return compiled_scene_intersect_mesh(scene.meshes[primitive.index], rayOrigin, glm::normalize(rayDir), distance, triangle, mesh_intersect_triangles_scalar);
+    }
+    return compiled_scene_intersect_plane(scene.planes[primitive.index], rayOrigin, rayDir, distance);
+}
+
+// Given a source position, return a ray to the primitive's center
+inline glm::vec3 compiled_scene_ray_from(const CompiledScene& scene, const PrimitiveRef& primitive, const glm::vec3& from)
+{
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        return glm::normalize(compiled_scene_sphere_center(scene, primitive.index) - from);
+    }
+    else if (primitive.type == PrimitiveType::Mesh)
+    {
+        const AABB& bounds = scene.meshes[primitive.index].bounds;
+        return glm::normalize((bounds.min + bounds.max) * 0.5f - from);
+    }
+    return glm::normalize(scene.planes[primitive.index].origin - from);
+}
+
+inline glm::vec3 compiled_scene_normal(const CompiledScene& scene, const PrimitiveRef& primitive, const glm::vec3& pos)
+{
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        return glm::normalize(pos - compiled_scene_sphere_center(scene, primitive.index));
+    }
+    else if (primitive.type == PrimitiveType::Mesh)
+    {
+        return mesh_triangle_normal(scene.meshes[primitive.index].data, primitive.triangle);
+    }
+    return scene.planes[primitive.index].normal;
+}
+
+inline const Material& compiled_scene_material(const CompiledScene& scene, const PrimitiveRef& primitive, const glm::vec3& pos)
+{
+    if (primitive.type == PrimitiveType::Sphere)
+    {
+        return scene.materials[scene.sphereMaterial[primitive.index]];
+    }
+    else if (primitive.type == PrimitiveType::Mesh)
+    {
+        return scene.materials[scene.meshes[primitive.index].material];
+    }
+
+    const auto& plane = scene.planes[primitive.index];
+    bool white = ((int(floor(pos.x / 4) + floor(pos.z / 4)) & 1) == 0);
+    return scene.materials[white ? plane.whiteMaterial : plane.blackMaterial];
+}
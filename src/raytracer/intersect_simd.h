@@ -0,0 +1,311 @@
+#pragma once
+
+#include <limits>
+#include <glm/glm.hpp>
+
+#include "compiled_scene.h"
+
+// Kernels that intersect one ray with several spheres or triangles at once, straight from the arrays.
+// AVX2 builds test 8 spheres at a time, otherwise SSE2 tests 4; mesh leaves are small, so triangles are
+// always tested 4 at a time.  The scalar versions do the same arithmetic in the same order, so all of them
+// find exactly the same hits; they are kept for checking.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Index of the lowest set bit; mask must not be 0
+inline uint32_t simd_first_lane(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return uint32_t(index);
+#else
+    return uint32_t(__builtin_ctz(mask));
+#endif
+}
+
+// Intersect the spheres [first, first + count) with a ray.  The direction must be normalized.
+// Returns the index of the nearest sphere hit closer than maxDistance and updates maxDistance, or -1 for no hit
+inline int intersect_spheres_scalar(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance)
+{
+    int nearest = -1;
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        float distance;
+        if (compiled_scene_intersect_sphere(scene, i, rayOrigin, rayDir, distance) &&
+            maxDistance > distance)
+        {
+            nearest = int(i);
+            maxDistance = distance;
+        }
+    }
+    return nearest;
+}
+
+// Returns a mask with bit n set if sphere first + n is hit closer than maxDistance; count must be at most 32.
+// For queries that need every hit along a ray, not just the nearest
+inline uint32_t intersect_spheres_mask_scalar(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance)
+{
+    uint32_t mask = 0;
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        float distance;
+        if (compiled_scene_intersect_sphere(scene, i, rayOrigin, rayDir, distance) &&
+            maxDistance > distance)
+        {
+            mask |= 1u << (i - first);
+        }
+    }
+    return mask;
+}
+
+#if SIMD_WIDTH == 8
+
+// Test the 8 spheres from i, ignoring any from 'end' on.  Returns the lanes hit closer than maxDistance, and their distances
+inline __m256 intersect_sphere_batch(const CompiledScene& scene, uint32_t i, uint32_t end, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance, __m256& distance)
+{
+    const __m256 epsilon = _mm256_set1_ps(std::numeric_limits<float>::epsilon());
+    const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    __m256 diffX = _mm256_sub_ps(_mm256_loadu_ps(&scene.sphereCenterX[i]), _mm256_set1_ps(rayOrigin.x));
+    __m256 diffY = _mm256_sub_ps(_mm256_loadu_ps(&scene.sphereCenterY[i]), _mm256_set1_ps(rayOrigin.y));
+    __m256 diffZ = _mm256_sub_ps(_mm256_loadu_ps(&scene.sphereCenterZ[i]), _mm256_set1_ps(rayOrigin.z));
+    __m256 radiusSquared = _mm256_loadu_ps(&scene.sphereRadiusSquared[i]);
+
+    __m256 t0 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(diffX, _mm256_set1_ps(rayDir.x)), _mm256_mul_ps(diffY, _mm256_set1_ps(rayDir.y))), _mm256_mul_ps(diffZ, _mm256_set1_ps(rayDir.z)));
+    __m256 diffLength = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(diffX, diffX), _mm256_mul_ps(diffY, diffY)), _mm256_mul_ps(diffZ, diffZ));
+    __m256 dSquared = _mm256_sub_ps(diffLength, _mm256_mul_ps(t0, t0));
+    __m256 valid = _mm256_cmp_ps(dSquared, radiusSquared, _CMP_LE_OQ);
+
+    __m256 t1 = _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(radiusSquared, dSquared), _mm256_setzero_ps()));
+    __m256 useNear = _mm256_cmp_ps(t0, _mm256_add_ps(t1, epsilon), _CMP_GT_OQ);
+    distance = _mm256_blendv_ps(_mm256_add_ps(t0, t1), _mm256_sub_ps(t0, t1), useNear);
+
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(distance, epsilon, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(distance, _mm256_set1_ps(maxDistance), _CMP_LT_OQ));
+    return _mm256_and_ps(valid, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(int(end - i)), laneIndex)));
+}
+
+inline int intersect_spheres(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance)
+{
+    const __m256 infinity = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+
+    int nearest = -1;
+    for (uint32_t i = first; i < first + count; i += 8)
+    {
+        __m256 distance;
+        __m256 valid = intersect_sphere_batch(scene, i, first + count, rayOrigin, rayDir, maxDistance, distance);
+        if (_mm256_movemask_ps(valid) == 0)
+        {
+            continue;
+        }
+
+        // Nearest of the valid lanes; the lowest lane wins a tie, as in the scalar loop
+        distance = _mm256_blendv_ps(infinity, distance, valid);
+        __m256 minDistance = _mm256_min_ps(distance, _mm256_permute_ps(distance, _MM_SHUFFLE(2, 3, 0, 1)));
+        minDistance = _mm256_min_ps(minDistance, _mm256_permute_ps(minDistance, _MM_SHUFFLE(1, 0, 3, 2)));
+        minDistance = _mm256_min_ps(minDistance, _mm256_permute2f128_ps(minDistance, minDistance, 1));
+        uint32_t lanes = uint32_t(_mm256_movemask_ps(_mm256_and_ps(valid, _mm256_cmp_ps(distance, minDistance, _CMP_EQ_OQ))));
+
+        nearest = int(i + simd_first_lane(lanes));
+        maxDistance = _mm256_cvtss_f32(minDistance);
+    }
+    return nearest;
+}
+
+inline uint32_t intersect_spheres_mask(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance)
+{
+    uint32_t mask = 0;
+    for (uint32_t i = first; i < first + count; i += 8)
+    {
+        __m256 distance;
+        mask |= uint32_t(_mm256_movemask_ps(intersect_sphere_batch(scene, i, first + count, rayOrigin, rayDir, maxDistance, distance))) << (i - first);
+    }
+    return mask;
+}
+
+#elif SIMD_WIDTH == 4
+
+// Test the 4 spheres from i, ignoring any from 'end' on.  Returns the lanes hit closer than maxDistance, and their distances
+inline __m128 intersect_sphere_batch(const CompiledScene& scene, uint32_t i, uint32_t end, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance, __m128& distance)
+{
+    const __m128 epsilon = _mm_set1_ps(std::numeric_limits<float>::epsilon());
+    const __m128i laneIndex = _mm_setr_epi32(0, 1, 2, 3);
+
+    __m128 diffX = _mm_sub_ps(_mm_loadu_ps(&scene.sphereCenterX[i]), _mm_set1_ps(rayOrigin.x));
+    __m128 diffY = _mm_sub_ps(_mm_loadu_ps(&scene.sphereCenterY[i]), _mm_set1_ps(rayOrigin.y));
+    __m128 diffZ = _mm_sub_ps(_mm_loadu_ps(&scene.sphereCenterZ[i]), _mm_set1_ps(rayOrigin.z));
+    __m128 radiusSquared = _mm_loadu_ps(&scene.sphereRadiusSquared[i]);
+
+    __m128 t0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diffX, _mm_set1_ps(rayDir.x)), _mm_mul_ps(diffY, _mm_set1_ps(rayDir.y))), _mm_mul_ps(diffZ, _mm_set1_ps(rayDir.z)));
+    __m128 diffLength = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diffX, diffX), _mm_mul_ps(diffY, diffY)), _mm_mul_ps(diffZ, diffZ));
+    __m128 dSquared = _mm_sub_ps(diffLength, _mm_mul_ps(t0, t0));
+    __m128 valid = _mm_cmple_ps(dSquared, radiusSquared);
+
+    // SSE2 has no blend, so select with and/andnot
+    __m128 t1 = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(radiusSquared, dSquared), _mm_setzero_ps()));
+    __m128 useNear = _mm_cmpgt_ps(t0, _mm_add_ps(t1, epsilon));
+    distance = _mm_or_ps(_mm_and_ps(useNear, _mm_sub_ps(t0, t1)), _mm_andnot_ps(useNear, _mm_add_ps(t0, t1)));
+
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(distance, epsilon));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(distance, _mm_set1_ps(maxDistance)));
+    return _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(int(end - i)), laneIndex)));
+}
+
+inline int intersect_spheres(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance)
+{
+    const __m128 infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+    int nearest = -1;
+    for (uint32_t i = first; i < first + count; i += 4)
+    {
+        __m128 distance;
+        __m128 valid = intersect_sphere_batch(scene, i, first + count, rayOrigin, rayDir, maxDistance, distance);
+        if (_mm_movemask_ps(valid) == 0)
+        {
+            continue;
+        }
+
+        // Nearest of the valid lanes; the lowest lane wins a tie, as in the scalar loop
+        distance = _mm_or_ps(_mm_and_ps(valid, distance), _mm_andnot_ps(valid, infinity));
+        __m128 minDistance = _mm_min_ps(distance, _mm_shuffle_ps(distance, distance, _MM_SHUFFLE(2, 3, 0, 1)));
+        minDistance = _mm_min_ps(minDistance, _mm_shuffle_ps(minDistance, minDistance, _MM_SHUFFLE(1, 0, 3, 2)));
+        uint32_t lanes = uint32_t(_mm_movemask_ps(_mm_and_ps(valid, _mm_cmpeq_ps(distance, minDistance))));
+
+        nearest = int(i + simd_first_lane(lanes));
+        maxDistance = _mm_cvtss_f32(minDistance);
+    }
+    return nearest;
+}
+
+inline uint32_t intersect_spheres_mask(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance)
+{
+    uint32_t mask = 0;
+    for (uint32_t i = first; i < first + count; i += 4)
+    {
+        __m128 distance;
+        mask |= uint32_t(_mm_movemask_ps(intersect_sphere_batch(scene, i, first + count, rayOrigin, rayDir, maxDistance, distance))) << (i - first);
+    }
+    return mask;
+}
+
+#else
+
+inline int intersect_spheres(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance)
+{
+    return intersect_spheres_scalar(scene, first, count, rayOrigin, rayDir, maxDistance);
+}
+
+inline uint32_t intersect_spheres_mask(const CompiledScene& scene, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance)
+{
+    return intersect_spheres_mask_scalar(scene, first, count, rayOrigin, rayDir, maxDistance);
+}
+
+#endif
+
+#if SIMD_WIDTH >= 4
+
+// As mesh_intersect_triangles_scalar
+inline int intersect_triangles(const MeshData& mesh, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance)
+{
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 determinantEpsilon = _mm_set1_ps(MeshDeterminantEpsilon);
+    const __m128 hitEpsilon = _mm_set1_ps(MeshHitEpsilon);
+    const __m128 infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128i laneIndex = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128 ox = _mm_set1_ps(rayOrigin.x);
+    const __m128 oy = _mm_set1_ps(rayOrigin.y);
+    const __m128 oz = _mm_set1_ps(rayOrigin.z);
+    const __m128 dx = _mm_set1_ps(rayDir.x);
+    const __m128 dy = _mm_set1_ps(rayDir.y);
+    const __m128 dz = _mm_set1_ps(rayDir.z);
+
+    int nearest = -1;
+    for (uint32_t i = first; i < first + count; i += 4)
+    {
+        __m128 e1x = _mm_loadu_ps(&mesh.pEdge1[0][i]);
+        __m128 e1y = _mm_loadu_ps(&mesh.pEdge1[1][i]);
+        __m128 e1z = _mm_loadu_ps(&mesh.pEdge1[2][i]);
+        __m128 e2x = _mm_loadu_ps(&mesh.pEdge2[0][i]);
+        __m128 e2y = _mm_loadu_ps(&mesh.pEdge2[1][i]);
+        __m128 e2z = _mm_loadu_ps(&mesh.pEdge2[2][i]);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 valid = _mm_cmpge_ps(_mm_andnot_ps(signMask, det), determinantEpsilon);
+        __m128 invDet = _mm_div_ps(one, det);
+
+        __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&mesh.pVertex[0][i]));
+        __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&mesh.pVertex[1][i]));
+        __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&mesh.pVertex[2][i]));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+        __m128 distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(distance, hitEpsilon));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(distance, _mm_set1_ps(maxDistance)));
+        valid = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(int(first + count - i)), laneIndex)));
+        if (_mm_movemask_ps(valid) == 0)
+        {
+            continue;
+        }
+
+        distance = _mm_or_ps(_mm_and_ps(valid, distance), _mm_andnot_ps(valid, infinity));
+        __m128 minDistance = _mm_min_ps(distance, _mm_shuffle_ps(distance, distance, _MM_SHUFFLE(2, 3, 0, 1)));
+        minDistance = _mm_min_ps(minDistance, _mm_shuffle_ps(minDistance, minDistance, _MM_SHUFFLE(1, 0, 3, 2)));
+        uint32_t lanes = uint32_t(_mm_movemask_ps(_mm_and_ps(valid, _mm_cmpeq_ps(distance, minDistance))));
+
+        nearest = int(i + simd_first_lane(lanes));
+        maxDistance = _mm_cvtss_f32(minDistance);
+    }
+    return nearest;
+}
+
+#else
+
+inline int intersect_triangles(const MeshData& mesh, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance)
+{
+    return mesh_intersect_triangles_scalar(mesh, first, count, rayOrigin, rayDir, maxDistance);
+}
+
+#endif
+
+// Intersect a placed mesh, with the SIMD or the scalar kernel; see compiled_scene_intersect_mesh
+inline bool intersect_mesh(const CompiledMesh& mesh, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance, uint32_t& triangle, bool useSimd)
+{
+    if (useSimd)
+    {
+        return compiled_scene_intersect_mesh(mesh, rayOrigin, rayDir, distance, triangle, intersect_triangles);
+    }
+    return compiled_scene_intersect_mesh(mesh, rayOrigin, rayDir, distance, triangle, mesh_intersect_triangles_scalar);
+}
+
+inline bool intersect_mesh_any(const CompiledMesh& mesh, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance, bool useSimd)
+{
+    if (useSimd)
+    {
+        return compiled_scene_intersect_mesh_any(mesh, rayOrigin, rayDir, maxDistance, intersect_triangles);
+    }
+    return compiled_scene_intersect_mesh_any(mesh, rayOrigin, rayDir, maxDistance, mesh_intersect_triangles_scalar);
+}
@@ -0,0 +1,542 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <glm/glm.hpp>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "sceneobjects.h"
+#include "bvh.h"
+#include "mapped_file.h"
+
+// Triangle meshes, loaded from OBJ files.
+// A mesh lives in a single block of memory laid out exactly as the binary cache file: a header, the BVH nodes,
+// then the triangles as arrays of components in BVH leaf order.  Each triangle is stored as a vertex and the
+// 2 edges from it, which is what the intersection test wants, and the arrays are padded so a whole SIMD batch
+// can be loaded starting from any triangle.
+// Building a mesh writes the cache next to the OBJ; after that it is loaded with a single mapping of the file.
+#define MESH_CACHE_VERSION 2
+#define MESH_BATCH_SIZE 8
+#define MESH_LEAF_SIZE 4
+
+// Rays nearly parallel to a triangle are treated as misses
+const float MeshDeterminantEpsilon = 1e-12f;
+const float MeshHitEpsilon = 1e-6f;
+
+struct MeshCacheHeader
+{
+    char magic[4];                                          // "ERMC"
+    uint32_t version;
+    uint64_t sourceSize;                                    // Size and time of the OBJ file it was built from
+    int64_t sourceTime;
+    uint32_t triangleCount;
+    uint32_t paddedTriangleCount;                           // Length of each of the triangle arrays
+    uint32_t nodeCount;
+    uint32_t reserved;
+    uint64_t contentHash;                                   // Of the nodes and triangles; the same wherever the OBJ is copied to
+    AABB bounds;
+};
+
+// Pointers into a mesh's memory
+struct MeshData
+{
+    const MeshCacheHeader* pHeader = nullptr;
+    const BVHNode* pNodes = nullptr;
+    const float* pVertex[3];                                // x, y and z arrays
+    const float* pEdge1[3];
+    const float* pEdge2[3];
+};
+
+inline size_t mesh_blob_size(uint32_t paddedTriangleCount, uint32_t nodeCount)
+{
+    return sizeof(MeshCacheHeader) + sizeof(BVHNode) * nodeCount + sizeof(float) * 9 * paddedTriangleCount;
+}
+
+// Check that the tree in a mesh's memory can be walked safely: every child and leaf range is inside the arrays,
+// each node is reached once, and the tree is shallow enough for the traversal stack.  A cache file can be
+// anything, so nothing in it is trusted before this
+inline bool mesh_nodes_valid(const BVHNode* pNodes, uint32_t nodeCount, uint32_t triangleCount)
+{
+    if (nodeCount == 0)
+    {
+        return triangleCount == 0;
+    }
+
+    struct WalkEntry
+    {
+        uint32_t node;
+        uint32_t depth;
+    };
+    std::vector<WalkEntry> stack(1, WalkEntry{ 0, 0 });
+    std::vector<bool> reached(nodeCount, false);
+    reached[0] = true;
+    while (!stack.empty())
+    {
+        WalkEntry entry = stack.back();
+        stack.pop_back();
+
+        const BVHNode& node = pNodes[entry.node];
+        if (node.IsLeaf())
+        {
+            if (node.count > triangleCount || node.leftOrFirst > triangleCount - node.count)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        // Children always come after their parent, and no deeper than the traversal stack allows
+        uint32_t left = node.leftOrFirst;
+        if (left <= entry.node || left >= nodeCount - 1 || entry.depth + 1 > BVH_MAX_DEPTH ||
+            reached[left] || reached[left + 1])
+        {
+            return false;
+        }
+        reached[left] = true;
+        reached[left + 1] = true;
+        stack.push_back(WalkEntry{ left, entry.depth + 1 });
+        stack.push_back(WalkEntry{ left + 1, entry.depth + 1 });
+    }
+    return true;
+}
+
+// Point a MeshData at a block of mesh memory, checking that it really is one
+inline bool mesh_data_bind(MeshData& data, const void* pBlob, size_t size)
+{
+    auto pHeader = (const MeshCacheHeader*)pBlob;
+    if (size < sizeof(MeshCacheHeader) ||
+        memcmp(pHeader->magic, "ERMC", 4) != 0 ||
+        pHeader->version != MESH_CACHE_VERSION ||
+        pHeader->triangleCount > std::numeric_limits<uint32_t>::max() - (MESH_BATCH_SIZE - 1) ||
+        pHeader->paddedTriangleCount != pHeader->triangleCount + MESH_BATCH_SIZE - 1 ||
+        size != mesh_blob_size(pHeader->paddedTriangleCount, pHeader->nodeCount))
+    {
+        return false;
+    }
+
+    auto pNodes = (const BVHNode*)(pHeader + 1);
+    if (!mesh_nodes_valid(pNodes, pHeader->nodeCount, pHeader->triangleCount))
+    {
+        return false;
+    }
+
+    data.pHeader = pHeader;
+    data.pNodes = pNodes;
+    auto pArrays = (const float*)(data.pNodes + pHeader->nodeCount);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        data.pVertex[axis] = pArrays + pHeader->paddedTriangleCount * axis;
+        data.pEdge1[axis] = pArrays + pHeader->paddedTriangleCount * (3 + axis);
+        data.pEdge2[axis] = pArrays + pHeader->paddedTriangleCount * (6 + axis);
+    }
+    return true;
+}
+
+// Build the mesh memory for a list of triangles, 3 indices each
+inline std::vector<uint8_t> mesh_build_blob(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices, uint64_t sourceSize, int64_t sourceTime)
+{
+    uint32_t triangleCount = uint32_t(indices.size() / 3);
+    std::vector<AABB> bounds(triangleCount);
+    for (uint32_t i = 0; i < triangleCount; i++)
+    {
+        for (int corner = 0; corner < 3; corner++)
+        {
+            bounds[i].Grow(positions[indices[i * 3 + corner]]);
+        }
+    }
+
+    BVH bvh;
+    bvh_build(bvh, bounds, MESH_LEAF_SIZE);
+
+    MeshCacheHeader header = {};
+    memcpy(header.magic, "ERMC", 4);
+    header.version = MESH_CACHE_VERSION;
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+    header.triangleCount = triangleCount;
+    header.paddedTriangleCount = triangleCount + MESH_BATCH_SIZE - 1;
+    header.nodeCount = uint32_t(bvh.nodes.size());
+    header.bounds = bvh.nodes.empty() ? AABB() : bvh.nodes[0].bounds;
+
+    // Padding triangles are all zero, so their determinant is 0 and they never hit
+    std::vector<uint8_t> blob(mesh_blob_size(header.paddedTriangleCount, header.nodeCount), 0);
+    memcpy(blob.data(), &header, sizeof(header));
+    if (!bvh.nodes.empty())
+    {
+        memcpy(blob.data() + sizeof(header), bvh.nodes.data(), sizeof(BVHNode) * bvh.nodes.size());
+    }
+
+    float* pArrays = (float*)(blob.data() + sizeof(header) + sizeof(BVHNode) * bvh.nodes.size());
+    for (uint32_t i = 0; i < triangleCount; i++)
+    {
+        auto triangle = bvh.primitives[i];
+        glm::vec3 v0 = positions[indices[triangle * 3]];
+        glm::vec3 edge1 = positions[indices[triangle * 3 + 1]] - v0;
+        glm::vec3 edge2 = positions[indices[triangle * 3 + 2]] - v0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            pArrays[header.paddedTriangleCount * axis + i] = v0[axis];
+            pArrays[header.paddedTriangleCount * (3 + axis) + i] = edge1[axis];
+            pArrays[header.paddedTriangleCount * (6 + axis) + i] = edge2[axis];
+        }
+    }
+
+    // FNV-1a over everything after the header
+    header.contentHash = 0xcbf29ce484222325ull;
+    for (size_t i = sizeof(header); i < blob.size(); i++)
+    {
+        header.contentHash = (header.contentHash ^ blob[i]) * 0x100000001b3ull;
+    }
+    memcpy(blob.data(), &header, sizeof(header));
+    return blob;
+}
+
+// Read the vertices and faces from an OBJ file; polygons are split into fans of triangles, everything else is ignored
+inline bool mesh_parse_obj(const char* pPath, std::vector<glm::vec3>& positions, std::vector<uint32_t>& indices)
+{
+    std::ifstream file(pPath, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::vector<char> text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    text.push_back('\0');
+
+    std::vector<uint32_t> face;
+    const char* p = text.data();
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            char* pEnd;
+            glm::vec3 position;
+            position.x = strtof(p + 1, &pEnd);
+            position.y = strtof(pEnd, &pEnd);
+            position.z = strtof(pEnd, &pEnd);
+            positions.push_back(position);
+            p = pEnd;
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            // Each corner is v, v/vt, v//vn or v/vt/vn; indices are 1 based, or relative to the end if negative
+            face.clear();
+            bool valid = true;
+            p++;
+            for (;;)
+            {
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (*p == '\0' || *p == '\n' || *p == '\r')
+                    break;
+
+                char* pEnd;
+                long index = strtol(p, &pEnd, 10);
+                if (pEnd == p)
+                {
+                    valid = false;
+                    break;
+                }
+                index = index < 0 ? long(positions.size()) + index : index - 1;
+                valid = valid && index >= 0 && index < long(positions.size());
+                face.push_back(uint32_t(index));
+
+                p = pEnd;
+                while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+                    p++;
+            }
+
+            for (size_t corner = 2; valid && corner < face.size(); corner++)
+            {
+                indices.push_back(face[0]);
+                indices.push_back(face[corner - 1]);
+                indices.push_back(face[corner]);
+            }
+        }
+
+        // Next line
+        while (*p && *p != '\n')
+            p++;
+        if (*p)
+            p++;
+    }
+    return !indices.empty();
+}
+
+// Intersect the triangles [first, first + count) with a ray in mesh space.  The direction must be normalized.
+// Returns the nearest triangle hit closer than maxDistance and updates maxDistance, or -1 for no hit
+inline int mesh_intersect_triangles_scalar(const MeshData& mesh, uint32_t first, uint32_t count, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance)
+{
+    int nearest = -1;
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        float e1x = mesh.pEdge1[0][i], e1y = mesh.pEdge1[1][i], e1z = mesh.pEdge1[2][i];
+        float e2x = mesh.pEdge2[0][i], e2y = mesh.pEdge2[1][i], e2z = mesh.pEdge2[2][i];
+
+        // Moller-Trumbore
+        float px = rayDir.y * e2z - rayDir.z * e2y;
+        float py = rayDir.z * e2x - rayDir.x * e2z;
+        float pz = rayDir.x * e2y - rayDir.y * e2x;
+        float det = e1x * px + e1y * py + e1z * pz;
+        if (!(std::abs(det) >= MeshDeterminantEpsilon))
+            continue;
+        float invDet = 1.0f / det;
+
+        float tx = rayOrigin.x - mesh.pVertex[0][i];
+        float ty = rayOrigin.y - mesh.pVertex[1][i];
+        float tz = rayOrigin.z - mesh.pVertex[2][i];
+        float u = (tx * px + ty * py + tz * pz) * invDet;
+        if (!(u >= 0.0f && u <= 1.0f))
+            continue;
+
+        float qx = ty * e1z - tz * e1y;
+        float qy = tz * e1x - tx * e1z;
+        float qz = tx * e1y - ty * e1x;
+        float v = (rayDir.x * qx + rayDir.y * qy + rayDir.z * qz) * invDet;
+        if (!(v >= 0.0f && u + v <= 1.0f))
+            continue;
+
+        float distance = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+        if (distance > MeshHitEpsilon && distance < maxDistance)
+        {
+            nearest = int(i);
+            maxDistance = distance;
+        }
+    }
+    return nearest;
+}
+
+// Find the nearest triangle hit by a ray in mesh space, walking the mesh's BVH.  The direction must be normalized.
+// intersectTriangles(mesh, first, count, origin, dir, maxDistance) tests a leaf, as mesh_intersect_triangles_scalar
+template <typename TriangleFunction>
+inline bool mesh_intersect(const MeshData& mesh, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& maxDistance, uint32_t& triangle, TriangleFunction&& intersectTriangles)
+{
+    if (mesh.pHeader->nodeCount == 0)
+    {
+        return false;
+    }
+
+    int nearest = -1;
+    bvh_intersect(mesh.pNodes, rayOrigin, rayDir, maxDistance, [&](uint32_t first, uint32_t count, float& leafMaxDistance)
+    {
+        int hit = intersectTriangles(mesh, first, count, rayOrigin, rayDir, leafMaxDistance);
+        if (hit >= 0)
+        {
+            nearest = hit;
+        }
+    });
+
+    if (nearest < 0)
+    {
+        return false;
+    }
+    triangle = uint32_t(nearest);
+    return true;
+}
+
+// True if the ray hits any triangle closer than maxDistance, for shadow rays
+template <typename TriangleFunction>
+inline bool mesh_intersect_any(const MeshData& mesh, const glm::vec3& rayOrigin, const glm::vec3& rayDir, float maxDistance, TriangleFunction&& intersectTriangles)
+{
+    if (mesh.pHeader->nodeCount == 0)
+    {
+        return false;
+    }
+
+    return bvh_intersect_any(mesh.pNodes, rayOrigin, rayDir, maxDistance, [&](uint32_t first, uint32_t count)
+    {
+        float leafMaxDistance = maxDistance;
+        return intersectTriangles(mesh, first, count, rayOrigin, rayDir, leafMaxDistance) >= 0;
+    });
+}
+
+// The geometric normal, following the winding of the triangle
+inline glm::vec3 mesh_triangle_normal(const MeshData& mesh, uint32_t triangle)
+{
+    glm::vec3 edge1(mesh.pEdge1[0][triangle], mesh.pEdge1[1][triangle], mesh.pEdge1[2][triangle]);
+    glm::vec3 edge2(mesh.pEdge2[0][triangle], mesh.pEdge2[1][triangle], mesh.pEdge2[2][triangle]);
+    return glm::normalize(glm::cross(edge1, edge2));
+}
+
+// A triangle mesh with a single material, scaled and then moved into place
+struct TriangleMesh : SceneObject
+{
+    Material material;
+    glm::vec3 position = glm::vec3(0.0f);
+    float scale = 1.0f;
+
+    MeshData data;
+    std::vector<uint8_t> storage;                           // The mesh memory, if it was built here
+    MappedFile* pMapping = nullptr;                         // or the cache file it was loaded from
+
+    TriangleMesh(const Material& mat)
+    {
+        material = mat;
+    }
+
+    virtual ~TriangleMesh()
+    {
+        mapped_file_close(pMapping);
+    }
+
+    uint32_t GetTriangleCount() const
+    {
+        return data.pHeader->triangleCount;
+    }
+
+    glm::vec3 ToMeshSpace(const glm::vec3& pos) const
+    {
+        return (pos - position) / scale;
+    }
+
+    virtual const Material& GetMaterial(const glm::vec3& pos) const override
+    {
+        return material;
+    }
+
+    virtual SceneObjectType GetSceneObjectType() const override
+    {
+        return SceneObjectType::Mesh;
+    }
+
+    // Slow; finds the triangle the point lies on.  Tracing uses the triangle from the hit instead
+    virtual glm::vec3 GetSurfaceNormal(const glm::vec3& pos) const override
+    {
+        glm::vec3 meshPos = ToMeshSpace(pos);
+        glm::vec3 normal(0.0f, 1.0f, 0.0f);
+        float nearest = std::numeric_limits<float>::max();
+        for (uint32_t i = 0; i < GetTriangleCount(); i++)
+        {
+            glm::vec3 triangleNormal = mesh_triangle_normal(data, i);
+            float distance = std::abs(glm::dot(meshPos - glm::vec3(data.pVertex[0][i], data.pVertex[1][i], data.pVertex[2][i]), triangleNormal));
+            if (distance < nearest)
+            {
+                nearest = distance;
+                normal = triangleNormal;
+            }
+        }
+        return normal;
+    }
+
+    virtual glm::vec3 GetRayFrom(const glm::vec3& from) const override
+    {
+        AABB bounds;
+        GetBounds(bounds);
+        return normalize((bounds.min + bounds.max) * 0.5f - from);
+    }
+
+    // Returns the hit triangle as well as the distance
+    bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance, uint32_t& triangle) const
+    {
+        float meshDistance = std::numeric_limits<float>::max();
+        if (!mesh_intersect(data, ToMeshSpace(rayOrigin), glm::normalize(rayDir), meshDistance, triangle, mesh_intersect_triangles_scalar))
+        {
+            return false;
+        }
+        distance = meshDistance * scale;
+        return true;
+    }
+
+    virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance) const override
+    {
+        uint32_t triangle;
+        return Intersects(rayOrigin, rayDir, distance, triangle);
+    }
+
+    virtual bool GetBounds(AABB& bounds) const override
+    {
+        bounds.min = data.pHeader->bounds.min * scale + position;
+        bounds.max = data.pHeader->bounds.max * scale + position;
+        return true;
+    }
+};
+
+// Write a cache file.  Other processes may have the old one mapped, or be writing it too, so it is written to a
+// file of our own and renamed over the old one; readers keep the file they mapped.  Returns false, leaving no
+// temporary file behind, if it can't be written
+inline bool mesh_save_cache(const std::string& cachePath, const std::vector<uint8_t>& blob)
+{
+#ifdef _WIN32
+    std::string tempPath = cachePath + ".tmp." + std::to_string(_getpid());
+#else
+    std::string tempPath = cachePath + ".tmp." + std::to_string(getpid());
+#endif
+
+    bool written;
+    {
+        std::ofstream cache(tempPath, std::ios::binary);
+        cache.write((const char*)blob.data(), blob.size());
+        cache.close();
+        written = !cache.fail();
+    }
+
+#ifdef _WIN32
+    // Fails if the old cache is mapped, as Windows won't replace a file in use
+    if (written && MoveFileExA(tempPath.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+    if (written && rename(tempPath.c_str(), cachePath.c_str()) == 0)
+#endif
+    {
+        return true;
+    }
+    remove(tempPath.c_str());
+    return false;
+}
+
+// Load a mesh from an OBJ file.  The binary cache next to it is used if it was built from the same file,
+// and is rebuilt otherwise.  Returns nullptr if the OBJ can't be read
+inline std::shared_ptr<TriangleMesh> mesh_load(const std::string& objPath, const Material& material)
+{
+    struct stat info;
+    if (stat(objPath.c_str(), &info) != 0)
+    {
+        return nullptr;
+    }
+
+    auto pMesh = std::make_shared<TriangleMesh>(material);
+    std::string cachePath = objPath + ".ermesh";
+
+    MappedFile* pCache = mapped_file_open(cachePath.c_str());
+    if (pCache &&
+        mesh_data_bind(pMesh->data, pCache->pData, pCache->size) &&
+        pMesh->data.pHeader->sourceSize == uint64_t(info.st_size) &&
+        pMesh->data.pHeader->sourceTime == int64_t(info.st_mtime))
+    {
+        pMesh->pMapping = pCache;
+        return pMesh;
+    }
+    mapped_file_close(pCache);
+
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> indices;
+    if (!mesh_parse_obj(objPath.c_str(), positions, indices))
+    {
+        return nullptr;
+    }
+
+    pMesh->storage = mesh_build_blob(positions, indices, uint64_t(info.st_size), int64_t(info.st_mtime));
+    if (!mesh_data_bind(pMesh->data, pMesh->storage.data(), pMesh->storage.size()))
+    {
+        return nullptr;
+    }
+
+    // Save the cache for next time; it doesn't matter if we can't
+    mesh_save_cache(cachePath, pMesh->storage);
+    return pMesh;
+}
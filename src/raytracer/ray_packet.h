@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cassert>
+#include <glm/glm.hpp>
+
+#include "compiled_scene.h"
+#include "intersect_simd.h"
+#include "frame_stats.h"
+
+// Packets of coherent primary rays.
+// Camera rays for neighbouring pixels are nearly parallel, so a block of them mostly visits the same BVH nodes.
+// Each node is first culled against the frustum bounding the whole packet, and the per-ray tests start from
+// the first ray that still reaches the node.  Every ray finds exactly the hit it would on its own.
+#define PACKET_WIDTH 4
+#define PACKET_SIZE (PACKET_WIDTH * PACKET_WIDTH)
+
+struct RayPacket
+{
+    glm::vec3 origin;                                       // Shared by all the rays; the camera position
+    glm::vec3 direction[PACKET_SIZE];                       // Row major, 'width' rays per row
+    glm::vec3 bounds[4];                                    // Through the corners of the pixel block, clockwise from
+                                                            // the top left; every ray lies between them
+    int width;                                              // Size of the pixel block, smaller at the screen edges
+    int height;
+
+    int Count() const
+    {
+        return width * height;
+    }
+};
+
+// The 4 side planes of the pyramid containing every ray in a packet, facing inwards
+struct PacketFrustum
+{
+    glm::vec3 normals[4];
+};
+
+inline void packet_build_frustum(const RayPacket& packet, PacketFrustum& frustum)
+{
+    const glm::vec3* corners = packet.bounds;
+    glm::vec3 center = corners[0] + corners[1] + corners[2] + corners[3];
+
+    for (int i = 0; i < 4; i++)
+    {
+        // A zero normal, should two corners coincide, never culls anything
+        glm::vec3 normal = glm::cross(corners[i], corners[(i + 1) % 4]);
+        float length = glm::length(normal);
+        normal = length > 0.0f ? normal / length : glm::vec3(0.0f);
+        frustum.normals[i] = glm::dot(normal, center) < 0.0f ? -normal : normal;
+    }
+}
+
+// True if the box is entirely outside the packet frustum
+inline bool packet_frustum_culls(const PacketFrustum& frustum, const glm::vec3& origin, const AABB& box)
+{
+    // Allow a little slack, so rays on the frustum edges are never lost to rounding
+    const float tolerance = 1e-4f;
+    for (int i = 0; i < 4; i++)
+    {
+        const glm::vec3& normal = frustum.normals[i];
+
+        // The box corner furthest along the plane normal
+        glm::vec3 corner(normal.x >= 0.0f ? box.max.x : box.min.x,
+            normal.y >= 0.0f ? box.max.y : box.min.y,
+            normal.z >= 0.0f ? box.max.z : box.min.z);
+        if (glm::dot(normal, corner - origin) < -tolerance)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Find the nearest hit for each ray in the packet, as FindNearestObject.
+// Returns a mask with bit i set if ray i hit something, in which case pHits[i] describes the hit
+inline uint32_t packet_find_nearest(const CompiledScene& scene, const RayPacket& packet, SceneHit* pHits, bool useSimd)
+{
+    const int count = packet.Count();
+    uint32_t hitMask = 0;
+    uint64_t tests = uint64_t(count) * (scene.planes.size() + scene.meshes.size());
+
+    glm::vec3 directions[PACKET_SIZE];
+    glm::vec3 invDirections[PACKET_SIZE];
+    float nearest[PACKET_SIZE];
+    for (int i = 0; i < count; i++)
+    {
+        nearest[i] = std::numeric_limits<float>::max();
+        directions[i] = glm::normalize(packet.direction[i]);
+        invDirections[i] = bvh_inverse_direction(directions[i]);
+
+        // Planes are unbounded, so they are just tested against every ray
+        for (uint32_t plane = 0; plane < uint32_t(scene.planes.size()); plane++)
+        {
+            float distance;
+            if (compiled_scene_intersect_plane(scene.planes[plane], packet.origin, packet.direction[i], distance) &&
+                nearest[i] > distance)
+            {
+                pHits[i].primitive = PrimitiveRef{ PrimitiveType::Plane, plane };
+                nearest[i] = distance;
+                hitMask |= (1u << i);
+            }
+        }
+    }
+
+    const auto& nodes = scene.sphereBvh.nodes;
+    if (!nodes.empty())
+    {
+        PacketFrustum frustum;
+        packet_build_frustum(packet, frustum);
+
+        struct StackEntry
+        {
+            uint32_t node;
+            int firstActive;                                // No ray before this one reached the parent node
+        };
+        StackEntry stack[BVH_STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = StackEntry{ 0, 0 };
+
+        while (stackSize > 0)
+        {
+            auto entry = stack[--stackSize];
+            const BVHNode& node = nodes[entry.node];
+            if (packet_frustum_culls(frustum, packet.origin, node.bounds))
+            {
+                continue;
+            }
+
+            // Find the first ray that reaches this node before its nearest hit
+            const float miss = std::numeric_limits<float>::infinity();
+            int first = entry.firstActive;
+            while (first < count &&
+                bvh_intersect_box(node.bounds, packet.origin, invDirections[first], nearest[first]) == miss)
+            {
+                first++;
+            }
+            if (first == count)
+            {
+                continue;
+            }
+
+            if (node.IsLeaf())
+            {
+                for (int i = first; i < count; i++)
+                {
+                    if (i != first &&
+                        bvh_intersect_box(node.bounds, packet.origin, invDirections[i], nearest[i]) == miss)
+                    {
+                        continue;
+                    }
+
+                    tests += node.count;
+                    int sphere = useSimd ?
+                        intersect_spheres(scene, node.leftOrFirst, node.count, packet.origin, directions[i], nearest[i]) :
+                        intersect_spheres_scalar(scene, node.leftOrFirst, node.count, packet.origin, directions[i], nearest[i]);
+                    if (sphere >= 0)
+                    {
+                        pHits[i].primitive = PrimitiveRef{ PrimitiveType::Sphere, uint32_t(sphere) };
+                        hitMask |= (1u << i);
+                    }
+                }
+                continue;
+            }
+
+            // Visit the child nearer along the first active ray first
+            uint32_t nearChild = node.leftOrFirst;
+            uint32_t farChild = nearChild + 1;
+            const AABB& nearBounds = nodes[nearChild].bounds;
+            const AABB& farBounds = nodes[farChild].bounds;
+            if (glm::dot(farBounds.min + farBounds.max - nearBounds.min - nearBounds.max, directions[first]) < 0.0f)
+            {
+                std::swap(nearChild, farChild);
+            }
+            assert(stackSize < BVH_STACK_SIZE);
+            stack[stackSize++] = StackEntry{ farChild, first };
+            assert(stackSize < BVH_STACK_SIZE);
+            stack[stackSize++] = StackEntry{ nearChild, first };
+        }
+    }
+
+    // Meshes have their own trees, so each ray walks them on its own
+    for (uint32_t mesh = 0; mesh < uint32_t(scene.meshes.size()); mesh++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t triangle;
+            if (intersect_mesh(scene.meshes[mesh], packet.origin, directions[i], nearest[i], triangle, useSimd))
+            {
+                pHits[i].primitive = PrimitiveRef{ PrimitiveType::Mesh, mesh, triangle };
+                hitMask |= (1u << i);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        pHits[i].distance = nearest[i];
+    }
+    frame_stats_count(FrameCounter::IntersectionTests, tests);
+    return hitMask;
+}
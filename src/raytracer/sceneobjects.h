@@ -1,6 +1,8 @@
 #pragma once
 
 #include <glm/gtx/intersect.hpp>
+#include "bvh.h"
+
 struct Material
 {
     glm::vec3 albedo = glm::vec3(1.0f);                      // Base color of the surface
@@ -15,15 +17,20 @@ struct Material
 enum class SceneObjectType
 {
     Sphere,
-    Plane
+    Plane,
+    Mesh
 };
 
 struct SceneObject
 {
+    virtual ~SceneObject()
+    {
+    }
+
     // Given a point on the surface, return the material at that point
     virtual const Material& GetMaterial(const glm::vec3& pos) const = 0;
 
-    // Is it a sphere or a plane?
+    // Is it a sphere, a plane or a mesh?
     virtual SceneObjectType GetSceneObjectType() const = 0;
 
     // Given a point on the surface, return a normal
@@ -34,6 +41,9 @@ struct SceneObject
 
     // Intersect this object with a ray and figure out if it hits, and return the distance to the hit point 
     virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance) const = 0;
+
+    // Get the world space bounds of the object; returns false if it is infinite
+    virtual bool GetBounds(AABB& bounds) const = 0;
 };
 
 // A sphere, at a coordinate, with a radius and a material
@@ -75,6 +85,13 @@ struct Sphere : SceneObject
         bool hit = glm::intersectRaySphere(rayOrigin, glm::normalize(rayDir), center, radius * radius, distance);
         return hit;
     }
+
+    virtual bool GetBounds(AABB& bounds) const override
+    {
+        bounds.min = center - glm::vec3(radius);
+        bounds.max = center + glm::vec3(radius);
+        return true;
+    }
 };
 
 // A plane, centered at origin, with a normal direction
@@ -86,6 +103,11 @@ struct Plane : SceneObject
     {
         return SceneObjectType::Plane;
     }
+
+    virtual bool GetBounds(AABB& bounds) const override
+    {
+        return false;
+    }
 };
 
 // A tiled plane.  returns a different material based on the hit point to represent the grid
@@ -1,27 +1,124 @@
-#include <thread>
+#include <algorithm>
+#include <vector>
 #include <glm/glm.hpp>
 
 #include "sceneobjects.h"
+#include "mesh.h"
+#include "compiled_scene.h"
+#include "intersect_simd.h"
+#include "ray_packet.h"
+#include "checkpoint.h"
 #include "camera.h"
 #include "camera_manipulator.h"
 
 #include "device.h"
-#include "bitmap_utils.h"
+#include "image_writer.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+#include "frame_stats.h"
+#include "remote_workers.h"
+#include "sampling.h"
 
 #define MAX_DEPTH 6
 
 std::vector<std::shared_ptr<SceneObject>> sceneObjects;
 std::vector<std::shared_ptr<SceneObject>> lightObjects;
+
 std::shared_ptr<Camera> pCamera;
 std::shared_ptr<Manipulator> pManipulator;
-BufferData* screenBufferData;
+std::shared_ptr<ThreadPool> pThreadPool;
+TileScheduler tileScheduler;
+BufferData* screenBufferData;                               // The accumulated mean of each pixel's samples; RGB32F
 SceneObject* pMoveLight = nullptr;
+SceneObject* pMoveObject = nullptr;
+
+// The flattened scene the render threads trace against; rebuilt at the start of a frame when the scene changes
+CompiledScene compiledScene;
+bool sceneChanged = true;
 
 float cameraDistance = 8.0f;
-bool pause = false;
+bool paused = false;
 bool step = true;
 int currentSample = 0;
-int partitions = std::thread::hardware_concurrency();
+bool useSimdIntersect = true;                               // 'i' switches to the scalar kernels, to check results
+bool usePackets = true;                                     // 'k' traces primary rays one at a time
+int tileSize = 32;                                          // '[' and ']' change it; must be a multiple of the packet size
+bool logTileTimings = false;                                // 't' logs a summary of the tile timings every frame
+// Adaptive sampling; 'v' switches it off, so every pixel gets a sample every frame
+bool useAdaptiveSampling = true;
+float adaptiveErrorThreshold = 0.004f;                      // Standard error in luminance, about one 8 bit step
+uint32_t minAdaptiveSamples = 16;                           // Before a pixel's variance is trusted
+uint32_t maxAdaptiveSamples = 256;                          // Beyond this a pixel counts as done anyway
+bool imageConverged = false;
+std::vector<uint32_t> pixelSamples;                         // Samples in each pixel of the accumulation buffer
+std::vector<float> pixelLuminanceMoment;                    // Mean squared luminance of each pixel's samples
+
+// How the frame is traced; 'm' switches between them
+enum class TraceMode
+{
+    Whitted,                                                // Each pixel's rays depth first
+    Wavefront                                               // A tile at a time, a generation of rays at a time
+};
+TraceMode traceMode = TraceMode::Whitted;
+
+// While the camera moves, frames are traced at 1/16 of the pixels, then 1/4, then accumulate at full resolution
+// once it stops; 'r' switches it off
+bool useProgressiveResolution = true;
+const int MaxPreviewScale = 4;                              // Pixels along the side of the coarsest preview block
+int previewScale = 1;                                       // Block size of the next frame; 1 for a full frame
+
+bool useRayCutoffs = true;                                  // 'u' traces every ray down to MAX_DEPTH, to compare
+float minRayContribution = 0.01f;                           // Rays that would add less than this to a pixel aren't traced
+int maxRaysPerPixel = 32;                                   // Including the primary ray
+
+// Localized updates.  For each PACKET_WIDTH square block of the image we keep a conservative record of what its
+// rays depended on, so moving one object only restarts the blocks it could change; see MoveObject
+struct BlockInfluence
+{
+    uint64_t emitters = 0;                                  // Bit (object % 64) for each emitter whose light was gathered
+    AABB shaded;                                            // Around the points light was gathered at
+    AABB rays;                                              // Around the secondary rays
+};
+std::vector<BlockInfluence> blockInfluence;
+AABB influenceBounds;                                       // Rays that leave the scene are only followed this far
+thread_local BlockInfluence* pRecordInfluence = nullptr;    // Where the rays being traced are recorded, if anywhere
+
+// Checkpoints.  The accumulation is saved every checkpointInterval seconds while it is still improving, and a
+// checkpoint of the same scene at the same image size is resumed from at startup; 'c' saves one now.  The device
+// can move them, or turn them off, through deviceParams.pCheckpointPath
+bool useCheckpoints = true;
+const char* pCheckpointPath = "raytracer.checkpoint";
+float checkpointInterval = 30.0f;
+CheckpointFile checkpointFile;
+bool checkpointResumeTried = false;
+bool checkpointRequested = false;
+int checkpointSample = 0;                                   // The sample count last saved
+std::chrono::steady_clock::time_point lastCheckpoint;
+
+// Remote tracing.  While workers are connected (see remote_workers.h) the tiles of a full resolution frame go to
+// them, remoteSamples samples a pixel at a time, rather than to the threads here.  A job carries all a worker needs
+// to trace its tile as it would be traced here: the camera, the settings, where the spheres are, and the index of
+// each pixel's next sample.  The reply is the mean colour and mean squared luminance of the new samples, which are
+// merged in weighted by their count.  Workers don't record what their rays depended on, so after a remote frame
+// moving an object restarts the whole image
+uint32_t remoteSamples = 4;
+const uint32_t MaxRemoteSamplesScale = 16;                  // Workers refuse requests for more than this many times remoteSamples
+
+// Followed by the sphere centres, in scene order, then the first sample index of each pixel of the tile
+struct RemoteTileRequest
+{
+    uint64_t sceneHash;                                     // The worker's scene must match, once the spheres are moved
+    CameraPose camera;
+    int32_t imageWidth;
+    int32_t imageHeight;
+    Tile tile;
+    uint32_t sampleCount;
+    uint32_t sphereCount;
+    uint32_t useRayCutoffs;
+    float minRayContribution;
+    int32_t maxRaysPerPixel;
+};
+bool ServeRemoteTile(const std::vector<uint8_t>& request, std::vector<uint8_t>& reply);
 
 glm::vec3 backgroundColor = glm::vec3{ 135.0f / 255.0f, 206.0f / 255.0f, 235.0f / 255.0f };
 glm::vec3 backgroundColor2 = glm::vec3{ 135.0f / 255.0f, 206.0f / 255.0f, 235.0f / 255.0f } * .75f;
@@ -30,6 +127,11 @@ float bias = 0.001f;
 void render_init()
 {
     deviceParams.pName = "Whitted Ray Tracer";
+    if (deviceParams.pCheckpointPath)
+    {
+        pCheckpointPath = deviceParams.pCheckpointPath;
+        useCheckpoints = pCheckpointPath[0] != '\0';
+    }
 
     sceneObjects.clear();
     lightObjects.clear();
@@ -57,6 +159,7 @@ void render_init()
     mat.emissive = glm::vec3(0.0f, 0.0f, 0.0f);
     mat.specular_exponent = 35;
     sceneObjects.push_back(std::make_shared<Sphere>(mat, glm::vec3(-1.0f, 0.7f, 3.f), 0.7f));
+    pMoveObject = sceneObjects[sceneObjects.size() - 1].get();
    
 
     // White ball
@@ -74,35 +177,150 @@ void render_init()
 
     sceneObjects.push_back(std::make_shared<TiledPlane>(glm::vec3(0.0f, 0.0f, 0.0f), normalize(glm::vec3(0.0f, 1.0f, 0.0f))));
 
+    // Put a mesh.obj in the working directory to have it stood on the floor behind the balls
+    mat.albedo = glm::vec3(0.8f, 0.8f, 0.8f);
+    mat.specular = glm::vec3(0.3f, 0.3f, 0.3f);
+    mat.emissive = glm::vec3(0.0f, 0.0f, 0.0f);
+    mat.specular_exponent = 20;
+    auto pMesh = mesh_load("mesh.obj", mat);
+    if (pMesh)
+    {
+        const AABB& bounds = pMesh->data.pHeader->bounds;
+        glm::vec3 extent = bounds.max - bounds.min;
+        pMesh->scale = 3.0f / std::max(std::max(extent.x, extent.y), extent.z);
+        glm::vec3 base((bounds.min.x + bounds.max.x) * 0.5f, bounds.min.y, (bounds.min.z + bounds.max.z) * 0.5f);
+        pMesh->position = glm::vec3(3.5f, 0.0f, -1.5f) - base * pMesh->scale;
+        sceneObjects.push_back(pMesh);
+    }
+
+    sceneChanged = true;
+
     pCamera = std::make_shared<Camera>();
     pCamera->SetPositionAndFocalPoint(glm::vec3(0.0f, 5.0f, cameraDistance), glm::vec3(0.0f, 1.0f, 0.0f));
 
     pManipulator = std::make_shared<Manipulator>(pCamera);
+
+    pThreadPool = std::make_shared<ThreadPool>();
+    device_set_thread_pool(pThreadPool);
+    remote_workers_set_handler(ServeRemoteTile);
 }
 
 void render_destroy()
 {
+    checkpoint_close(checkpointFile);
     device_buffer_destroy(screenBufferData);
     screenBufferData = nullptr;
+    device_set_thread_pool(nullptr);
+    pThreadPool.reset();
 }
 
-SceneObject* FindNearestObject(glm::vec3 rayorig, glm::vec3 raydir, float& nearestDistance)
+bool FindNearestObject(const glm::vec3& rayorig, const glm::vec3& raydir, SceneHit& nearestHit)
 {
-    SceneObject* nearestObject = nullptr;
-    nearestDistance = std::numeric_limits<float>::max();
+    bool hit = false;
+    nearestHit.distance = std::numeric_limits<float>::max();
+    uint64_t tests = compiledScene.planes.size() + compiledScene.meshes.size();
 
-    // find intersection of this ray with the sphere in the scene
-    for (auto pObject : sceneObjects)
+    // find intersection of this ray with the planes in the scene
+    for (uint32_t i = 0; i < uint32_t(compiledScene.planes.size()); i++)
     {
         float distance;
-        if (pObject->Intersects(rayorig, raydir, distance) &&
-            nearestDistance > distance)
+        if (compiled_scene_intersect_plane(compiledScene.planes[i], rayorig, raydir, distance) &&
+            nearestHit.distance > distance)
         {
-            nearestObject = pObject.get();
-            nearestDistance = distance;
+            nearestHit.primitive = PrimitiveRef{ PrimitiveType::Plane, i };
+            nearestHit.distance = distance;
+            hit = true;
         }
     }
-    return nearestObject;
+
+    // Then walk the BVH for the spheres, skipping anything further away than the nearest hit so far.
+    // Sphere distances are along the normalized ray, so the tree is walked with the same direction
+    glm::vec3 dir = glm::normalize(raydir);
+    bvh_intersect(compiledScene.sphereBvh, rayorig, dir, nearestHit.distance, [&](uint32_t first, uint32_t count, float& maxDistance)
+    {
+        tests += count;
+        int nearest = useSimdIntersect ?
+            intersect_spheres(compiledScene, first, count, rayorig, dir, maxDistance) :
+            intersect_spheres_scalar(compiledScene, first, count, rayorig, dir, maxDistance);
+        if (nearest >= 0)
+        {
+            nearestHit.primitive = PrimitiveRef{ PrimitiveType::Sphere, uint32_t(nearest) };
+            hit = true;
+        }
+    });
+
+    for (uint32_t i = 0; i < uint32_t(compiledScene.meshes.size()); i++)
+    {
+        uint32_t triangle;
+        if (intersect_mesh(compiledScene.meshes[i], rayorig, dir, nearestHit.distance, triangle, useSimdIntersect))
+        {
+            nearestHit.primitive = PrimitiveRef{ PrimitiveType::Mesh, i, triangle };
+            hit = true;
+        }
+    }
+    frame_stats_count(FrameCounter::IntersectionTests, tests);
+    return hit;
+}
+
+// Is anything in the way along a ray, closer than maxDistance?  For shadows, where the nearest hit doesn't matter.
+// transmittance is how much light gets through: each occluder takes off its opacity, and the search stops as
+// soon as none is left, so the first opaque hit ends it
+bool FindAnyOccluder(const glm::vec3& rayorig, const glm::vec3& raydir, float maxDistance, float& transmittance)
+{
+    frame_stats_count(FrameCounter::ShadowRays);
+    frame_stats_count(FrameCounter::IntersectionTests, compiledScene.planes.size() + compiledScene.meshes.size());
+
+    bool hit = false;
+    transmittance = 1.0f;
+    auto occlude = [&](const Material& material)
+    {
+        hit = true;
+        transmittance = std::max(0.0f, transmittance - material.opacity);
+        return transmittance == 0.0f;
+    };
+
+    for (uint32_t i = 0; i < uint32_t(compiledScene.planes.size()); i++)
+    {
+        float distance;
+        if (compiled_scene_intersect_plane(compiledScene.planes[i], rayorig, raydir, distance) &&
+            distance < maxDistance &&
+            occlude(compiled_scene_material(compiledScene, PrimitiveRef{ PrimitiveType::Plane, i }, rayorig + raydir * distance)))
+        {
+            return true;
+        }
+    }
+
+    glm::vec3 dir = glm::normalize(raydir);
+    bool blocked = bvh_intersect_any(compiledScene.sphereBvh, rayorig, dir, maxDistance, [&](uint32_t first, uint32_t count)
+    {
+        frame_stats_count(FrameCounter::IntersectionTests, count);
+        uint32_t spheres = useSimdIntersect ?
+            intersect_spheres_mask(compiledScene, first, count, rayorig, dir, maxDistance) :
+            intersect_spheres_mask_scalar(compiledScene, first, count, rayorig, dir, maxDistance);
+        for (; spheres != 0; spheres &= spheres - 1)
+        {
+            if (occlude(compiledScene.materials[compiledScene.sphereMaterial[first + simd_first_lane(spheres)]]))
+            {
+                return true;
+            }
+        }
+        return false;
+    });
+    if (blocked)
+    {
+        return true;
+    }
+
+    // A mesh counts once, like a sphere, however many of its triangles are in the way
+    for (const auto& mesh : compiledScene.meshes)
+    {
+        if (intersect_mesh_any(mesh, rayorig, dir, maxDistance, useSimdIntersect) &&
+            occlude(compiledScene.materials[mesh.material]))
+        {
+            return true;
+        }
+    }
+    return hit;
 }
 
 glm::vec3 refract(const glm::vec3& I, const glm::vec3& N, const float &ior)
@@ -154,33 +372,88 @@ void fresnel(const glm::vec3& I, const glm::vec3& N, const float &ior, float &kr
     // kt = 1 - kr;
 }
 
-glm::vec3 TraceRay(const glm::vec3& ray_origin, const glm::vec3 &ray_dir, const int depth)
+glm::vec3 BackgroundColor(const glm::vec3& ray_dir)
 {
-    const SceneObject* nearestObject = nullptr;
-    float distance;
+    return glm::mix(backgroundColor, backgroundColor2, 1.0f - glm::clamp(glm::dot(ray_dir, glm::vec3(0.0f, 1.0f, 0.0f)), 0.0f, 1.0f));
+}
 
-    glm::vec3 back = glm::mix(backgroundColor, backgroundColor2, 1.0f - glm::clamp(glm::dot(ray_dir, glm::vec3(0.0f, 1.0f, 0.0f)), 0.0f, 1.0f));
+// The block of the image a pixel's influence is recorded in
+BlockInfluence& InfluenceBlockAt(int x, int y)
+{
+    int blocksWide = (screenBufferData->BufferWidth + PACKET_WIDTH - 1) / PACKET_WIDTH;
+    return blockInfluence[(y / PACKET_WIDTH) * blocksWide + (x / PACKET_WIDTH)];
+}
 
-    // Too deep
-    if (depth > MAX_DEPTH)
+// Record a ray segment that hit something at 'distance', or that missed if distance is negative.
+// A miss is followed to where it leaves influenceBounds, since nothing moved can be beyond that
+void RecordInfluenceRay(const glm::vec3& origin, const glm::vec3& direction, float distance)
+{
+    if (distance < 0.0f)
     {
-        return back;
+        glm::vec3 invDirection = bvh_inverse_direction(direction);
+        glm::vec3 t0 = (influenceBounds.min - origin) * invDirection;
+        glm::vec3 t1 = (influenceBounds.max - origin) * invDirection;
+        glm::vec3 tFar = glm::max(t0, t1);
+        distance = std::max(0.0f, std::min(std::min(tFar.x, tFar.y), tFar.z));
+        if (!std::isfinite(distance))
+        {
+            pRecordInfluence->rays.Grow(influenceBounds);
+            return;
+        }
     }
+    pRecordInfluence->rays.Grow(origin);
+    pRecordInfluence->rays.Grow(origin + direction * distance);
+}
+
+// A ray waiting to be traced, and how much its colour counts towards the pixel
+struct PendingRay
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float weight;
+    int depth;
+};
 
-    nearestObject = FindNearestObject(ray_origin, ray_dir, distance);
-    if (!nearestObject)
+// The rays still to trace for one pixel.  They are traced depth first, so each level of the tree leaves
+// at most one ray waiting and the stack never needs to be deeper than the tree
+#define RAY_STACK_SIZE (2 * (MAX_DEPTH + 2))
+struct RayStack
+{
+    PendingRay rays[RAY_STACK_SIZE];
+    int size = 0;
+    int traced = 0;                                         // Rays traced for this pixel so far
+};
+
+// Is a secondary ray worth tracing?  One that can't add enough to the pixel to matter ends straight away,
+// as if it had reached the depth limit
+bool RayWorthTracing(const PendingRay& ray)
+{
+    return !useRayCutoffs || ray.weight >= minRayContribution;
+}
+
+// Queue a secondary ray, or end it with its background colour added to 'color'
+void PushRay(RayStack& stack, glm::vec3& color, const PendingRay& ray)
+{
+    if (!RayWorthTracing(ray) || stack.size == RAY_STACK_SIZE)
     {
-        // Didn't hit an object, so return background color
-        return back;
+        color += BackgroundColor(ray.direction) * ray.weight;
+        return;
     }
+    stack.rays[stack.size++] = ray;
+}
 
+// Shade a ray that has hit something, returning its weighted colour.
+// The reflection and refraction rays it spawns are returned in pSecondary, the stronger one last
+glm::vec3 ShadeHit(const glm::vec3& ray_origin, const glm::vec3& ray_dir, const SceneHit& nearestHit, const int depth, const float weight, PendingRay* pSecondary, int& secondaryCount)
+{
     glm::vec3 outputColor = glm::vec3(0.0f, 0.0f, 0.0f);
+    secondaryCount = 0;
 
     // Where we hit on the surface
-    glm::vec3 hit_point = ray_origin + (ray_dir * distance);
+    glm::vec3 hit_point = ray_origin + (ray_dir * nearestHit.distance);
 
-    glm::vec3 normal = nearestObject->GetSurfaceNormal(hit_point);
-    const Material& material = nearestObject->GetMaterial(hit_point);
+    glm::vec3 normal = compiled_scene_normal(compiledScene, nearestHit.primitive, hit_point);
+    const Material& material = compiled_scene_material(compiledScene, nearestHit.primitive, hit_point);
 
     if (material.refractive_index != 1.0f && material.opacity < 1.0f)
     {
@@ -193,10 +466,14 @@ glm::vec3 TraceRay(const glm::vec3& ray_origin, const glm::vec3 &ray_dir, const
         glm::vec3 refract_direction = normalize(refract(ray_dir, normal, material.refractive_index));
         auto refract_start = (glm::dot(refract_direction, normal) > 0) ? (hit_point + normal * bias) : (hit_point - normal * bias);
 
-        auto reflection_color = TraceRay(reflect_start, reflect_direction, depth + 1);
-        auto refraction_color = TraceRay(refract_start, refract_direction, depth + 1);
+        // The stronger ray goes last, so on a stack it is traced first and gets the pick of the ray budget
+        PendingRay reflection = PendingRay{ reflect_start, reflect_direction, weight * kr * (1.0f - material.opacity), depth + 1 };
+        PendingRay refraction = PendingRay{ refract_start, refract_direction, weight * (1.0f - kr) * (1.0f - material.opacity), depth + 1 };
+        bool reflectionStronger = reflection.weight > refraction.weight;
+        pSecondary[secondaryCount++] = reflectionStronger ? refraction : reflection;
+        pSecondary[secondaryCount++] = reflectionStronger ? reflection : refraction;
 
-        outputColor = (reflection_color * kr + refraction_color * (1.0f - kr)) * (1.0f - material.opacity) + material.emissive;
+        outputColor = material.emissive * weight;
     }
 
     if (material.opacity > 0.0f)
@@ -205,35 +482,35 @@ glm::vec3 TraceRay(const glm::vec3& ray_origin, const glm::vec3 &ray_dir, const
         glm::vec3 specular_accumulation = glm::vec3(0.0f);
 
         // For every emitter, gather the light
-        for (auto& emitterObj : sceneObjects)
+        for (const auto& emitter : compiledScene.emitters)
         {
+            // Move hit point out slightly
+            auto light_origin = (glm::dot(ray_dir, normal) < 0) ? (hit_point + normal * bias) : (hit_point - normal * bias);
+
+            // Whether or not it lights this point, moving the emitter or anything near the way to it could change that
+            if (pRecordInfluence)
+            {
+                pRecordInfluence->emitters |= 1ull << (emitter.object % 64);
+                pRecordInfluence->shaded.Grow(light_origin);
+            }
+
             // Find the part of the object we hit
-            glm::vec3 light_dir = emitterObj->GetRayFrom(hit_point);
+            glm::vec3 light_dir = glm::normalize(emitter.center - hit_point);
             float light_distance;
 
-            // Move hit point out slightly
-            auto light_origin = (glm::dot(ray_dir, normal) < 0) ? (hit_point + normal * bias) : (hit_point - normal * bias);
+            // Far from the emitter the test can miss through lack of precision, so it can't be seen from here
+            if (!compiled_scene_intersect(compiledScene, emitter.primitive, light_origin + (light_dir * bias), light_dir, light_distance))
+                continue;
 
-            emitterObj->Intersects(light_origin + (light_dir * bias), light_dir, light_distance);
-            auto lightMaterial = emitterObj->GetMaterial(hit_point + light_dir * light_distance);
+            const Material& lightMaterial = compiled_scene_material(compiledScene, emitter.primitive, hit_point + light_dir * light_distance);
 
-            // It's not a light!
+            // Not the glowing part of the object
             if (lightMaterial.emissive == glm::vec3(0.0f))
                 continue;
 
-            float shadowFactor = 1.0f;
-            float nearestDistance;
-            auto nearestOccluder = FindNearestObject(light_origin, light_dir, nearestDistance);
-            if (nearestOccluder != nullptr)
-            {
-                if (nearestDistance < (light_distance))// - bias))
-                {
-                    // Quick fix for shadows through non-opaque objects!
-                    auto occluderMat = nearestOccluder->GetMaterial(hit_point + light_dir * nearestDistance);
-                    shadowFactor -= occluderMat.opacity;
-                    shadowFactor = std::max(0.0f, shadowFactor);
-                }
-            }
+            // Anything in the way takes off its opacity
+            float shadowFactor;
+            FindAnyOccluder(light_origin, light_dir, light_distance, shadowFactor);
 
             float l_dot_n = std::max(0.0f, dot(normal, light_dir));
             light_accumulation += (shadowFactor) * lightMaterial.emissive * l_dot_n;
@@ -241,17 +518,742 @@ glm::vec3 TraceRay(const glm::vec3& ray_origin, const glm::vec3 &ray_dir, const
             auto light_reflect_dir = glm::normalize(glm::reflect(-light_dir, normal));
             specular_accumulation += powf(std::max(0.0f, -glm::dot(light_reflect_dir, ray_dir)), material.specular_exponent) * lightMaterial.emissive;
         }
-        outputColor += (light_accumulation * material.albedo * material.opacity) + material.emissive + (material.specular * specular_accumulation * material.opacity);
+        outputColor += ((light_accumulation * material.albedo * material.opacity) + material.emissive + (material.specular * specular_accumulation * material.opacity)) * weight;
     }
     return outputColor;
 }
 
+glm::vec3 ShadeHitOntoStack(const glm::vec3& ray_origin, const glm::vec3& ray_dir, const SceneHit& nearestHit, const int depth, const float weight, RayStack& stack)
+{
+    PendingRay secondary[2];
+    int secondaryCount;
+    glm::vec3 color = ShadeHit(ray_origin, ray_dir, nearestHit, depth, weight, secondary, secondaryCount);
+    for (int i = 0; i < secondaryCount; i++)
+    {
+        PushRay(stack, color, secondary[i]);
+    }
+    return color;
+}
+
+// Trace the rays on the stack and all the rays they lead to, returning the sum of their weighted colours
+glm::vec3 TraceStack(RayStack& stack)
+{
+    glm::vec3 color = glm::vec3(0.0f);
+    while (stack.size > 0)
+    {
+        PendingRay ray = stack.rays[--stack.size];
+
+        // Too deep, or out of rays for this pixel
+        if (ray.depth > MAX_DEPTH || (useRayCutoffs && stack.traced >= maxRaysPerPixel))
+        {
+            color += BackgroundColor(ray.direction) * ray.weight;
+            continue;
+        }
+
+        stack.traced++;
+        frame_stats_count(ray.depth == 0 ? FrameCounter::PrimaryRays : FrameCounter::SecondaryRays);
+        SceneHit nearestHit;
+        bool hit = FindNearestObject(ray.origin, ray.direction, nearestHit);
+
+        // Primary rays are covered by the block's frustum
+        if (pRecordInfluence && ray.depth > 0)
+        {
+            RecordInfluenceRay(ray.origin, ray.direction, hit ? nearestHit.distance : -1.0f);
+        }
+
+        if (!hit)
+        {
+            // Didn't hit an object, so return background color
+            color += BackgroundColor(ray.direction) * ray.weight;
+            continue;
+        }
+        color += ShadeHitOntoStack(ray.origin, ray.direction, nearestHit, ray.depth, ray.weight, stack);
+    }
+    return color;
+}
+
+glm::vec3 TraceRay(const glm::vec3& ray_origin, const glm::vec3& ray_dir)
+{
+    RayStack stack;
+    stack.rays[stack.size++] = PendingRay{ ray_origin, ray_dir, 1.0f, 0 };
+    return TraceStack(stack);
+}
+
+// Trace a block of primary rays together, then shade each one; secondary rays are traced singly
+void TracePacket(const RayPacket& packet, glm::vec3* pColors)
+{
+    frame_stats_count(FrameCounter::PrimaryRays, packet.Count());
+
+    SceneHit hits[PACKET_SIZE];
+    uint32_t hitMask = packet_find_nearest(compiledScene, packet, hits, useSimdIntersect);
+    for (int i = 0; i < packet.Count(); i++)
+    {
+        if (hitMask & (1u << i))
+        {
+            RayStack stack;
+            stack.traced = 1;
+            pColors[i] = ShadeHitOntoStack(packet.origin, packet.direction[i], hits[i], 0, 1.0f, stack);
+            pColors[i] += TraceStack(stack);
+        }
+        else
+        {
+            pColors[i] = BackgroundColor(packet.direction[i]);
+        }
+    }
+}
+
+// Where a pixel's next sample goes on the image; each pixel steps through its own sequence, one sample per frame
+glm::vec2 PixelSample(int x, int y)
+{
+    uint32_t index = uint32_t(y * screenBufferData->BufferWidth + x);
+    return glm::vec2(x, y) + sampling_pixel_offset(index, pixelSamples[index]);
+}
+
+// Fill in a packet of primary rays for a block of pixels
+void BuildPacket(int x, int y, int width, int height, RayPacket& packet)
+{
+    packet.origin = pCamera->GetPosition();
+    packet.width = width;
+    packet.height = height;
+
+    glm::vec2 samples[PACKET_SIZE];
+    for (int ray = 0; ray < packet.Count(); ray++)
+    {
+        samples[ray] = PixelSample(x + (ray % width), y + (ray / width));
+    }
+    pCamera->GetWorldRays(samples, packet.direction, packet.Count());
+
+    // The samples are anywhere in their pixels, so the packet is bounded by the corners of the block
+    glm::vec2 corners[4] = {
+        glm::vec2(x, y),
+        glm::vec2(x + width, y),
+        glm::vec2(x + width, y + height),
+        glm::vec2(x, y + height)
+    };
+    pCamera->GetWorldRays(corners, packet.bounds, 4);
+}
+
+// Wavefront tracing.
+// Instead of following each pixel's ray tree to the end, a whole tile is traced one generation of rays at a time.
+// Every ray in a wave is intersected, the hits are sorted by material and shaded together, and the rays the
+// shading spawns make up the next wave.  Neighbouring work then touches the same geometry and materials.
+struct WavefrontRay
+{
+    PendingRay ray;
+    uint32_t pixel;                                         // Index in the tile
+};
+
+struct WavefrontHit
+{
+    SceneHit hit;
+    uint32_t ray;                                           // Index in the wave
+    uint32_t material;
+};
+
+// The queues are kept between tiles, so a thread only allocates them once
+struct WavefrontQueues
+{
+    std::vector<WavefrontRay> wave;
+    std::vector<WavefrontRay> nextWave;
+    std::vector<WavefrontHit> hits;
+    std::vector<int> pixelRays;                             // Rays traced for each pixel
+};
+
+void AddWavefrontHit(WavefrontQueues& queues, const SceneHit& hit, uint32_t ray)
+{
+    const WavefrontRay& waveRay = queues.wave[ray];
+    glm::vec3 hit_point = waveRay.ray.origin + waveRay.ray.direction * hit.distance;
+    const Material& material = compiled_scene_material(compiledScene, hit.primitive, hit_point);
+    queues.hits.push_back(WavefrontHit{ hit, ray, uint32_t(&material - compiledScene.materials.data()) });
+}
+
+// The influence record for a pixel of a tile, or nullptr when influence isn't being recorded
+BlockInfluence* TileInfluenceBlock(const Tile& tile, uint32_t pixel)
+{
+    if (blockInfluence.empty())
+    {
+        return nullptr;
+    }
+    return &InfluenceBlockAt(tile.x + int(pixel % tile.width), tile.y + int(pixel / tile.width));
+}
+
+// Trace one sample for every pixel of a tile, adding the colours to pColors, which is tile.width * tile.height
+void TraceTileWavefront(const Tile& tile, glm::vec3* pColors)
+{
+    static thread_local WavefrontQueues queues;
+    queues.wave.clear();
+    queues.hits.clear();
+    queues.pixelRays.assign(tile.width * tile.height, 1);
+
+    // The primary rays are coherent, so they are intersected in packets
+    for (int y = 0; y < tile.height; y += PACKET_WIDTH)
+    {
+        for (int x = 0; x < tile.width; x += PACKET_WIDTH)
+        {
+            RayPacket packet;
+            BuildPacket(tile.x + x, tile.y + y, std::min(PACKET_WIDTH, tile.width - x), std::min(PACKET_WIDTH, tile.height - y), packet);
+
+            frame_stats_count(FrameCounter::PrimaryRays, packet.Count());
+
+            SceneHit hits[PACKET_SIZE];
+            uint32_t hitMask = packet_find_nearest(compiledScene, packet, hits, useSimdIntersect);
+            for (int i = 0; i < packet.Count(); i++)
+            {
+                uint32_t pixel = uint32_t((y + i / packet.width) * tile.width + x + i % packet.width);
+                if (!(hitMask & (1u << i)))
+                {
+                    pColors[pixel] += BackgroundColor(packet.direction[i]);
+                    continue;
+                }
+                queues.wave.push_back(WavefrontRay{ PendingRay{ packet.origin, packet.direction[i], 1.0f, 0 }, pixel });
+                AddWavefrontHit(queues, hits[i], uint32_t(queues.wave.size() - 1));
+            }
+        }
+    }
+
+    while (!queues.hits.empty())
+    {
+        // Shade the hits material by material; ties keep the wave order, so the result doesn't depend on the sort
+        std::stable_sort(queues.hits.begin(), queues.hits.end(), [](const WavefrontHit& a, const WavefrontHit& b)
+        {
+            return a.material < b.material;
+        });
+
+        queues.nextWave.clear();
+        for (const auto& hit : queues.hits)
+        {
+            const WavefrontRay& waveRay = queues.wave[hit.ray];
+            PendingRay secondary[2];
+            int secondaryCount;
+            pRecordInfluence = TileInfluenceBlock(tile, waveRay.pixel);
+            pColors[waveRay.pixel] += ShadeHit(waveRay.ray.origin, waveRay.ray.direction, hit.hit, waveRay.ray.depth, waveRay.ray.weight, secondary, secondaryCount);
+            for (int i = 0; i < secondaryCount; i++)
+            {
+                if (RayWorthTracing(secondary[i]))
+                {
+                    queues.nextWave.push_back(WavefrontRay{ secondary[i], waveRay.pixel });
+                }
+                else
+                {
+                    pColors[waveRay.pixel] += BackgroundColor(secondary[i].direction) * secondary[i].weight;
+                }
+            }
+        }
+
+        // Intersect the next wave
+        queues.wave.swap(queues.nextWave);
+        queues.hits.clear();
+        for (uint32_t i = 0; i < uint32_t(queues.wave.size()); i++)
+        {
+            const WavefrontRay& waveRay = queues.wave[i];
+            int& pixelRays = queues.pixelRays[waveRay.pixel];
+
+            // Rays too deep, or beyond this pixel's budget, end as if they missed
+            bool trace = waveRay.ray.depth <= MAX_DEPTH && (!useRayCutoffs || pixelRays < maxRaysPerPixel);
+            if (trace)
+            {
+                pixelRays++;
+                frame_stats_count(FrameCounter::SecondaryRays);
+            }
+
+            SceneHit hit;
+            bool found = trace && FindNearestObject(waveRay.ray.origin, waveRay.ray.direction, hit);
+            pRecordInfluence = TileInfluenceBlock(tile, waveRay.pixel);
+            if (trace && pRecordInfluence)
+            {
+                RecordInfluenceRay(waveRay.ray.origin, waveRay.ray.direction, found ? hit.distance : -1.0f);
+            }
+
+            if (found)
+            {
+                AddWavefrontHit(queues, hit, i);
+            }
+            else
+            {
+                pColors[waveRay.pixel] += BackgroundColor(waveRay.ray.direction) * waveRay.ray.weight;
+            }
+        }
+    }
+}
+
+// The accumulation buffer has no alpha, so it is a plain array of vec3s
+glm::vec3* AccumulatedPixels()
+{
+    return (glm::vec3*)screenBufferData->pPixels;
+}
+
+float Luminance(const glm::vec3& color)
+{
+    return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Has every pixel in a rectangle settled down?  A pixel is done when the standard error of its mean luminance,
+// estimated from the samples so far, is under the threshold, or when it has had the most samples we allow
+bool RegionConverged(int regionX, int regionY, int width, int height)
+{
+    for (int y = regionY; y < regionY + height; y++)
+    {
+        for (int x = regionX; x < regionX + width; x++)
+        {
+            auto index = (y * screenBufferData->BufferWidth) + x;
+            uint32_t samples = pixelSamples[index];
+            if (samples < minAdaptiveSamples)
+            {
+                return false;
+            }
+            if (samples >= maxAdaptiveSamples)
+            {
+                continue;
+            }
+
+            float mean = Luminance(AccumulatedPixels()[index]);
+            float variance = std::max(0.0f, pixelLuminanceMoment[index] - mean * mean);
+            if (variance > adaptiveErrorThreshold * adaptiveErrorThreshold * float(samples))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Could a segment from anywhere in the ball (start, startRadius) to 'end' pass within 'radius' of 'point'?
+// The segments fill a cone, with its apex at 'end'; along its axis the cross section shrinks linearly
+bool ConeReaches(const glm::vec3& start, float startRadius, const glm::vec3& end, const glm::vec3& point, float radius)
+{
+    glm::vec3 axis = start - end;
+    float length = glm::length(axis);
+    if (length <= startRadius)
+    {
+        return glm::length(point - start) <= startRadius + radius;
+    }
+    axis /= length;
+
+    // The distance to the ball of the cross section at 'fraction' along the axis is convex in it, so its minimum
+    // is where it stops falling, clamped to the cone
+    float along = glm::dot(point - end, axis);
+    float across = glm::length(point - end - axis * along);
+    float fraction = glm::clamp((along + across * startRadius / sqrtf(length * length - startRadius * startRadius)) / length, 0.0f, 1.0f);
+    return glm::length(point - (end + axis * (fraction * length))) - fraction * startRadius <= radius;
+}
+
+// Could a shadow ray from the block to one of its emitters pass within 'radius' of 'center'?
+bool ShadowsCouldChange(const BlockInfluence& influence, const glm::vec3& center, float radius)
+{
+    if (influence.emitters == 0)
+    {
+        return false;
+    }
+
+    glm::vec3 shadedCenter = (influence.shaded.min + influence.shaded.max) * 0.5f;
+    float shadedRadius = glm::length(influence.shaded.max - influence.shaded.min) * 0.5f;
+    for (const auto& emitter : compiledScene.emitters)
+    {
+        if ((influence.emitters & (1ull << (emitter.object % 64))) == 0)
+        {
+            continue;
+        }
+
+        // Shadow rays end where they meet the emitter, which for a sphere or plane is before its centre; a mesh may
+        // be met anywhere in its bounds
+        float endRadius = 0.0f;
+        if (emitter.primitive.type == PrimitiveType::Mesh)
+        {
+            const AABB& bounds = compiledScene.meshes[emitter.primitive.index].bounds;
+            endRadius = glm::length(bounds.max - bounds.min) * 0.5f;
+        }
+
+        if (ConeReaches(shadedCenter, shadedRadius, emitter.center, center, radius + endRadius))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Move a sphere, and restart only the blocks of the image the move could change: those it was or is now seen in,
+// those whose secondary or shadow rays could pass where it was or is now, and those that gathered its light.
+// When that can't be worked out, the whole image restarts
+void MoveObject(SceneObject* pObject, const glm::vec3& offset)
+{
+    auto pSphere = static_cast<Sphere*>(pObject);
+    AABB before;
+    AABB after;
+    pSphere->GetBounds(before);
+    glm::vec3 centerBefore = pSphere->center;
+    pSphere->center += offset;
+    pSphere->GetBounds(after);
+    sceneChanged = true;
+    step = true;
+
+    size_t pixelCount = screenBufferData ? size_t(screenBufferData->BufferWidth) * screenBufferData->BufferHeight : 0;
+    if (currentSample == 0 ||
+        previewScale > 1 ||
+        pixelSamples.size() != pixelCount ||
+        blockInfluence.empty() ||
+        !influenceBounds.Contains(after))
+    {
+        currentSample = 0;
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    uint32_t object = uint32_t(std::find_if(sceneObjects.begin(), sceneObjects.end(), [&](const std::shared_ptr<SceneObject>& spObject)
+    {
+        return spObject.get() == pObject;
+    }) - sceneObjects.begin());
+    uint64_t objectBit = 1ull << (object % 64);
+
+    const int width = screenBufferData->BufferWidth;
+    const int height = screenBufferData->BufferHeight;
+    uint32_t restarted = 0;
+    for (int y = 0; y < height; y += PACKET_WIDTH)
+    {
+        for (int x = 0; x < width; x += PACKET_WIDTH)
+        {
+            int blockWidth = std::min(PACKET_WIDTH, width - x);
+            int blockHeight = std::min(PACKET_WIDTH, height - y);
+            BlockInfluence& influence = InfluenceBlockAt(x, y);
+            bool affected = (influence.emitters & objectBit) != 0 ||
+                influence.rays.Overlaps(before) ||
+                influence.rays.Overlaps(after) ||
+                ShadowsCouldChange(influence, centerBefore, pSphere->radius) ||
+                ShadowsCouldChange(influence, pSphere->center, pSphere->radius);
+
+            // Seen directly, if it is inside the frustum of the block's primary rays
+            if (!affected)
+            {
+                RayPacket packet;
+                glm::vec2 corners[4] = {
+                    glm::vec2(x, y),
+                    glm::vec2(x + blockWidth, y),
+                    glm::vec2(x + blockWidth, y + blockHeight),
+                    glm::vec2(x, y + blockHeight)
+                };
+                pCamera->GetWorldRays(corners, packet.bounds, 4);
+
+                PacketFrustum frustum;
+                packet_build_frustum(packet, frustum);
+                affected = !packet_frustum_culls(frustum, pCamera->GetPosition(), before) ||
+                    !packet_frustum_culls(frustum, pCamera->GetPosition(), after);
+            }
+
+            if (affected)
+            {
+                for (int yy = y; yy < y + blockHeight; yy++)
+                {
+                    for (int xx = x; xx < x + blockWidth; xx++)
+                    {
+                        pixelSamples[yy * width + xx] = 0;
+                        pixelLuminanceMoment[yy * width + xx] = 0.0f;
+                    }
+                }
+                influence = BlockInfluence();
+                restarted++;
+            }
+        }
+    }
+    imageConverged = false;
+
+    char message[128];
+    snprintf(message, sizeof(message), "Moved an object: restarted %u of %u blocks in %.2fms", restarted, uint32_t(blockInfluence.size()),
+        std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+    device_log(message);
+}
+
+// Trace one ray through the middle of each scale x scale block of pixels, and fill the block with it.
+// The pixel sample counts are left alone, so the first full resolution sample replaces the preview
+void TracePreview(const std::vector<Tile>& tiles, int scale)
+{
+    tileScheduler.Run(*pThreadPool, tiles, [&](const Tile& tile)
+    {
+        FrameStageTimer timer(FrameStage::Trace);
+
+        // Tiles are a multiple of the largest block size, so blocks never straddle them
+        for (int y = tile.y; y < tile.y + tile.height; y += scale)
+        {
+            for (int x = tile.x; x < tile.x + tile.width; x += scale)
+            {
+                auto ray = pCamera->GetWorldRay(glm::vec2(x, y) + glm::vec2(scale * 0.5f));
+                glm::vec3 color = TraceRay(ray.position, ray.direction);
+                for (int yy = y; yy < std::min(y + scale, tile.y + tile.height); yy++)
+                {
+                    for (int xx = x; xx < std::min(x + scale, tile.x + tile.width); xx++)
+                    {
+                        AccumulatedPixels()[(yy * screenBufferData->BufferWidth) + xx] = color;
+                    }
+                }
+            }
+        }
+    });
+}
+
+// The scene, and the settings that change what the pixels converge to
+uint64_t CheckpointSceneHash()
+{
+    uint64_t hash = checkpoint_scene_hash(compiledScene);
+    int maxDepth = MAX_DEPTH;
+    hash = checkpoint_hash(hash, &maxDepth, sizeof(maxDepth));
+    hash = checkpoint_hash(hash, &useRayCutoffs, sizeof(useRayCutoffs));
+    hash = checkpoint_hash(hash, &minRayContribution, sizeof(minRayContribution));
+    return checkpoint_hash(hash, &maxRaysPerPixel, sizeof(maxRaysPerPixel));
+}
+
+CheckpointState CheckpointStateNow()
+{
+    CheckpointState state;
+    state.width = screenBufferData->BufferWidth;
+    state.height = screenBufferData->BufferHeight;
+    state.sceneHash = CheckpointSceneHash();
+    state.camera = pCamera->GetPose();
+    state.sampleCount = uint32_t(currentSample);
+    state.pColors = AccumulatedPixels();
+    state.pSamples = pixelSamples.data();
+    state.pLuminanceMoments = pixelLuminanceMoment.data();
+    return state;
+}
+
+// Carry on from a checkpoint, if there is one for this scene and image size.  The arrays must already be sized.
+// What the rays depended on wasn't saved, so the next object moved restarts the whole image
+void ResumeFromCheckpoint()
+{
+    CheckpointState state = CheckpointStateNow();
+    if (!checkpoint_read(pCheckpointPath, state))
+    {
+        return;
+    }
+
+    pCamera->SetPose(state.camera);
+    currentSample = int(state.sampleCount);
+    checkpointSample = currentSample;
+    previewScale = 1;
+    imageConverged = false;
+    influenceBounds = AABB();
+
+    char message[128];
+    snprintf(message, sizeof(message), "Resumed from %s at %d samples", pCheckpointPath, currentSample);
+    device_log(message);
+}
+
+// Save the accumulation if it has moved on since the last save, and it is time to or 'c' asked for it
+void CheckpointIfDue()
+{
+    auto now = std::chrono::steady_clock::now();
+    bool due = std::chrono::duration<float>(now - lastCheckpoint).count() >= checkpointInterval;
+    if (!useCheckpoints || currentSample == checkpointSample || (!due && !checkpointRequested))
+    {
+        return;
+    }
+    checkpointRequested = false;
+
+    char message[128];
+    if (checkpoint_write(checkpointFile, pCheckpointPath, CheckpointStateNow()))
+    {
+        snprintf(message, sizeof(message), "Checkpointed %d samples to %s in %.2fms", currentSample, pCheckpointPath,
+            std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - now).count());
+    }
+    else
+    {
+        snprintf(message, sizeof(message), "Failed to checkpoint to %s", pCheckpointPath);
+    }
+    device_log(message);
+    lastCheckpoint = now;
+    checkpointSample = currentSample;
+}
+
+// Send tiles to the workers, and merge in what they trace.  Returns the tiles they didn't trace
+std::vector<Tile> TraceTilesRemotely(const std::vector<Tile>& tiles)
+{
+    RemoteTileRequest header = {};
+    header.sceneHash = CheckpointSceneHash();
+    header.camera = pCamera->GetPose();
+    header.imageWidth = screenBufferData->BufferWidth;
+    header.imageHeight = screenBufferData->BufferHeight;
+    header.sampleCount = remoteSamples;
+    header.useRayCutoffs = useRayCutoffs ? 1 : 0;
+    header.minRayContribution = minRayContribution;
+    header.maxRaysPerPixel = maxRaysPerPixel;
+
+    std::vector<glm::vec3> centers;
+    for (auto& spObject : sceneObjects)
+    {
+        if (spObject->GetSceneObjectType() == SceneObjectType::Sphere)
+        {
+            centers.push_back(static_cast<Sphere*>(spObject.get())->center);
+        }
+    }
+    header.sphereCount = uint32_t(centers.size());
+
+    std::vector<std::vector<uint8_t>> requests(tiles.size());
+    for (size_t job = 0; job < tiles.size(); job++)
+    {
+        const Tile& tile = tiles[job];
+        header.tile = tile;
+        auto& request = requests[job];
+        request.resize(sizeof(header) + centers.size() * sizeof(glm::vec3) + size_t(tile.width) * tile.height * sizeof(uint32_t));
+        memcpy(request.data(), &header, sizeof(header));
+        memcpy(request.data() + sizeof(header), centers.data(), centers.size() * sizeof(glm::vec3));
+        auto pFirstSamples = (uint32_t*)(request.data() + sizeof(header) + centers.size() * sizeof(glm::vec3));
+        for (int y = 0; y < tile.height; y++)
+        {
+            memcpy(pFirstSamples + y * tile.width, &pixelSamples[(tile.y + y) * screenBufferData->BufferWidth + tile.x], tile.width * sizeof(uint32_t));
+        }
+    }
+
+    // Each tile is in one job, so replies can be merged as they arrive, on the threads that receive them
+    std::vector<uint8_t> traced(tiles.size(), 0);
+    remote_workers_run(requests, [&](uint32_t job, const std::vector<uint8_t>& reply)
+    {
+        const Tile& tile = tiles[job];
+        size_t tilePixels = size_t(tile.width) * tile.height;
+        if (reply.size() != tilePixels * (sizeof(glm::vec3) + sizeof(float)))
+        {
+            return;
+        }
+
+        auto pColors = (const glm::vec3*)reply.data();
+        auto pMoments = (const float*)(pColors + tilePixels);
+
+        // A bad reply would spoil the pixels for good, so the tile is left to be traced here instead
+        for (size_t pixel = 0; pixel < tilePixels; pixel++)
+        {
+            if (!std::isfinite(pColors[pixel].x) || !std::isfinite(pColors[pixel].y) || !std::isfinite(pColors[pixel].z) ||
+                !std::isfinite(pMoments[pixel]))
+            {
+                return;
+            }
+        }
+
+        const float samples = float(remoteSamples);
+        for (int y = 0; y < tile.height; y++)
+        {
+            for (int x = 0; x < tile.width; x++)
+            {
+                auto index = ((tile.y + y) * screenBufferData->BufferWidth) + tile.x + x;
+                auto& bufferVal = AccumulatedPixels()[index];
+                const float k1 = float(pixelSamples[index]);
+                const float k2 = 1.f / (k1 + samples);
+                bufferVal = ((bufferVal * k1) + pColors[y * tile.width + x] * samples) * k2;
+                pixelLuminanceMoment[index] = ((pixelLuminanceMoment[index] * k1) + pMoments[y * tile.width + x] * samples) * k2;
+                pixelSamples[index] += remoteSamples;
+            }
+        }
+        traced[job] = 1;
+    });
+    influenceBounds = AABB();
+
+    std::vector<Tile> untraced;
+    for (size_t job = 0; job < tiles.size(); job++)
+    {
+        if (traced[job])
+        {
+            frame_stats_count(FrameCounter::Samples, uint64_t(tiles[job].width) * tiles[job].height * remoteSamples);
+        }
+        else
+        {
+            untraced.push_back(tiles[job]);
+        }
+    }
+    return untraced;
+}
+
+// Trace a tile for the coordinator, on a worker
+bool ServeRemoteTile(const std::vector<uint8_t>& request, std::vector<uint8_t>& reply)
+{
+    RemoteTileRequest header;
+    if (request.size() < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, request.data(), sizeof(header));
+
+    // Anyone can connect to a coordinator's port, so nothing in a request is traced until it makes sense
+    const Tile& tile = header.tile;
+    if (header.sampleCount == 0 || header.sampleCount > remoteSamples * MaxRemoteSamplesScale ||
+        header.imageWidth <= 0 || header.imageHeight <= 0 ||
+        tile.width <= 0 || tile.height <= 0 || tile.x < 0 || tile.y < 0 ||
+        tile.x > header.imageWidth - tile.width || tile.y > header.imageHeight - tile.height)
+    {
+        device_log("Ignored a request for a tile that isn't in the image, or for too many samples");
+        return false;
+    }
+    size_t tilePixels = size_t(tile.width) * tile.height;
+    if (request.size() != sizeof(header) + header.sphereCount * sizeof(glm::vec3) + tilePixels * sizeof(uint32_t))
+    {
+        return false;
+    }
+
+    // Move the spheres to where the coordinator has them; anything else that differs shows up in the hash
+    auto pCenters = (const glm::vec3*)(request.data() + sizeof(header));
+    uint32_t sphere = 0;
+    for (auto& spObject : sceneObjects)
+    {
+        if (spObject->GetSceneObjectType() == SceneObjectType::Sphere && sphere < header.sphereCount)
+        {
+            auto pSphere = static_cast<Sphere*>(spObject.get());
+            if (pSphere->center != pCenters[sphere])
+            {
+                pSphere->center = pCenters[sphere];
+                sceneChanged = true;
+            }
+            sphere++;
+        }
+    }
+    useRayCutoffs = header.useRayCutoffs != 0;
+    minRayContribution = header.minRayContribution;
+    maxRaysPerPixel = header.maxRaysPerPixel;
+    if (sceneChanged)
+    {
+        compiled_scene_build(compiledScene, sceneObjects);
+        sceneChanged = false;
+    }
+    if (CheckpointSceneHash() != header.sceneHash)
+    {
+        device_log("This worker's scene isn't the coordinator's");
+        return false;
+    }
+
+    pCamera->SetFilmSize(float(header.imageWidth), float(header.imageHeight));
+    pCamera->SetPose(header.camera);
+    pCamera->PreRender();
+
+    auto pFirstSamples = (const uint32_t*)(pCenters + header.sphereCount);
+    reply.resize(tilePixels * (sizeof(glm::vec3) + sizeof(float)));
+    auto pColors = (glm::vec3*)reply.data();
+    auto pMoments = (float*)(pColors + tilePixels);
+    pThreadPool->ParallelFor(uint32_t(tile.height), [&](uint32_t y)
+    {
+        for (int x = 0; x < tile.width; x++)
+        {
+            uint32_t pixel = y * tile.width + x;
+            int imageX = tile.x + x;
+            int imageY = tile.y + int(y);
+            uint32_t index = uint32_t(imageY * header.imageWidth + imageX);
+
+            glm::vec3 color(0.0f);
+            float moment = 0.0f;
+            for (uint32_t sample = 0; sample < header.sampleCount; sample++)
+            {
+                auto ray = pCamera->GetWorldRay(glm::vec2(imageX, imageY) + sampling_pixel_offset(index, pFirstSamples[pixel] + sample));
+                glm::vec3 sampleColor = TraceRay(ray.position, ray.direction);
+                float luminance = Luminance(sampleColor);
+                color += sampleColor;
+                moment += luminance * luminance;
+            }
+            pColors[pixel] = color / float(header.sampleCount);
+            pMoments[pixel] = moment / float(header.sampleCount);
+        }
+    });
+    return true;
+}
+
 void render_update()
 {
     bool changed = pCamera->PreRender();
     if (changed)
     {
         currentSample = 0;
+        previewScale = useProgressiveResolution ? MaxPreviewScale : 1;
     }
 }
 
@@ -259,47 +1261,194 @@ void render_redraw()
 {
     if (!screenBufferData)
     {
-        screenBufferData = device_buffer_create();
+        // The accumulation is the finished image, so it can be rendered straight into a file
+        if (deviceParams.pMappedOutput)
+        {
+            screenBufferData = device_buffer_map(deviceParams.pMappedOutput, 0, 0, BufferFormat::RGB32F);
+        }
+        if (!screenBufferData)
+        {
+            screenBufferData = device_buffer_create(0, 0, BufferFormat::RGB32F);
+        }
     }
     device_buffer_ensure_screen_size(screenBufferData);
 
-    auto t = time(NULL);
-    std::srand(currentSample == 0 ? 0 : (unsigned int)t);
+    if (sceneChanged)
+    {
+        compiled_scene_build(compiledScene, sceneObjects);
+        sceneChanged = false;
+    }
+
+    // Start the sample counts again when the image is reset or resized
+    size_t pixelCount = size_t(screenBufferData->BufferWidth) * screenBufferData->BufferHeight;
+    if (currentSample == 0 || pixelSamples.size() != pixelCount)
+    {
+        pixelSamples.assign(pixelCount, 0);
+        pixelLuminanceMoment.assign(pixelCount, 0.0f);
+        imageConverged = false;
+
+        // Leave room around the scene, so most moves stay inside the bounds the rays were followed to
+        int blocksWide = (screenBufferData->BufferWidth + PACKET_WIDTH - 1) / PACKET_WIDTH;
+        int blocksHigh = (screenBufferData->BufferHeight + PACKET_WIDTH - 1) / PACKET_WIDTH;
+        blockInfluence.assign(size_t(blocksWide) * blocksHigh, BlockInfluence());
+        influenceBounds = compiledScene.bounds;
+        glm::vec3 extent = influenceBounds.max - influenceBounds.min;
+        float margin = std::max(std::max(extent.x, extent.y), extent.z);
+        influenceBounds.min -= glm::vec3(margin);
+        influenceBounds.max += glm::vec3(margin);
+
+        lastCheckpoint = std::chrono::steady_clock::now();
+        checkpointSample = 0;
+    }
+
+    // The first time there is an image to fill, pick up where a previous run left off
+    if (useCheckpoints && !checkpointResumeTried)
+    {
+        checkpointResumeTried = true;
+        ResumeFromCheckpoint();
+    }
+
+    auto accumulate = [&](int x, int y, const glm::vec3& color)
+    {
+        auto index = (y * screenBufferData->BufferWidth) + x;
+        auto& bufferVal = AccumulatedPixels()[index];
+
+        // Running means of the colour and of the squared luminance
+        const float k1 = float(pixelSamples[index]);
+        const float k2 = 1.f / (k1 + 1.f);
+        bufferVal = ((bufferVal * k1) + color) * k2;
+
+        float luminance = Luminance(color);
+        pixelLuminanceMoment[index] = ((pixelLuminanceMoment[index] * k1) + luminance * luminance) * k2;
+        pixelSamples[index]++;
+        frame_stats_count(FrameCounter::Samples);
+    };
+
+    auto tiles = tiles_build(screenBufferData->BufferWidth, screenBufferData->BufferHeight, tileSize);
 
-    std::vector<std::shared_ptr<std::thread>> threads;
+    // A coarse frame while the camera is moving; each still frame after that halves the block size
+    if (previewScale > 1)
+    {
+        TracePreview(tiles, previewScale);
+        previewScale /= 2;
+        device_buffer_set_to_display(screenBufferData);
+        return;
+    }
+
+    if (useAdaptiveSampling)
+    {
+        // Only tiles that haven't converged get another sample
+        std::vector<uint8_t> converged(tiles.size());
+        pThreadPool->ParallelFor(uint32_t(tiles.size()), [&](uint32_t tile)
+        {
+            const Tile& t = tiles[tile];
+            converged[tile] = RegionConverged(t.x, t.y, t.width, t.height);
+        });
+
+        std::vector<Tile> activeTiles;
+        for (size_t tile = 0; tile < tiles.size(); tile++)
+        {
+            if (!converged[tile])
+            {
+                activeTiles.push_back(tiles[tile]);
+            }
+        }
+
+        if (activeTiles.empty())
+        {
+            if (!imageConverged)
+            {
+                char message[64];
+                snprintf(message, sizeof(message), "Converged after %d samples", currentSample);
+                device_log(message);
+                imageConverged = true;
+            }
+            CheckpointIfDue();
+            device_buffer_set_to_display(screenBufferData);
+            return;
+        }
+        tiles.swap(activeTiles);
+    }
 
-    const float k1 = float(currentSample);
-    const float k2 = 1.f / (k1 + 1.f);
-    glm::vec2 sample = glm::linearRand(glm::vec2(0.0f), glm::vec2(1.0f));
-    for (int i = 0; i < partitions; i++)
+    // Tiles the workers don't take are traced here, with one sample a pixel as usual.  The frame only counts as
+    // the workers' samples if they traced all of it
+    int samplesTraced = 1;
+    if (remote_workers_count() > 0)
+    {
+        tiles = TraceTilesRemotely(tiles);
+        if (tiles.empty())
+        {
+            samplesTraced = int(remoteSamples);
+        }
+    }
+    tileScheduler.Run(*pThreadPool, tiles, [&](const Tile& tile)
     {
-        auto pT = std::make_shared<std::thread>([&](int offset)
+        FrameStageTimer timer(FrameStage::Trace);
+        if (traceMode == TraceMode::Wavefront)
         {
-            for (int y = offset; y < screenBufferData->BufferHeight; y += partitions)
+            // Kept per thread, like the wavefront queues, so tiles don't allocate
+            static thread_local std::vector<glm::vec3> colors;
+            colors.assign(size_t(tile.width) * tile.height, glm::vec3(0.0f));
+            TraceTileWavefront(tile, colors.data());
+            pRecordInfluence = nullptr;
+            for (int y = 0; y < tile.height; y++)
             {
-                for (int x = 0; x < screenBufferData->BufferWidth; x += 1)
+                for (int x = 0; x < tile.width; x++)
                 {
-                    glm::vec3 color{ 0.0f, 0.0f, 0.0f };
-                    auto offset = sample + glm::vec2(x, y);
+                    accumulate(tile.x + x, tile.y + y, colors[y * tile.width + x]);
+                }
+            }
+            return;
+        }
 
-                    auto ray = pCamera->GetWorldRay(offset);
-                    color += TraceRay(ray.position, ray.direction, 0);
+        for (int y = tile.y; y < tile.y + tile.height; y += PACKET_WIDTH)
+        {
+            for (int x = tile.x; x < tile.x + tile.width; x += PACKET_WIDTH)
+            {
+                int width = std::min(PACKET_WIDTH, tile.x + tile.width - x);
+                int height = std::min(PACKET_WIDTH, tile.y + tile.height - y);
 
-                    auto index = (y * screenBufferData->BufferWidth) + x;
-                    auto& bufferVal = screenBufferData->buffer[index];
+                // Converged blocks inside an unfinished tile are skipped too
+                if (useAdaptiveSampling && RegionConverged(x, y, width, height))
+                {
+                    continue;
+                }
+                pRecordInfluence = &InfluenceBlockAt(x, y);
 
-                    bufferVal = ((bufferVal * k1) + glm::vec4(color, 1.0f)) * k2;
+                if (usePackets)
+                {
+                    RayPacket packet;
+                    BuildPacket(x, y, width, height, packet);
+
+                    glm::vec3 colors[PACKET_SIZE];
+                    TracePacket(packet, colors);
+                    for (int ray = 0; ray < packet.Count(); ray++)
+                    {
+                        accumulate(x + (ray % width), y + (ray / width), colors[ray]);
+                    }
+                }
+                else
+                {
+                    for (int yy = y; yy < y + height; yy++)
+                    {
+                        for (int xx = x; xx < x + width; xx++)
+                        {
+                            auto ray = pCamera->GetWorldRay(PixelSample(xx, yy));
+                            accumulate(xx, yy, TraceRay(ray.position, ray.direction));
+                        }
+                    }
                 }
             }
-        }, i);
-        threads.push_back(pT);
-    }
+        }
+        pRecordInfluence = nullptr;
+    });
+    currentSample += samplesTraced;
+    CheckpointIfDue();
 
-    for (auto& t : threads)
+    if (logTileTimings)
     {
-        t->join();
+        device_log(tileScheduler.GetReport().c_str());
     }
-    currentSample++;
 
     device_buffer_set_to_display(screenBufferData);
 }
@@ -318,7 +1467,7 @@ void render_key_pressed(char key)
     }
     else if (key == 'p')
     {
-        pause = !pause;
+        paused = !paused;
     }
     else if (key == ' ')
     {
@@ -326,8 +1475,56 @@ void render_key_pressed(char key)
     }
     else if (key == 'b')
     {
-        auto pBitmap = bitmap_create_from_buffer(screenBufferData->buffer, screenBufferData->BufferWidth, screenBufferData->BufferHeight);
-        bitmap_write(pBitmap, "rayout.bmp");
+        image_write_async(screenBufferData, "rayout.bmp");
+    }
+    else if (key == 'c')
+    {
+        checkpointRequested = true;
+    }
+    else if (key == 'i')
+    {
+        useSimdIntersect = !useSimdIntersect;
+        currentSample = 0;
+    }
+    else if (key == 'k')
+    {
+        usePackets = !usePackets;
+        currentSample = 0;
+    }
+    else if (key == '[')
+    {
+        tileSize = std::max(8, tileSize / 2);
+    }
+    else if (key == ']')
+    {
+        tileSize = std::min(256, tileSize * 2);
+    }
+    else if (key == 't')
+    {
+        logTileTimings = !logTileTimings;
+    }
+    else if (key == 'v')
+    {
+        useAdaptiveSampling = !useAdaptiveSampling;
+    }
+    else if (key == 'm')
+    {
+        traceMode = traceMode == TraceMode::Whitted ? TraceMode::Wavefront : TraceMode::Whitted;
+        currentSample = 0;
+    }
+    else if (key == 'r')
+    {
+        useProgressiveResolution = !useProgressiveResolution;
+    }
+    else if (key == 'g')
+    {
+        // Linear, sRGB, then tonemapped
+        deviceParams.encoding = PixelEncoding((int(deviceParams.encoding) + 1) % 3);
+    }
+    else if (key == 'u')
+    {
+        useRayCutoffs = !useRayCutoffs;
+        currentSample = 0;
     }
     else if (key == '+')
     {
@@ -339,17 +1536,19 @@ void render_key_pressed(char key)
     }
     else if (key == 'd')
     {
-        auto pSphere = (Sphere*)pMoveLight;
-        pSphere->center.x += .1f;
-        currentSample = 0;
-        step = true;
+        MoveObject(pMoveLight, glm::vec3(.1f, 0.0f, 0.0f));
     }
     else if (key == 'a')
     {
-        auto pSphere = (Sphere*)pMoveLight;
-        pSphere->center.x -= .1f;
-        currentSample = 0;
-        step = true;
+        MoveObject(pMoveLight, glm::vec3(-.1f, 0.0f, 0.0f));
+    }
+    else if (key == 'l')
+    {
+        MoveObject(pMoveObject, glm::vec3(.1f, 0.0f, 0.0f));
+    }
+    else if (key == 'j')
+    {
+        MoveObject(pMoveObject, glm::vec3(-.1f, 0.0f, 0.0f));
     }
 }
 
@@ -1,6 +1,9 @@
 #pragma once
 #include "device.h"
+#include "image_writer.h"
+#include <cassert>
 #include <cstdio>
+#include <cstdlib>
 
 // This header implements a simple bitmap object, with writing to a file.
 // It doesn't require any windows headers.
@@ -27,25 +30,12 @@ static Bitmap* bitmap_create(int width, int height)
     return pBitmap;
 }
 
-static Bitmap* bitmap_create_from_buffer(glm::vec4* buffer, int width, int height)
+static Bitmap* bitmap_create_from_buffer(const BufferData* pBuffer)
 {
-    auto pBitmap = bitmap_create(width, height);
+    auto pBitmap = bitmap_create(pBuffer->BufferWidth, pBuffer->BufferHeight);
 
-    for (int y = 0; y < height; y++)
-    {
-        for (auto x = 0; x < width; x++)
-        {
-            Color* pTarget = ((Color*)pBitmap->pData) + (y * pBitmap->width) + (x);
-            glm::vec4 source = buffer[(y * width) + x];
-            source = glm::clamp(source, glm::vec4(0.0f), glm::vec4(1.0f));
-           
-            // BufferData is RGB!
-            auto converted = glm::u8vec3(source * 255.0f);
-            pTarget->blue = converted.r;
-            pTarget->green = converted.g;
-            pTarget->red = converted.b;
-        }
-    }
+    // BufferData is RGB!  The Color fields are filled in reverse, so the pixels are laid out as BGR
+    device_buffer_convert(pBuffer, (uint8_t*)pBitmap->pData, pBitmap->width * int(sizeof(Color)), PixelLayout::BGR8, deviceParams.encoding);
     return pBitmap;
 }
 
@@ -104,107 +94,21 @@ static void bitmap_set_color(Bitmap* pBitmap, const Color& color)
         }
     }
 }
-/*
-This rather hacky function to write a bitmap is taken from here.
-Just give it the size of your array and the RGB (24Bit)
-https://en.wikipedia.org/wiki/User:Evercat/Buddhabrot.c
-*/
-static void bitmap_write(Bitmap* pBitmap, char * filename)
+// Write the bitmap as a 24 bit BMP, through the image writer
+static bool bitmap_write(Bitmap* pBitmap, const char* filename)
 {
-    uint32_t headers[13];
-    int extrabytes;
-    int paddedsize;
-    int x; int y; int n;
-
-    extrabytes = 4 - ((pBitmap->width * 3) % 4);                 // How many bytes of padding to add to each
-                                                        // horizontal line - the size of which must
-                                                        // be a multiple of 4 bytes.
-    if (extrabytes == 4)
-        extrabytes = 0;
-
-    paddedsize = ((pBitmap->width * 3) + extrabytes) * pBitmap->height;
-
-    // Headers...
-    // Note that the "BM" identifier in bytes 0 and 1 is NOT included in these "headers".
-
-    headers[0] = paddedsize + 54;      // bfSize (whole file size)
-    headers[1] = 0;                    // bfReserved (both)
-    headers[2] = 54;                   // bfOffbits
-    headers[3] = 40;                   // biSize
-    headers[4] = pBitmap->width;  // biWidth
-    headers[5] = pBitmap->height; // biHeight
-
-                         // Would have biPlanes and biBitCount in position 6, but they're shorts.
-                         // It's easier to write them out separately (see below) than pretend
-                         // they're a single int, especially with endian issues...
-
-    headers[7] = 0;                    // biCompression
-    headers[8] = paddedsize;           // biSizeImage
-    headers[9] = 0;                    // biXPelsPerMeter
-    headers[10] = 0;                    // biYPelsPerMeter
-    headers[11] = 0;                    // biClrUsed
-    headers[12] = 0;                    // biClrImportant
-
-    FILE* outfile = nullptr;
-    if (fopen_s(&outfile, filename, "wb") != 0)
+    ImagePixels pixels;
+    pixels.width = pBitmap->width;
+    pixels.height = pBitmap->height;
+    pixels.format = ImageFileFormat::BMP;
+    pixels.data.assign((const uint8_t*)pBitmap->pData, (const uint8_t*)(pBitmap->pData + pBitmap->width * pBitmap->height));
+
+    ImageWriteOptions options;
+    options.format = ImageFileFormat::BMP;
+    if (!image_write_pixels(pixels, filename, options))
     {
         assert(!"Failed to write bitmap file!");
-        return;
+        return false;
     }
-
-    //
-    // Headers begin...
-    // When printing ints and shorts, we write out 1 character at a time to avoid endian issues.
-    //
-
-    fprintf(outfile, "BM");
-
-    for (n = 0; n <= 5; n++)
-    {
-        fprintf(outfile, "%c", headers[n] & 0x000000FF);
-        fprintf(outfile, "%c", (headers[n] & 0x0000FF00) >> 8);
-        fprintf(outfile, "%c", (headers[n] & 0x00FF0000) >> 16);
-        fprintf(outfile, "%c", (headers[n] & (uint32_t)0xFF000000) >> 24);
-    }
-
-    // These next 4 characters are for the biPlanes and biBitCount fields.
-
-    fprintf(outfile, "%c", 1);
-    fprintf(outfile, "%c", 0);
-    fprintf(outfile, "%c", 24);
-    fprintf(outfile, "%c", 0);
-
-    for (n = 7; n <= 12; n++)
-    {
-        fprintf(outfile, "%c", headers[n] & 0x000000FF);
-        fprintf(outfile, "%c", (headers[n] & 0x0000FF00) >> 8);
-        fprintf(outfile, "%c", (headers[n] & 0x00FF0000) >> 16);
-        fprintf(outfile, "%c", (headers[n] & (uint32_t)0xFF000000) >> 24);
-    }
-
-    //
-    // Headers done, now write the data...
-    //
-
-    for (y = pBitmap->height - 1; y >= 0; y--)     // BMP image format is written from bottom to top...
-    {
-        for (x = 0; x <= pBitmap->width - 1; x++)
-        {
-            // Also, it's written in (b,g,r) format...
-            Color& col = bitmap_get_pixel(pBitmap, x, y);
-            fprintf(outfile, "%c", col.blue);
-            fprintf(outfile, "%c", col.green);
-            fprintf(outfile, "%c", col.red);
-        }
-        if (extrabytes)      // See above - BMP lines must be of lengths divisible by 4.
-        {
-            for (n = 1; n <= extrabytes; n++)
-            {
-                fprintf(outfile, "%c", 0);
-            }
-        }
-    }
-
-    fclose(outfile);
-    return;
+    return true;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <chrono>
 #include <glm/gtx/rotate_vector.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/random.hpp>
@@ -8,7 +9,7 @@
 
 /** Build a unit quaternion representing the rotation
  * from u to v. The input vectors need not be normalised. */
-glm::quat QuatFromVectors(glm::vec3 u, glm::vec3 v)
+inline glm::quat QuatFromVectors(glm::vec3 u, glm::vec3 v)
 {
     float norm_u_norm_v = sqrt(dot(u, u) * dot(v, v));
     float real_part = norm_u_norm_v + dot(u, v);
@@ -32,6 +33,16 @@ glm::quat QuatFromVectors(glm::vec3 u, glm::vec3 v)
     return glm::normalize(glm::quat(real_part, w.x, w.y, w.z));
 }
 
+// Where a camera is and which way it faces; enough to put it back exactly as it was
+struct CameraPose
+{
+    glm::vec3 position;
+    glm::vec3 focalPoint;
+    glm::vec3 viewDirection;
+    glm::quat orientation;
+    float fieldOfView;
+};
+
 struct Ray
 {
     glm::vec3 position;
@@ -96,6 +107,24 @@ public:
         UpdateRightUp();
     }
 
+    CameraPose GetPose() const
+    {
+        return CameraPose{ position, focalPoint, viewDirection, orientation, fieldOfView };
+    }
+
+    // Any movement still settling is dropped
+    void SetPose(const CameraPose& pose)
+    {
+        position = pose.position;
+        focalPoint = pose.focalPoint;
+        viewDirection = pose.viewDirection;
+        orientation = pose.orientation;
+        fieldOfView = pose.fieldOfView;
+        orbitDelta = glm::vec2(0.0f);
+        positionDelta = glm::vec3(0.0f);
+        UpdateRightUp();
+    }
+
     void SetFilmSize(float width, float height)
     {
         filmWidth = width;
@@ -147,24 +176,17 @@ public:
     // Given a screen coordinate, return a ray leaving the camera and entering the world at that 'pixel'
     Ray GetWorldRay(const glm::vec2& imageSample)
     {
-        // Could move some of this maths out of here for speed, but this isn't time critical
-        //glm::vec3 dir(viewDirection);
-
-        auto dir = viewDirection;
-        float x = ((imageSample.x * 2.0f) / filmWidth) - 1.0f;
-        float y = ((imageSample.y * 2.0f) / filmHeight) - 1.0f;
-
-        // Take the view direction and adjust it to point at the given sample, based on the 
-        // the frustum 
-        dir += (right * (halfAngle * aspectRatio * x));
-        dir -= (up * (halfAngle * y));
-        //dir = normalize(dir);
-        float ft = (glm::length(focalPoint - position) - 1.0f) / glm::length(dir);
-        glm::vec3 focasPoint = position + dir * ft;
-
-        dir = glm::normalize(focasPoint - position);
+        return Ray{ position, GetWorldRayDirection(imageSample, glm::length(focalPoint - position) - 1.0f) };
+    }
 
-        return Ray{ position, dir };
+    // Batched GetWorldRay, for a packet of neighbouring samples; all the rays start at the camera position
+    void GetWorldRays(const glm::vec2* pImageSamples, glm::vec3* pDirections, int count)
+    {
+        float focalDistance = glm::length(focalPoint - position) - 1.0f;
+        for (int i = 0; i < count; i++)
+        {
+            pDirections[i] = GetWorldRayDirection(pImageSamples[i], focalDistance);
+        }
     }
 
     void Dolly(float distance)
@@ -228,6 +250,23 @@ public:
     }
 
 private:
+    glm::vec3 GetWorldRayDirection(const glm::vec2& imageSample, float focalDistance) const
+    {
+        auto dir = viewDirection;
+        float x = ((imageSample.x * 2.0f) / filmWidth) - 1.0f;
+        float y = ((imageSample.y * 2.0f) / filmHeight) - 1.0f;
+
+        // Take the view direction and adjust it to point at the given sample, based on the 
+        // the frustum 
+        dir += (right * (halfAngle * aspectRatio * x));
+        dir -= (up * (halfAngle * y));
+        //dir = normalize(dir);
+        float ft = focalDistance / glm::length(dir);
+        glm::vec3 focasPoint = position + dir * ft;
+
+        return glm::normalize(focasPoint - position);
+    }
+
     void UpdateRightUp()
     {
         // Right and up vectors updated based on the quaternion orientation
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory>
+
 #include "camera.h"
 #include "device.h"
 
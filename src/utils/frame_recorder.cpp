@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_recorder.h"
+#include "image_writer.h"
+
+namespace
+{
+
+// Find the frame number in an image sequence's path: the first %d, or %<width>d up to 2 digits, in the file name.  Any other '%'
+// is part of the name.  Returns false if there isn't one
+bool find_frame_number(const std::string& path, size_t& start, size_t& length, int& width, bool& zeroPad)
+{
+    size_t nameStart = path.find_last_of("/\\");
+    nameStart = nameStart == std::string::npos ? 0 : nameStart + 1;
+    for (size_t percent = path.find('%', nameStart); percent != std::string::npos; percent = path.find('%', percent + 1))
+    {
+        size_t end = percent + 1;
+        while (end < path.size() && path[end] >= '0' && path[end] <= '9' && end - percent <= 2)
+        {
+            end++;
+        }
+        if (end < path.size() && path[end] == 'd')
+        {
+            start = percent;
+            length = end + 1 - percent;
+            width = end > percent + 1 ? atoi(path.substr(percent + 1, end - percent - 1).c_str()) : 0;
+            zeroPad = end > percent + 1 && path[percent + 1] == '0';
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string frame_path(const std::string& pattern, uint64_t frame)
+{
+    size_t start;
+    size_t length;
+    int width;
+    bool zeroPad;
+    if (!find_frame_number(pattern, start, length, width, zeroPad))
+    {
+        return pattern;
+    }
+
+    char number[128];
+    snprintf(number, sizeof(number), zeroPad ? "%0*llu" : "%*llu", width, (unsigned long long)frame);
+    return pattern.substr(0, start) + number + pattern.substr(start + length);
+}
+
+class Recorder
+{
+public:
+    RecordSettings settings;
+
+    // Filled by the render thread, and emptied by the writer; 'captured' and 'written' count frames through the ring
+    std::vector<BufferData*> slots;
+    uint64_t captured = 0;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    uint64_t skipped = 0;
+
+    std::mutex mutex;
+    std::condition_variable filled;                         // Signalled when a frame is captured, or on stop
+    std::condition_variable freed;                          // Signalled when a frame is written
+    bool stopping = false;
+    std::thread worker;
+
+    // Only used by the writer
+    FILE* pFile = nullptr;
+    bool failed = false;
+    std::vector<uint8_t> rgb;
+    std::vector<uint8_t> planes;
+
+    explicit Recorder(const RecordSettings& recordSettings)
+        : settings(recordSettings)
+    {
+    }
+
+    ~Recorder()
+    {
+        for (auto pSlot : slots)
+        {
+            device_buffer_destroy(pSlot);
+        }
+        if (pFile)
+        {
+            fclose(pFile);
+        }
+    }
+
+    void Start()
+    {
+        worker = std::thread([this]() { WriterLoop(); });
+    }
+
+    void Stop()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        filled.notify_one();
+        worker.join();
+    }
+
+private:
+    void WriterLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            filled.wait(lock, [this]() { return stopping || captured != written; });
+            if (captured == written)
+            {
+                return;
+            }
+
+            // The slot is the writer's until 'written' moves past it
+            const BufferData* pFrame = slots[written % slots.size()];
+            uint64_t frame = written;
+            lock.unlock();
+
+            if (!failed && !WriteFrame(pFrame, frame))
+            {
+                failed = true;
+                device_log(("Recording failed to write to " + settings.path).c_str());
+            }
+
+            lock.lock();
+            written++;
+            freed.notify_one();
+        }
+    }
+
+    bool WriteFrame(const BufferData* pFrame, uint64_t frame)
+    {
+        int width = pFrame->BufferWidth;
+        int height = pFrame->BufferHeight;
+        if (settings.format == RecordFormat::Images)
+        {
+            std::string path = frame_path(settings.path, frame);
+            ImageWriteOptions options = image_write_options(path.c_str());
+            options.encoding = settings.encoding;
+            return image_write(pFrame, path.c_str(), options);
+        }
+
+        // This isn't the render thread, so the conversion doesn't use the device's thread pool
+        size_t pixelCount = size_t(width) * height;
+        rgb.resize(pixelCount * 3);
+        device_buffer_convert(pFrame, rgb.data(), width * 3, PixelLayout::RGB8, settings.encoding);
+        if (settings.format == RecordFormat::RawRGB)
+        {
+            return fwrite(rgb.data(), 1, rgb.size(), pFile) == rgb.size();
+        }
+
+        if (frame == 0)
+        {
+            fprintf(pFile, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, settings.framesPerSecond);
+        }
+
+        // BT.601, in studio range, as whole planes of Y, then Cb, then Cr
+        planes.resize(pixelCount * 3);
+        uint8_t* pY = planes.data();
+        uint8_t* pU = pY + pixelCount;
+        uint8_t* pV = pU + pixelCount;
+        for (size_t i = 0; i < pixelCount; i++)
+        {
+            int r = rgb[i * 3];
+            int g = rgb[i * 3 + 1];
+            int b = rgb[i * 3 + 2];
+            pY[i] = uint8_t(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+            pU[i] = uint8_t(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+            pV[i] = uint8_t(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+        }
+        return fwrite("FRAME\n", 1, 6, pFile) == 6 &&
+            fwrite(planes.data(), 1, planes.size(), pFile) == planes.size();
+    }
+};
+
+std::unique_ptr<Recorder> spRecorder;                       // Only touched by the render thread
+
+}
+
+RecordSettings frame_recorder_settings(const char* pPath)
+{
+    RecordSettings settings;
+    settings.path = pPath;
+    settings.encoding = deviceParams.encoding;
+
+    std::string path(pPath);
+    size_t dot = path.find_last_of('.');
+    size_t start;
+    size_t length;
+    int width;
+    bool zeroPad;
+    if (find_frame_number(path, start, length, width, zeroPad))
+    {
+        settings.format = RecordFormat::Images;
+    }
+    else if (dot != std::string::npos && path.substr(dot) == ".y4m")
+    {
+        settings.format = RecordFormat::Y4M;
+    }
+    else
+    {
+        settings.format = RecordFormat::RawRGB;
+    }
+    return settings;
+}
+
+bool frame_recorder_start(const RecordSettings& settings)
+{
+    if (spRecorder)
+    {
+        device_log("Already recording");
+        return false;
+    }
+
+    std::unique_ptr<Recorder> spNew(new Recorder(settings));
+    if (settings.format != RecordFormat::Images)
+    {
+#ifdef _MSC_VER
+        if (fopen_s(&spNew->pFile, settings.path.c_str(), "wb") != 0)
+        {
+            spNew->pFile = nullptr;
+        }
+#else
+        spNew->pFile = fopen(settings.path.c_str(), "wb");
+#endif
+        if (!spNew->pFile)
+        {
+            device_log(("Failed to open " + settings.path + " to record to").c_str());
+            return false;
+        }
+    }
+
+    spRecorder = std::move(spNew);
+    spRecorder->Start();
+    device_log(("Recording to " + settings.path).c_str());
+    return true;
+}
+
+void frame_recorder_capture(const BufferData* pData)
+{
+    if (!spRecorder)
+    {
+        return;
+    }
+    Recorder& recorder = *spRecorder;
+
+    // The ring is allocated to match the first frame
+    if (recorder.slots.empty())
+    {
+        for (uint32_t slot = 0; slot < std::max(1u, recorder.settings.ringFrames); slot++)
+        {
+            recorder.slots.push_back(device_buffer_create(pData->BufferWidth, pData->BufferHeight, pData->format));
+        }
+    }
+
+    const BufferData* pFirst = recorder.slots[0];
+    if (pData->BufferWidth != pFirst->BufferWidth ||
+        pData->BufferHeight != pFirst->BufferHeight ||
+        pData->format != pFirst->format)
+    {
+        recorder.skipped++;
+        return;
+    }
+
+    BufferData* pSlot;
+    {
+        std::unique_lock<std::mutex> lock(recorder.mutex);
+        if (recorder.captured - recorder.written == recorder.slots.size())
+        {
+            if (recorder.settings.overflow == RecordOverflow::Drop)
+            {
+                recorder.dropped++;
+                return;
+            }
+            recorder.freed.wait(lock, [&]() { return recorder.captured - recorder.written < recorder.slots.size(); });
+        }
+        pSlot = recorder.slots[recorder.captured % recorder.slots.size()];
+    }
+
+    // The slot is free until 'captured' moves past it, so it is copied outside the lock
+    memcpy(pSlot->pPixels, pData->pPixels, device_buffer_pixel_size(pData->format) * pData->BufferWidth * pData->BufferHeight);
+
+    {
+        std::unique_lock<std::mutex> lock(recorder.mutex);
+        recorder.captured++;
+    }
+    recorder.filled.notify_one();
+}
+
+void frame_recorder_stop()
+{
+    if (!spRecorder)
+    {
+        return;
+    }
+
+    spRecorder->Stop();
+    char message[256];
+    snprintf(message, sizeof(message), "Recorded %llu frames to %s; dropped %llu, skipped %llu of the wrong size",
+        (unsigned long long)spRecorder->written, spRecorder->settings.path.c_str(),
+        (unsigned long long)spRecorder->dropped, (unsigned long long)spRecorder->skipped);
+    device_log(message);
+    spRecorder.reset();
+}
+
+bool frame_recorder_is_recording()
+{
+    return spRecorder != nullptr;
+}
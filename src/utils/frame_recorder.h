@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "device.h"
+
+// Records every frame the device presents, for capturing animations.
+// The device hands each frame to frame_recorder_capture, which copies it into a ring of preallocated frames and
+// returns; a background thread converts and writes them.  The render loop never waits on the file.  When the
+// writer falls behind and the ring is full, frames are dropped, or, if asked for, capture waits for a free slot.
+//
+// All frames of a recording must be the size and format of the first; others are skipped.
+enum class RecordFormat
+{
+    Y4M,                                                    // YUV4MPEG2 stream, 4:4:4; plays in ffplay and mpv
+    RawRGB,                                                 // 8 bit RGB frames back to back, for ffmpeg -f rawvideo -pix_fmt rgb24
+    Images                                                  // Numbered image files, through the image writer
+};
+
+enum class RecordOverflow
+{
+    Drop,                                                   // Drop frames when the ring is full; for interactive capture
+    Wait                                                    // Wait for the writer; for offline renders, where every frame counts
+};
+
+struct RecordSettings
+{
+    std::string path;                                       // For Images, with %d or %05d in the file name for the frame number
+    RecordFormat format = RecordFormat::Y4M;
+    RecordOverflow overflow = RecordOverflow::Drop;
+    uint32_t ringFrames = 8;
+    int framesPerSecond = 30;                               // Written in the Y4M header
+    PixelEncoding encoding = PixelEncoding::Linear;
+};
+
+// Settings for a path: a %d in the file name, optionally with a width like %05d, makes it an image sequence, .y4m a
+// Y4M stream, and anything else raw RGB.  Any other '%' is just part of the name
+RecordSettings frame_recorder_settings(const char* pPath);
+
+// Start recording; returns false, and logs why, if the output can't be opened or a recording is running
+bool frame_recorder_start(const RecordSettings& settings);
+
+// Copy a presented frame into the ring; does nothing unless recording
+void frame_recorder_capture(const BufferData* pData);
+
+// Stop recording, after the frames in the ring are written, and log what was recorded
+void frame_recorder_stop();
+
+bool frame_recorder_is_recording();
@@ -0,0 +1,163 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "device.h"
+#include "frame_stats.h"
+
+thread_local FrameThreadStats* pFrameThreadStats = nullptr;
+
+namespace
+{
+struct AlignedFree
+{
+    void operator()(FrameThreadStats* pStats) const
+    {
+#ifdef _WIN32
+        _aligned_free(pStats);
+#else
+        free(pStats);
+#endif
+    }
+};
+
+// The blocks are owned here rather than by their threads, so they stay valid if a thread exits mid frame
+std::mutex threadStatsMutex;
+std::vector<std::unique_ptr<FrameThreadStats, AlignedFree>> threadStats;
+
+FrameStats lastFrame;
+FrameStats total;
+FrameStats sinceLog;
+bool started = false;
+std::chrono::high_resolution_clock::time_point lastFrameEnd;
+float logInterval = 1.0f;
+}
+
+FrameThreadStats* frame_stats_register_thread()
+{
+    void* pMemory;
+#ifdef _WIN32
+    pMemory = _aligned_malloc(sizeof(FrameThreadStats), alignof(FrameThreadStats));
+#else
+    if (posix_memalign(&pMemory, alignof(FrameThreadStats), sizeof(FrameThreadStats)) != 0)
+    {
+        pMemory = nullptr;
+    }
+#endif
+    if (!pMemory)
+    {
+        throw std::bad_alloc();
+    }
+
+    // All the members are plain numbers, so zeroing the memory makes the block
+    std::unique_ptr<FrameThreadStats, AlignedFree> spStats((FrameThreadStats*)pMemory);
+    memset(spStats.get(), 0, sizeof(FrameThreadStats));
+
+    std::lock_guard<std::mutex> lock(threadStatsMutex);
+    threadStats.push_back(std::move(spStats));
+    return threadStats.back().get();
+}
+
+static void frame_stats_add(FrameStats& target, const FrameStats& source)
+{
+    target.frames += source.frames;
+    for (uint32_t counter = 0; counter < FrameCounterCount; counter++)
+    {
+        target.counters[counter] += source.counters[counter];
+    }
+    for (uint32_t stage = 0; stage < FrameStageCount; stage++)
+    {
+        target.stageMilliseconds[stage] += source.stageMilliseconds[stage];
+    }
+    target.milliseconds += source.milliseconds;
+    target.threads = source.threads;
+}
+
+void frame_stats_end_frame()
+{
+    auto now = std::chrono::high_resolution_clock::now();
+
+    lastFrame = FrameStats();
+    lastFrame.frames = 1;
+    lastFrame.milliseconds = started ? std::chrono::duration<double, std::milli>(now - lastFrameEnd).count() : 0.0;
+    {
+        std::lock_guard<std::mutex> lock(threadStatsMutex);
+        for (auto& spStats : threadStats)
+        {
+            for (uint32_t counter = 0; counter < FrameCounterCount; counter++)
+            {
+                lastFrame.counters[counter] += spStats->counters[counter];
+            }
+            for (uint32_t stage = 0; stage < FrameStageCount; stage++)
+            {
+                lastFrame.stageMilliseconds[stage] += spStats->stageMilliseconds[stage];
+            }
+            memset(spStats.get(), 0, sizeof(FrameThreadStats));
+        }
+        lastFrame.threads = uint32_t(threadStats.size());
+    }
+
+    // Nothing marks the start of the first frame, so its wall time is taken from its stages
+    if (!started)
+    {
+        lastFrame.milliseconds = lastFrame.stageMilliseconds[uint32_t(FrameStage::Update)] + lastFrame.stageMilliseconds[uint32_t(FrameStage::Redraw)];
+        started = true;
+    }
+    lastFrameEnd = now;
+
+    frame_stats_add(total, lastFrame);
+    frame_stats_add(sinceLog, lastFrame);
+    if (logInterval > 0.0f && sinceLog.milliseconds >= logInterval * 1000.0)
+    {
+        device_log(frame_stats_report(sinceLog).c_str());
+        sinceLog = FrameStats();
+    }
+}
+
+const FrameStats& frame_stats_last()
+{
+    return lastFrame;
+}
+
+const FrameStats& frame_stats_total()
+{
+    return total;
+}
+
+void frame_stats_set_log_interval(float seconds)
+{
+    logInterval = seconds;
+}
+
+std::string frame_stats_report(const FrameStats& stats)
+{
+    if (stats.frames == 0)
+    {
+        return "No frames";
+    }
+
+    auto perFrame = [&](FrameStage stage) { return stats.stageMilliseconds[uint32_t(stage)] / stats.frames; };
+    auto perSecond = [&](FrameCounter counter) { return stats.milliseconds > 0.0 ? stats.counters[uint32_t(counter)] / (stats.milliseconds * 1000.0) : 0.0; };
+
+    // How much of the redraw time the threads spent tracing; low numbers mean idle threads
+    double traceBusy = stats.stageMilliseconds[uint32_t(FrameStage::Redraw)] * stats.threads;
+    traceBusy = traceBusy > 0.0 ? 100.0 * stats.stageMilliseconds[uint32_t(FrameStage::Trace)] / traceBusy : 0.0;
+
+    char report[512];
+    snprintf(report, sizeof(report), "%llu frames, %.2fms/frame: update %.2f redraw %.2f trace %.2f display %.2fms, %u threads %.0f%% busy tracing; "
+        "M/s: %.2f primary %.2f secondary %.2f shadow rays, %.2f tests, %.2f samples, %.2f pixels",
+        (unsigned long long)stats.frames, stats.milliseconds / stats.frames,
+        perFrame(FrameStage::Update), perFrame(FrameStage::Redraw), perFrame(FrameStage::Trace), perFrame(FrameStage::Display),
+        stats.threads, traceBusy,
+        perSecond(FrameCounter::PrimaryRays), perSecond(FrameCounter::SecondaryRays), perSecond(FrameCounter::ShadowRays),
+        perSecond(FrameCounter::IntersectionTests), perSecond(FrameCounter::Samples), perSecond(FrameCounter::Pixels));
+    return report;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Per frame counters and stage timings.
+// Every thread counts into its own block, so recording costs an add to memory no other thread touches.
+// The blocks are summed and cleared by frame_stats_end_frame, which the device calls after each frame, when
+// the worker threads are idle.  The summed stats are available through frame_stats_last and frame_stats_total,
+// and are logged every so often.
+
+enum class FrameCounter : uint32_t
+{
+    PrimaryRays,
+    SecondaryRays,                                          // Reflection and refraction rays
+    ShadowRays,
+    IntersectionTests,                                      // Primitives tested; a mesh counts once, not per triangle
+    Samples,                                                // Pixel samples added to the image
+    Pixels,                                                 // Pixels sent to the display
+    Count
+};
+
+enum class FrameStage : uint32_t
+{
+    Update,                                                 // render_update
+    Redraw,                                                 // render_redraw, including Trace and Display
+    Trace,                                                  // Summed over the threads doing the work
+    Display,                                                // device_buffer_set_to_display
+    Count
+};
+
+const uint32_t FrameCounterCount = uint32_t(FrameCounter::Count);
+const uint32_t FrameStageCount = uint32_t(FrameStage::Count);
+
+struct FrameStats
+{
+    uint64_t frames = 0;
+    uint64_t counters[FrameCounterCount] = {};
+    double stageMilliseconds[FrameStageCount] = {};
+    double milliseconds = 0.0;                              // Wall time the frames took, end to end
+    uint32_t threads = 0;                                   // Threads that have recorded anything
+};
+
+#define FRAME_STATS_CACHE_LINE 64
+
+// The block a thread records into; aligned, and padded to whole lines, so two threads never share a cache line.
+// It is allocated by frame_stats_register_thread, as new only aligns to 16 bytes before C++17
+struct alignas(FRAME_STATS_CACHE_LINE) FrameThreadStats
+{
+    uint64_t counters[FrameCounterCount];
+    double stageMilliseconds[FrameStageCount];
+    uint8_t padding[FRAME_STATS_CACHE_LINE - (sizeof(uint64_t) * FrameCounterCount + sizeof(double) * FrameStageCount) % FRAME_STATS_CACHE_LINE];
+};
+static_assert(sizeof(FrameThreadStats) % FRAME_STATS_CACHE_LINE == 0, "FrameThreadStats must fill whole cache lines");
+
+extern thread_local FrameThreadStats* pFrameThreadStats;
+FrameThreadStats* frame_stats_register_thread();
+
+inline FrameThreadStats& frame_stats_thread()
+{
+    if (!pFrameThreadStats)
+    {
+        pFrameThreadStats = frame_stats_register_thread();
+    }
+    return *pFrameThreadStats;
+}
+
+inline void frame_stats_count(FrameCounter counter, uint64_t count = 1)
+{
+    frame_stats_thread().counters[uint32_t(counter)] += count;
+}
+
+// Adds the time until it goes out of scope to a stage
+class FrameStageTimer
+{
+private:
+    FrameStage stage;
+    std::chrono::high_resolution_clock::time_point start;
+
+public:
+    explicit FrameStageTimer(FrameStage frameStage)
+        : stage(frameStage),
+        start(std::chrono::high_resolution_clock::now())
+    {
+    }
+
+    ~FrameStageTimer()
+    {
+        frame_stats_thread().stageMilliseconds[uint32_t(stage)] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+};
+
+// Sum and clear every thread's block.  Only call it when no other thread is recording
+void frame_stats_end_frame();
+
+// The last frame, and everything since the start
+const FrameStats& frame_stats_last();
+const FrameStats& frame_stats_total();
+
+// How often frame_stats_end_frame logs a summary of the frames since the last one; 0 stops it
+void frame_stats_set_log_interval(float seconds);
+
+// One line: time per stage per frame, and rays, tests and samples per second
+std::string frame_stats_report(const FrameStats& stats);
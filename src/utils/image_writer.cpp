@@ -0,0 +1,636 @@
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "image_writer.h"
+
+namespace
+{
+
+const size_t WriteBlockSize = 1 << 20;                      // Bytes gathered before each fwrite
+const size_t MaxQueuedImages = 4;                           // image_write_async waits when the writer is this far behind
+
+// Gathers the file in a block of memory, and writes it out a block at a time
+class FileWriter
+{
+private:
+    FILE* pFile = nullptr;
+    std::vector<uint8_t> block;
+    bool failed = false;
+
+public:
+    explicit FileWriter(const char* pPath)
+    {
+#ifdef _MSC_VER
+        if (fopen_s(&pFile, pPath, "wb") != 0)
+        {
+            pFile = nullptr;
+        }
+#else
+        pFile = fopen(pPath, "wb");
+#endif
+        failed = pFile == nullptr;
+        block.reserve(WriteBlockSize);
+    }
+
+    ~FileWriter()
+    {
+        Close();
+    }
+
+    void Append(const void* pData, size_t size)
+    {
+        auto pBytes = (const uint8_t*)pData;
+        while (size > 0 && !failed)
+        {
+            size_t count = std::min(size, WriteBlockSize - block.size());
+            block.insert(block.end(), pBytes, pBytes + count);
+            pBytes += count;
+            size -= count;
+            if (block.size() == WriteBlockSize)
+            {
+                WriteBlock();
+            }
+        }
+    }
+
+    void Append16(uint16_t value)
+    {
+        uint8_t bytes[2] = { uint8_t(value), uint8_t(value >> 8) };
+        Append(bytes, sizeof(bytes));
+    }
+
+    void Append32(uint32_t value)
+    {
+        uint8_t bytes[4] = { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) };
+        Append(bytes, sizeof(bytes));
+    }
+
+    void Append32BigEndian(uint32_t value)
+    {
+        uint8_t bytes[4] = { uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value) };
+        Append(bytes, sizeof(bytes));
+    }
+
+    // Returns false if anything failed to write
+    bool Close()
+    {
+        if (pFile)
+        {
+            WriteBlock();
+            failed |= fclose(pFile) != 0;
+            pFile = nullptr;
+        }
+        return !failed;
+    }
+
+private:
+    void WriteBlock()
+    {
+        if (!block.empty() && !failed)
+        {
+            failed = fwrite(block.data(), 1, block.size(), pFile) != block.size();
+        }
+        block.clear();
+    }
+};
+
+void write_bmp(const ImagePixels& pixels, FileWriter& writer)
+{
+    // Rows are padded to 4 bytes, and stored bottom to top
+    size_t rowSize = size_t(pixels.width) * 3;
+    size_t paddedRowSize = (rowSize + 3) & ~size_t(3);
+    uint32_t imageSize = uint32_t(paddedRowSize * pixels.height);
+
+    writer.Append("BM", 2);
+    writer.Append32(54 + imageSize);                        // File size
+    writer.Append32(0);                                     // Reserved
+    writer.Append32(54);                                    // Offset of the pixels
+    writer.Append32(40);                                    // Size of the info header
+    writer.Append32(uint32_t(pixels.width));
+    writer.Append32(uint32_t(pixels.height));
+    writer.Append16(1);                                     // Planes
+    writer.Append16(24);                                    // Bits per pixel
+    writer.Append32(0);                                     // No compression
+    writer.Append32(imageSize);
+    writer.Append32(0);                                     // Pixels per meter, x and y
+    writer.Append32(0);
+    writer.Append32(0);                                     // Palette colours, and important ones
+    writer.Append32(0);
+
+    const uint8_t padding[3] = {};
+    for (int y = pixels.height - 1; y >= 0; y--)
+    {
+        writer.Append(pixels.data.data() + y * rowSize, rowSize);
+        writer.Append(padding, paddedRowSize - rowSize);
+    }
+}
+
+void write_ppm(const ImagePixels& pixels, FileWriter& writer)
+{
+    char header[64];
+    int headerSize = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", pixels.width, pixels.height);
+    writer.Append(header, size_t(headerSize));
+    writer.Append(pixels.data.data(), pixels.data.size());
+}
+
+void write_pfm(const ImagePixels& pixels, FileWriter& writer)
+{
+    // A negative scale means little endian floats; rows are stored bottom to top
+    char header[64];
+    int headerSize = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", pixels.width, pixels.height);
+    writer.Append(header, size_t(headerSize));
+
+    size_t rowSize = size_t(pixels.width) * 3 * sizeof(float);
+    for (int y = pixels.height - 1; y >= 0; y--)
+    {
+        writer.Append(pixels.data.data() + y * rowSize, rowSize);
+    }
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t* pData, size_t size)
+{
+    static const struct CrcTable
+    {
+        uint32_t entries[256];
+        CrcTable()
+        {
+            for (uint32_t n = 0; n < 256; n++)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                {
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                entries[n] = c;
+            }
+        }
+    } table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table.entries[(crc ^ pData[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t adler32(const uint8_t* pData, size_t size)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+    while (size > 0)
+    {
+        // The most bytes that can be summed before b might overflow
+        size_t count = std::min(size, size_t(5552));
+        for (size_t i = 0; i < count; i++)
+        {
+            a += pData[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        pData += count;
+        size -= count;
+    }
+    return (b << 16) | a;
+}
+
+// Huffman codes go most significant bit first, where everything else in a deflate stream goes least significant first
+uint32_t reverse_bits(uint32_t code, int bitCount)
+{
+    uint32_t reversed = 0;
+    for (int bit = 0; bit < bitCount; bit++)
+    {
+        reversed |= ((code >> bit) & 1) << (bitCount - 1 - bit);
+    }
+    return reversed;
+}
+
+// Bits for a deflate stream, packed from the least significant end
+class BitWriter
+{
+private:
+    std::vector<uint8_t>& out;
+    uint64_t bits = 0;
+    int count = 0;
+
+public:
+    explicit BitWriter(std::vector<uint8_t>& target)
+        : out(target)
+    {
+    }
+
+    void Put(uint32_t value, int bitCount)
+    {
+        bits |= uint64_t(value) << count;
+        count += bitCount;
+        while (count >= 8)
+        {
+            out.push_back(uint8_t(bits));
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void Flush()
+    {
+        if (count > 0)
+        {
+            out.push_back(uint8_t(bits));
+        }
+        bits = 0;
+        count = 0;
+    }
+};
+
+const uint16_t LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t DistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// A literal or length symbol, with the fixed Huffman codes; they are reversed once, up front
+void put_fixed_symbol(BitWriter& writer, uint32_t symbol)
+{
+    static const struct FixedCodes
+    {
+        uint16_t codes[288];
+        uint8_t lengths[288];
+        FixedCodes()
+        {
+            for (uint32_t symbol = 0; symbol < 288; symbol++)
+            {
+                uint32_t code;
+                if (symbol < 144)
+                {
+                    code = 0x30 + symbol;
+                    lengths[symbol] = 8;
+                }
+                else if (symbol < 256)
+                {
+                    code = 0x190 + symbol - 144;
+                    lengths[symbol] = 9;
+                }
+                else if (symbol < 280)
+                {
+                    code = symbol - 256;
+                    lengths[symbol] = 7;
+                }
+                else
+                {
+                    code = 0xc0 + symbol - 280;
+                    lengths[symbol] = 8;
+                }
+                codes[symbol] = uint16_t(reverse_bits(code, lengths[symbol]));
+            }
+        }
+    } fixed;
+
+    writer.Put(fixed.codes[symbol], fixed.lengths[symbol]);
+}
+
+void put_match(BitWriter& writer, uint32_t length, uint32_t distance)
+{
+    int lengthCode = 28;
+    while (LengthBase[lengthCode] > length)
+    {
+        lengthCode--;
+    }
+    put_fixed_symbol(writer, 257 + lengthCode);
+    writer.Put(length - LengthBase[lengthCode], LengthExtra[lengthCode]);
+
+    int distanceCode = 29;
+    while (DistanceBase[distanceCode] > distance)
+    {
+        distanceCode--;
+    }
+    writer.Put(reverse_bits(uint32_t(distanceCode), 5), 5);
+    writer.Put(distance - DistanceBase[distanceCode], DistanceExtra[distanceCode]);
+}
+
+// One block with the fixed Huffman codes.  Matches are found through a hash of the next 3 bytes, which keeps only
+// the last place each hash was seen; that is fast, and does well enough on rendered images
+void deflate_fast(const uint8_t* pData, size_t size, std::vector<uint8_t>& out)
+{
+    const int HashBits = 15;
+    const uint32_t MaxDistance = 32768;
+    const uint32_t MaxLength = 258;
+    std::vector<uint32_t> lastSeen(size_t(1) << HashBits, 0);  // Position + 1, so 0 is never seen
+
+    BitWriter writer(out);
+    writer.Put(1, 1);                                       // Final block
+    writer.Put(1, 2);                                       // Fixed Huffman codes
+
+    size_t i = 0;
+    while (i + 3 <= size)
+    {
+        uint32_t hash = ((uint32_t(pData[i]) << 16 | uint32_t(pData[i + 1]) << 8 | pData[i + 2]) * 2654435761u) >> (32 - HashBits);
+        size_t candidate = lastSeen[hash];
+        lastSeen[hash] = uint32_t(i + 1);
+        if (candidate != 0 && i + 1 - candidate <= MaxDistance && memcmp(pData + candidate - 1, pData + i, 3) == 0)
+        {
+            candidate--;
+            size_t maxLength = std::min(size_t(MaxLength), size - i);
+            size_t length = 3;
+            while (length < maxLength && pData[candidate + length] == pData[i + length])
+            {
+                length++;
+            }
+            put_match(writer, uint32_t(length), uint32_t(i - candidate));
+            i += length;
+        }
+        else
+        {
+            put_fixed_symbol(writer, pData[i]);
+            i++;
+        }
+    }
+    for (; i < size; i++)
+    {
+        put_fixed_symbol(writer, pData[i]);
+    }
+    put_fixed_symbol(writer, 256);                          // End of block
+    writer.Flush();
+}
+
+// Stored blocks of up to 64K, with no compression
+void deflate_stored(const uint8_t* pData, size_t size, std::vector<uint8_t>& out)
+{
+    size_t offset = 0;
+    do
+    {
+        uint16_t count = uint16_t(std::min(size - offset, size_t(65535)));
+        bool final = offset + count == size;
+        uint8_t header[5] = { uint8_t(final ? 1 : 0), uint8_t(count), uint8_t(count >> 8), uint8_t(~count), uint8_t(uint16_t(~count) >> 8) };
+        out.insert(out.end(), header, header + sizeof(header));
+        out.insert(out.end(), pData + offset, pData + offset + count);
+        offset += count;
+    } while (offset < size);
+}
+
+void write_png_chunk(FileWriter& writer, const char* pType, const uint8_t* pData, size_t size)
+{
+    writer.Append32BigEndian(uint32_t(size));
+    writer.Append(pType, 4);
+    writer.Append(pData, size);
+    writer.Append32BigEndian(crc32(crc32(0, (const uint8_t*)pType, 4), pData, size));
+}
+
+void write_png(const ImagePixels& pixels, FileWriter& writer, bool compress)
+{
+    // Each row starts with its filter; 'up' stores the difference from the row above, which suits smooth images
+    size_t rowSize = size_t(pixels.width) * 3;
+    std::vector<uint8_t> filtered(pixels.height * (rowSize + 1));
+    for (int y = 0; y < pixels.height; y++)
+    {
+        const uint8_t* pRow = pixels.data.data() + y * rowSize;
+        uint8_t* pTarget = filtered.data() + y * (rowSize + 1);
+        pTarget[0] = 2;
+        if (y == 0)
+        {
+            memcpy(pTarget + 1, pRow, rowSize);
+            continue;
+        }
+        const uint8_t* pAbove = pRow - rowSize;
+        for (size_t x = 0; x < rowSize; x++)
+        {
+            pTarget[x + 1] = uint8_t(pRow[x] - pAbove[x]);
+        }
+    }
+
+    // A zlib stream: header, deflate data, then the Adler-32 of the data
+    std::vector<uint8_t> stream = { 0x78, 0x01 };
+    stream.reserve(compress ? filtered.size() / 2 : filtered.size() + filtered.size() / 65535 * 5 + 16);
+    if (compress)
+    {
+        deflate_fast(filtered.data(), filtered.size(), stream);
+    }
+    else
+    {
+        deflate_stored(filtered.data(), filtered.size(), stream);
+    }
+    uint32_t adler = adler32(filtered.data(), filtered.size());
+    uint8_t adlerBytes[4] = { uint8_t(adler >> 24), uint8_t(adler >> 16), uint8_t(adler >> 8), uint8_t(adler) };
+    stream.insert(stream.end(), adlerBytes, adlerBytes + 4);
+
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    writer.Append(signature, sizeof(signature));
+
+    uint8_t header[13] = {
+        uint8_t(pixels.width >> 24), uint8_t(pixels.width >> 16), uint8_t(pixels.width >> 8), uint8_t(pixels.width),
+        uint8_t(pixels.height >> 24), uint8_t(pixels.height >> 16), uint8_t(pixels.height >> 8), uint8_t(pixels.height),
+        8,                                                  // Bits per channel
+        2,                                                  // RGB
+        0, 0, 0                                             // Deflate, adaptive filters, not interlaced
+    };
+    write_png_chunk(writer, "IHDR", header, sizeof(header));
+    write_png_chunk(writer, "IDAT", stream.data(), stream.size());
+    write_png_chunk(writer, "IEND", nullptr, 0);
+}
+
+struct ImageJob
+{
+    std::string path;
+    ImageWriteOptions options;
+    ImagePixels pixels;
+};
+
+// The background thread, and the images waiting for it
+class ImageWriterQueue
+{
+private:
+    std::mutex mutex;
+    std::condition_variable wake;                           // Signalled when a job is queued, or on shutdown
+    std::condition_variable done;                           // Signalled when a job is finished
+    std::deque<ImageJob> jobs;
+    bool writing = false;
+    bool quit = false;
+    std::thread worker;
+
+public:
+    ~ImageWriterQueue()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+
+    void Push(ImageJob&& job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!worker.joinable())
+        {
+            worker = std::thread([this]() { WorkerLoop(); });
+        }
+        done.wait(lock, [this]() { return jobs.size() < MaxQueuedImages; });
+        jobs.push_back(std::move(job));
+        wake.notify_one();
+    }
+
+    void Flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return jobs.empty() && !writing; });
+    }
+
+private:
+    void WorkerLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            // Queued images are still written on shutdown
+            wake.wait(lock, [this]() { return quit || !jobs.empty(); });
+            if (jobs.empty())
+            {
+                return;
+            }
+
+            ImageJob job = std::move(jobs.front());
+            jobs.pop_front();
+            writing = true;
+            lock.unlock();
+
+            if (!image_write_pixels(job.pixels, job.path.c_str(), job.options))
+            {
+                device_log(("Failed to write " + job.path).c_str());
+            }
+
+            lock.lock();
+            writing = false;
+            done.notify_all();
+        }
+    }
+};
+
+ImageWriterQueue& image_writer_queue()
+{
+    static ImageWriterQueue queue;
+    return queue;
+}
+
+}
+
+ImageWriteOptions image_write_options(const char* pPath)
+{
+    ImageWriteOptions options;
+    options.encoding = deviceParams.encoding;
+
+    std::string path(pPath);
+    std::string extension = path.substr(std::min(path.size(), path.find_last_of('.')));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return char(tolower(c)); });
+    if (extension == ".ppm")
+    {
+        options.format = ImageFileFormat::PPM;
+    }
+    else if (extension == ".pfm")
+    {
+        options.format = ImageFileFormat::PFM;
+    }
+    else if (extension == ".png")
+    {
+        options.format = ImageFileFormat::PNG;
+    }
+    return options;
+}
+
+void image_pixels_from_buffer(const BufferData* pBuffer, const ImageWriteOptions& options, ImagePixels& pixels)
+{
+    pixels.width = pBuffer->BufferWidth;
+    pixels.height = pBuffer->BufferHeight;
+    pixels.format = options.format;
+    size_t pixelCount = size_t(pixels.width) * pixels.height;
+
+    if (options.format == ImageFileFormat::PFM)
+    {
+        pixels.data.resize(pixelCount * 3 * sizeof(float));
+        if (pBuffer->format == BufferFormat::RGB32F)
+        {
+            memcpy(pixels.data.data(), pBuffer->pPixels, pixels.data.size());
+            return;
+        }
+
+        std::vector<glm::vec4> row(pixels.width);
+        auto pTarget = (float*)pixels.data.data();
+        for (int y = 0; y < pixels.height; y++)
+        {
+            device_buffer_read(pBuffer, 0, y, pixels.width, row.data());
+            for (const auto& pixel : row)
+            {
+                *pTarget++ = pixel.r;
+                *pTarget++ = pixel.g;
+                *pTarget++ = pixel.b;
+            }
+        }
+        return;
+    }
+
+    // BMP wants its pixels blue first
+    pixels.data.resize(pixelCount * 3);
+    PixelLayout layout = options.format == ImageFileFormat::BMP ? PixelLayout::BGR8 : PixelLayout::RGB8;
+    device_buffer_convert(pBuffer, pixels.data.data(), pixels.width * 3, layout, options.encoding);
+}
+
+bool image_write_pixels(const ImagePixels& pixels, const char* pPath, const ImageWriteOptions& options)
+{
+    FileWriter writer(pPath);
+    switch (pixels.format)
+    {
+    case ImageFileFormat::BMP:
+        write_bmp(pixels, writer);
+        break;
+    case ImageFileFormat::PPM:
+        write_ppm(pixels, writer);
+        break;
+    case ImageFileFormat::PFM:
+        write_pfm(pixels, writer);
+        break;
+    case ImageFileFormat::PNG:
+        write_png(pixels, writer, options.compress);
+        break;
+    }
+    return writer.Close();
+}
+
+bool image_write(const BufferData* pBuffer, const char* pPath)
+{
+    return image_write(pBuffer, pPath, image_write_options(pPath));
+}
+
+bool image_write(const BufferData* pBuffer, const char* pPath, const ImageWriteOptions& options)
+{
+    ImagePixels pixels;
+    image_pixels_from_buffer(pBuffer, options, pixels);
+    return image_write_pixels(pixels, pPath, options);
+}
+
+void image_write_async(const BufferData* pBuffer, const char* pPath)
+{
+    image_write_async(pBuffer, pPath, image_write_options(pPath));
+}
+
+void image_write_async(const BufferData* pBuffer, const char* pPath, const ImageWriteOptions& options)
+{
+    ImageJob job;
+    job.path = pPath;
+    job.options = options;
+    image_pixels_from_buffer(pBuffer, options, job.pixels);
+    image_writer_queue().Push(std::move(job));
+}
+
+void image_writer_flush()
+{
+    image_writer_queue().Flush();
+}
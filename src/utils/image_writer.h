@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "device.h"
+
+// Writing images to files.  A buffer is converted on the calling thread, which is quick and can use the device's
+// thread pool; the file itself is assembled a block at a time and written with a few large calls, either there or
+// on a background thread, so the render loop can hand a frame off and carry on.
+//
+// BMP, binary PPM and PNG hold 8 bit pixels in the device's encoding; PFM holds the floats as they are
+enum class ImageFileFormat
+{
+    BMP,
+    PPM,
+    PFM,
+    PNG
+};
+
+// How an image is written; image_write_options fills it in from the file's extension and deviceParams
+struct ImageWriteOptions
+{
+    ImageFileFormat format = ImageFileFormat::BMP;
+    PixelEncoding encoding = PixelEncoding::Linear;         // 8 bit formats only
+    bool compress = true;                                   // PNG only: a fast deflate, or the rows stored as they are
+};
+
+// Pixels converted for a file: rows top to bottom, 3 channels in the order the file wants them; bytes for the
+// 8 bit formats, and floats for PFM
+struct ImagePixels
+{
+    int width = 0;
+    int height = 0;
+    ImageFileFormat format = ImageFileFormat::BMP;
+    std::vector<uint8_t> data;
+};
+
+// .bmp, .ppm, .pfm or .png; anything else is written as a BMP
+ImageWriteOptions image_write_options(const char* pPath);
+
+// Convert a buffer into the pixels the format needs
+void image_pixels_from_buffer(const BufferData* pBuffer, const ImageWriteOptions& options, ImagePixels& pixels);
+
+// Write converted pixels to a file.  Returns false if the file can't be written
+bool image_write_pixels(const ImagePixels& pixels, const char* pPath, const ImageWriteOptions& options);
+
+// Convert and write a buffer, and wait for it
+bool image_write(const BufferData* pBuffer, const char* pPath);
+bool image_write(const BufferData* pBuffer, const char* pPath, const ImageWriteOptions& options);
+
+// Convert a buffer, and queue it to be written on the background thread.  Returns once the pixels are converted;
+// only waits for the writer if it is already several images behind.  Failures are reported with device_log
+void image_write_async(const BufferData* pBuffer, const char* pPath);
+void image_write_async(const BufferData* pBuffer, const char* pPath, const ImageWriteOptions& options);
+
+// Wait until every queued image has been written
+void image_writer_flush();
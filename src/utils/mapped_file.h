@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A file mapped into memory, so it can be used in place without reading or writing it
+struct MappedFile
+{
+    void* pData;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int file;
+#endif
+};
+
+static void mapped_file_close(MappedFile* pFile);
+
+// Map a whole file for reading.  Returns nullptr if it can't be opened or is empty
+static MappedFile* mapped_file_open(const char* pPath)
+{
+    MappedFile* pFile = (MappedFile*)malloc(sizeof(MappedFile));
+    pFile->pData = nullptr;
+    pFile->size = 0;
+
+#ifdef _WIN32
+    pFile->mapping = NULL;
+    pFile->file = CreateFileA(pPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (pFile->file == INVALID_HANDLE_VALUE ||
+        !GetFileSizeEx(pFile->file, &size) ||
+        size.QuadPart == 0)
+    {
+        mapped_file_close(pFile);
+        return nullptr;
+    }
+    pFile->size = size_t(size.QuadPart);
+
+    pFile->mapping = CreateFileMappingA(pFile->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (pFile->mapping)
+    {
+        pFile->pData = MapViewOfFile(pFile->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+#else
+    pFile->file = open(pPath, O_RDONLY);
+    struct stat info;
+    if (pFile->file < 0 ||
+        fstat(pFile->file, &info) != 0 ||
+        info.st_size == 0)
+    {
+        mapped_file_close(pFile);
+        return nullptr;
+    }
+    pFile->size = size_t(info.st_size);
+
+    void* pData = mmap(nullptr, pFile->size, PROT_READ, MAP_PRIVATE, pFile->file, 0);
+    pFile->pData = pData == MAP_FAILED ? nullptr : pData;
+#endif
+
+    if (!pFile->pData)
+    {
+        mapped_file_close(pFile);
+        return nullptr;
+    }
+    return pFile;
+}
+
+// Map a file for reading and writing, creating it if needed.  A file that is already 'size' bytes keeps what is
+// in it; any other is cleared and resized.  Changes reach the file when the system writes the pages back, at the
+// latest when it is closed.  Returns nullptr if it can't be opened or size is 0
+static MappedFile* mapped_file_create(const char* pPath, size_t size)
+{
+    if (size == 0)
+    {
+        return nullptr;
+    }
+
+    MappedFile* pFile = (MappedFile*)malloc(sizeof(MappedFile));
+    pFile->pData = nullptr;
+    pFile->size = size;
+
+#ifdef _WIN32
+    pFile->mapping = NULL;
+    pFile->file = CreateFileA(pPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER currentSize;
+    if (pFile->file == INVALID_HANDLE_VALUE ||
+        !GetFileSizeEx(pFile->file, &currentSize))
+    {
+        mapped_file_close(pFile);
+        return nullptr;
+    }
+    if (size_t(currentSize.QuadPart) != size)
+    {
+        LARGE_INTEGER zero = {};
+        LARGE_INTEGER end;
+        end.QuadPart = LONGLONG(size);
+        if (!SetFilePointerEx(pFile->file, zero, NULL, FILE_BEGIN) ||
+            !SetEndOfFile(pFile->file) ||
+            !SetFilePointerEx(pFile->file, end, NULL, FILE_BEGIN) ||
+            !SetEndOfFile(pFile->file))
+        {
+            mapped_file_close(pFile);
+            return nullptr;
+        }
+    }
+
+    pFile->mapping = CreateFileMappingA(pFile->file, NULL, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size), NULL);
+    if (pFile->mapping)
+    {
+        pFile->pData = MapViewOfFile(pFile->mapping, FILE_MAP_WRITE, 0, 0, size);
+    }
+#else
+    // A file of the wrong size is emptied, then grown to the new size
+    struct stat info;
+    pFile->file = open(pPath, O_RDWR | O_CREAT, 0644);
+    if (pFile->file < 0 ||
+        fstat(pFile->file, &info) != 0)
+    {
+        mapped_file_close(pFile);
+        return nullptr;
+    }
+    if (size_t(info.st_size) != size &&
+        (ftruncate(pFile->file, 0) != 0 || ftruncate(pFile->file, off_t(size)) != 0))
+    {
+        mapped_file_close(pFile);
+        return nullptr;
+    }
+
+    void* pData = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, pFile->file, 0);
+    pFile->pData = pData == MAP_FAILED ? nullptr : pData;
+#endif
+
+    if (!pFile->pData)
+    {
+        mapped_file_close(pFile);
+        return nullptr;
+    }
+    return pFile;
+}
+
+// Start writing the changed pages of a writable mapping back to the file, without waiting for them
+static void mapped_file_flush(MappedFile* pFile)
+{
+#ifdef _WIN32
+    FlushViewOfFile(pFile->pData, pFile->size);
+#else
+    msync(pFile->pData, pFile->size, MS_ASYNC);
+#endif
+}
+
+static void mapped_file_close(MappedFile* pFile)
+{
+    if (!pFile)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    if (pFile->pData)
+    {
+        UnmapViewOfFile(pFile->pData);
+    }
+    if (pFile->mapping)
+    {
+        CloseHandle(pFile->mapping);
+    }
+    if (pFile->file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(pFile->file);
+    }
+#else
+    if (pFile->pData)
+    {
+        munmap(pFile->pData, pFile->size);
+    }
+    if (pFile->file >= 0)
+    {
+        close(pFile->file);
+    }
+#endif
+    free(pFile);
+}
@@ -0,0 +1,589 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
+
+#include "remote_workers.h"
+#include "device.h"
+
+namespace
+{
+
+#ifdef _WIN32
+using Socket = SOCKET;
+const Socket NoSocket = INVALID_SOCKET;
+using Process = HANDLE;
+#else
+using Socket = int;
+const Socket NoSocket = -1;
+using Process = pid_t;
+#endif
+
+const uint32_t HelloMagic = 0x4b575245;                     // "ERWK"
+const uint32_t ProtocolVersion = 1;
+const uint32_t MaxMessageSize = 1u << 30;
+
+// What a worker says when it connects
+struct WorkerHello
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t threads;
+};
+
+bool sockets_start()
+{
+#ifdef _WIN32
+    static bool started = []()
+    {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+    return started;
+#else
+    return true;
+#endif
+}
+
+void socket_close(Socket socket)
+{
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
+
+// Wakes up anything blocked on the socket, without releasing it
+void socket_shutdown(Socket socket)
+{
+#ifdef _WIN32
+    shutdown(socket, SD_BOTH);
+#else
+    shutdown(socket, SHUT_RDWR);
+#endif
+}
+
+// Jobs are small and answered quickly, so they shouldn't wait to be batched up; and a closed connection shouldn't
+// raise SIGPIPE
+void socket_configure(Socket socket)
+{
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&on, sizeof(on));
+#endif
+}
+
+bool send_all(Socket socket, const void* pData, size_t size)
+{
+    auto pBytes = (const char*)pData;
+    while (size > 0)
+    {
+        int chunk = int(std::min(size, size_t(1) << 30));
+#ifdef MSG_NOSIGNAL
+        int sent = int(send(socket, pBytes, chunk, MSG_NOSIGNAL));
+#else
+        int sent = int(send(socket, pBytes, chunk, 0));
+#endif
+        if (sent <= 0)
+        {
+            return false;
+        }
+        pBytes += sent;
+        size -= size_t(sent);
+    }
+    return true;
+}
+
+bool receive_all(Socket socket, void* pData, size_t size)
+{
+    auto pBytes = (char*)pData;
+    while (size > 0)
+    {
+        int chunk = int(std::min(size, size_t(1) << 30));
+        int received = int(recv(socket, pBytes, chunk, 0));
+        if (received <= 0)
+        {
+            return false;
+        }
+        pBytes += received;
+        size -= size_t(received);
+    }
+    return true;
+}
+
+bool send_message(Socket socket, const std::vector<uint8_t>& message)
+{
+    uint32_t size = uint32_t(message.size());
+    return send_all(socket, &size, sizeof(size)) && send_all(socket, message.data(), message.size());
+}
+
+bool receive_message(Socket socket, std::vector<uint8_t>& message)
+{
+    uint32_t size;
+    if (!receive_all(socket, &size, sizeof(size)) || size > MaxMessageSize)
+    {
+        return false;
+    }
+    message.resize(size);
+    return receive_all(socket, message.data(), size);
+}
+
+// A connected worker, and the thread that feeds it jobs
+struct Connection
+{
+    Socket socket = NoSocket;
+    std::string name;
+    std::thread thread;
+    bool finished = false;                                  // The thread is done with the socket, which is closed
+};
+
+class Coordinator
+{
+public:
+    Socket listener = NoSocket;
+    uint16_t port = 0;
+    std::thread acceptThread;
+    std::vector<Process> processes;                         // The workers started on this machine
+
+    std::mutex mutex;
+    std::condition_variable changed;                        // A worker joined or left, or jobs were queued or answered
+    std::vector<std::unique_ptr<Connection>> connections;
+    uint32_t liveWorkers = 0;
+    uint32_t joinedWorkers = 0;
+    bool stopping = false;
+
+    // The run in progress
+    const std::vector<std::vector<uint8_t>>* pRequests = nullptr;
+    const RemoteReplyHandler* pOnReply = nullptr;
+    std::deque<uint32_t> queue;
+    uint32_t unanswered = 0;
+
+    void AcceptLoop()
+    {
+        for (;;)
+        {
+            sockaddr_in address;
+            socklen_t addressSize = sizeof(address);
+            Socket socket = accept(listener, (sockaddr*)&address, &addressSize);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopping)
+            {
+                if (socket != NoSocket)
+                {
+                    socket_close(socket);
+                }
+                return;
+            }
+            if (socket == NoSocket)
+            {
+                // Out of descriptors, most likely; try again in a while
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+
+            char host[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+            socket_configure(socket);
+
+            ReapFinished();
+            connections.emplace_back(new Connection());
+            Connection* pConnection = connections.back().get();
+            pConnection->socket = socket;
+            pConnection->name = host;
+            pConnection->thread = std::thread([this, pConnection]() { ConnectionLoop(*pConnection); });
+        }
+    }
+
+    // Let go of the connections whose threads have finished; their threads don't take the lock again after
+    // marking them, so they can be joined with it held
+    void ReapFinished()
+    {
+        for (auto itr = connections.begin(); itr != connections.end();)
+        {
+            if ((*itr)->finished)
+            {
+                (*itr)->thread.join();
+                itr = connections.erase(itr);
+            }
+            else
+            {
+                ++itr;
+            }
+        }
+    }
+
+    // Called with the lock held, as the last thing a connection's thread does
+    void Finish(Connection& connection)
+    {
+        socket_close(connection.socket);
+        connection.socket = NoSocket;
+        connection.finished = true;
+    }
+
+    void ConnectionLoop(Connection& connection)
+    {
+        WorkerHello hello;
+        if (!receive_all(connection.socket, &hello, sizeof(hello)) ||
+            hello.magic != HelloMagic ||
+            hello.version != ProtocolVersion)
+        {
+            device_log(("Turned away a connection from " + connection.name + " that isn't a worker").c_str());
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!stopping)
+            {
+                Finish(connection);
+            }
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        liveWorkers++;
+        joinedWorkers++;
+        char message[256];
+        snprintf(message, sizeof(message), "Worker %u joined from %s with %u threads", joinedWorkers, connection.name.c_str(), hello.threads);
+        device_log(message);
+        changed.notify_all();
+
+        std::vector<uint8_t> reply;
+        for (;;)
+        {
+            changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+
+            // The request stays put until its job is answered, so it can be sent without the lock
+            uint32_t job = queue.front();
+            queue.pop_front();
+            const std::vector<uint8_t>& request = (*pRequests)[job];
+            const RemoteReplyHandler& onReply = *pOnReply;
+            lock.unlock();
+
+            // An empty reply is a worker that couldn't answer
+            bool answered = send_message(connection.socket, request) &&
+                receive_message(connection.socket, reply) &&
+                !reply.empty();
+            if (answered)
+            {
+                onReply(job, reply);
+            }
+
+            lock.lock();
+            if (!answered)
+            {
+                // Closed, so a worker that refused the job doesn't wait for another
+                queue.push_front(job);
+                liveWorkers--;
+                device_log(("Lost the worker on " + connection.name + "; its job goes to another").c_str());
+                changed.notify_all();
+                if (!stopping)
+                {
+                    Finish(connection);
+                }
+                return;
+            }
+            unanswered--;
+            if (unanswered == 0)
+            {
+                changed.notify_all();
+            }
+        }
+    }
+};
+
+std::unique_ptr<Coordinator> spCoordinator;
+RemoteJobHandler jobHandler;
+
+}
+
+bool remote_workers_listen(uint16_t port)
+{
+    if (spCoordinator)
+    {
+        device_log("Already listening for workers");
+        return false;
+    }
+    if (!sockets_start())
+    {
+        device_log("Couldn't start the network");
+        return false;
+    }
+
+    Socket listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(port == 0 ? INADDR_LOOPBACK : INADDR_ANY);
+    socklen_t addressSize = sizeof(address);
+    if (listener == NoSocket ||
+        bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 64) != 0 ||
+        getsockname(listener, (sockaddr*)&address, &addressSize) != 0)
+    {
+        if (listener != NoSocket)
+        {
+            socket_close(listener);
+        }
+        device_log(("Couldn't listen for workers on port " + std::to_string(port)).c_str());
+        return false;
+    }
+
+    spCoordinator.reset(new Coordinator());
+    spCoordinator->listener = listener;
+    spCoordinator->port = ntohs(address.sin_port);
+    spCoordinator->acceptThread = std::thread([]() { spCoordinator->AcceptLoop(); });
+    device_log(("Listening for workers on port " + std::to_string(spCoordinator->port)).c_str());
+    return true;
+}
+
+bool remote_workers_spawn(uint32_t count, const char* pExecutable)
+{
+    if (!spCoordinator)
+    {
+        device_log("Workers can only be started while listening for them");
+        return false;
+    }
+
+    std::string address = "127.0.0.1:" + std::to_string(spCoordinator->port);
+    for (uint32_t worker = 0; worker < count; worker++)
+    {
+#ifdef _WIN32
+        // The executable is found from this process, as argv[0] may not have a path or extension
+        (void)pExecutable;
+        char path[MAX_PATH];
+        GetModuleFileNameA(NULL, path, MAX_PATH);
+        std::string commandLine = std::string("\"") + path + "\" --worker " + address;
+        STARTUPINFOA startup = {};
+        startup.cb = sizeof(startup);
+        PROCESS_INFORMATION info;
+        if (!CreateProcessA(path, &commandLine[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &info))
+        {
+            device_log("Couldn't start a worker");
+            return false;
+        }
+        CloseHandle(info.hThread);
+        spCoordinator->processes.push_back(info.hProcess);
+#else
+        char* arguments[] = { (char*)pExecutable, (char*)"--worker", (char*)address.c_str(), nullptr };
+        pid_t process;
+        if (posix_spawnp(&process, pExecutable, nullptr, nullptr, arguments, environ) != 0)
+        {
+            device_log((std::string("Couldn't start a worker from ") + pExecutable).c_str());
+            return false;
+        }
+        spCoordinator->processes.push_back(process);
+#endif
+    }
+    return true;
+}
+
+uint32_t remote_workers_wait(uint32_t count, float timeoutSeconds)
+{
+    if (!spCoordinator)
+    {
+        return 0;
+    }
+    Coordinator& coordinator = *spCoordinator;
+    std::unique_lock<std::mutex> lock(coordinator.mutex);
+    coordinator.changed.wait_for(lock, std::chrono::duration<float>(timeoutSeconds), [&]()
+    {
+        return coordinator.liveWorkers >= count;
+    });
+    return coordinator.liveWorkers;
+}
+
+uint32_t remote_workers_count()
+{
+    if (!spCoordinator)
+    {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(spCoordinator->mutex);
+    return spCoordinator->liveWorkers;
+}
+
+bool remote_workers_run(const std::vector<std::vector<uint8_t>>& requests, const RemoteReplyHandler& onReply)
+{
+    if (requests.empty())
+    {
+        return true;
+    }
+    if (!spCoordinator)
+    {
+        return false;
+    }
+
+    Coordinator& coordinator = *spCoordinator;
+    std::unique_lock<std::mutex> lock(coordinator.mutex);
+    coordinator.pRequests = &requests;
+    coordinator.pOnReply = &onReply;
+    for (uint32_t job = 0; job < uint32_t(requests.size()); job++)
+    {
+        coordinator.queue.push_back(job);
+    }
+    coordinator.unanswered = uint32_t(requests.size());
+    coordinator.changed.notify_all();
+
+    // No job is in flight once they are all answered, or once there is no one left to answer them
+    coordinator.changed.wait(lock, [&]()
+    {
+        return coordinator.unanswered == 0 || coordinator.liveWorkers == 0;
+    });
+    bool complete = coordinator.unanswered == 0;
+    coordinator.queue.clear();
+    coordinator.unanswered = 0;
+    coordinator.pRequests = nullptr;
+    coordinator.pOnReply = nullptr;
+    return complete;
+}
+
+void remote_workers_stop()
+{
+    if (!spCoordinator)
+    {
+        return;
+    }
+    Coordinator& coordinator = *spCoordinator;
+    {
+        std::unique_lock<std::mutex> lock(coordinator.mutex);
+        coordinator.stopping = true;
+    }
+    coordinator.changed.notify_all();
+
+    socket_shutdown(coordinator.listener);
+    socket_close(coordinator.listener);
+    coordinator.acceptThread.join();
+
+    // Closing the connections tells the workers to exit
+    for (auto& spConnection : coordinator.connections)
+    {
+        if (spConnection->finished)
+        {
+            spConnection->thread.join();
+            continue;
+        }
+        socket_shutdown(spConnection->socket);
+        spConnection->thread.join();
+        socket_close(spConnection->socket);
+    }
+
+    for (auto process : coordinator.processes)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(process, INFINITE);
+        CloseHandle(process);
+#else
+        waitpid(process, nullptr, 0);
+#endif
+    }
+    spCoordinator.reset();
+}
+
+void remote_workers_set_handler(const RemoteJobHandler& handler)
+{
+    jobHandler = handler;
+}
+
+bool remote_worker_serve(const char* pAddress)
+{
+    std::string address(pAddress);
+    size_t colon = address.find_last_of(':');
+    if (!jobHandler)
+    {
+        device_log((std::string(deviceParams.pName) + " can't be a worker").c_str());
+        return false;
+    }
+    if (colon == std::string::npos || !sockets_start())
+    {
+        device_log(("Can't connect to " + address + "; it should be host:port").c_str());
+        return false;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* pAddresses = nullptr;
+    Socket socket = NoSocket;
+    if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &pAddresses) == 0)
+    {
+        for (addrinfo* pInfo = pAddresses; pInfo && socket == NoSocket; pInfo = pInfo->ai_next)
+        {
+            socket = ::socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+            if (socket != NoSocket && connect(socket, pInfo->ai_addr, socklen_t(pInfo->ai_addrlen)) != 0)
+            {
+                socket_close(socket);
+                socket = NoSocket;
+            }
+        }
+        freeaddrinfo(pAddresses);
+    }
+
+    if (socket == NoSocket)
+    {
+        device_log(("Couldn't connect to the coordinator at " + address).c_str());
+        return false;
+    }
+
+    socket_configure(socket);
+    WorkerHello hello = { HelloMagic, ProtocolVersion, std::max(1u, std::thread::hardware_concurrency()) };
+    if (!send_all(socket, &hello, sizeof(hello)))
+    {
+        socket_close(socket);
+        device_log(("Lost the coordinator at " + address).c_str());
+        return false;
+    }
+
+    std::vector<uint8_t> request;
+    std::vector<uint8_t> reply;
+    while (receive_message(socket, request))
+    {
+        reply.clear();
+        if (!jobHandler(request, reply))
+        {
+            reply.clear();
+        }
+        if (!send_message(socket, reply))
+        {
+            break;
+        }
+    }
+    socket_close(socket);
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Sharing a frame's work out to other processes, on this machine or others, over TCP.
+// A coordinator listens for workers, which are the same sample started with the device's --worker option; it can
+// also start workers on this machine itself.  A frame's work is a list of jobs, each a request for a worker to
+// answer; what is in them is up to the sample.  Every connected worker takes the next job as soon as it has
+// answered its last, so fast machines take more of the frame.  The job of a worker that goes away is given to
+// another one.
+//
+// Messages are a 32 bit length followed by the bytes, in the byte order of the machines, which must agree.
+
+// Answers a request on a worker; returns false if it can't, which drops the worker
+using RemoteJobHandler = std::function<bool(const std::vector<uint8_t>& request, std::vector<uint8_t>& reply)>;
+
+// Called with each job's reply, on the thread that talks to the worker that answered it; jobs may finish in any order
+using RemoteReplyHandler = std::function<void(uint32_t job, const std::vector<uint8_t>& reply)>;
+
+// Coordinator
+
+// Listen for workers on a port, from anywhere, or on a free port on the loopback address only if port is 0.
+// Returns false, and logs why, if it can't
+bool remote_workers_listen(uint16_t port);
+
+// Start worker processes on this machine, connected to the coordinator, which must be listening.  pExecutable is the
+// sample to run, usually argv[0]
+bool remote_workers_spawn(uint32_t count, const char* pExecutable);
+
+// Wait until at least 'count' workers have connected, or the timeout runs out; returns the number connected
+uint32_t remote_workers_wait(uint32_t count, float timeoutSeconds);
+
+uint32_t remote_workers_count();
+
+// Hand out the jobs and wait for their replies.  Returns false if the workers all went away before every job was
+// answered; the replies that did come back have been handed to onReply
+bool remote_workers_run(const std::vector<std::vector<uint8_t>>& requests, const RemoteReplyHandler& onReply);
+
+// Disconnect the workers, which makes them exit, and stop listening
+void remote_workers_stop();
+
+// Worker
+
+// The sample says how it answers requests; samples that don't can't be workers
+void remote_workers_set_handler(const RemoteJobHandler& handler);
+
+// Connect to the coordinator at host:port, and answer its requests until it disconnects.  Returns false, and logs
+// why, if there is no handler or it can't connect
+bool remote_worker_serve(const char* pAddress);
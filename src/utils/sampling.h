@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Sub-pixel sample positions for anti-aliasing.
+// Each pixel walks its own copy of the R2 low discrepancy sequence, shifted by a hash of the pixel index
+// (a Cranley-Patterson rotation).  Neighbouring pixels then sample different positions, each pixel's samples
+// cover its area evenly, and a sample depends only on the pixel and sample index, not on which thread traced it.
+
+// A good 32 bit integer mix (lowbias32)
+inline uint32_t sampling_hash(uint32_t value)
+{
+    value ^= value >> 16;
+    value *= 0x7feb352du;
+    value ^= value >> 15;
+    value *= 0x846ca68bu;
+    value ^= value >> 16;
+    return value;
+}
+
+// The top 24 bits as a float in [0, 1)
+inline float sampling_unit_float(uint32_t bits)
+{
+    return float(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// The index'th sample for a pixel, as an offset in [0, 1) from its top left corner
+inline glm::vec2 sampling_pixel_offset(uint32_t pixel, uint32_t index)
+{
+    // R2 steps by the inverse powers of the plastic number; in 32 bit fixed point the wrap around is exact
+    const uint32_t step0 = 3242174889u;                     // 2^32 / g
+    const uint32_t step1 = 2447445414u;                     // 2^32 / g^2
+    uint32_t rotation = sampling_hash(pixel);
+    return glm::vec2(sampling_unit_float(rotation + index * step0),
+        sampling_unit_float(sampling_hash(rotation) + index * step1));
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A pool of worker threads that lives for the whole run, so a frame doesn't pay to create and join threads.
+// The thread that calls Run takes part in the work as thread 0.  Run must only be called from one thread at a time.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;                           // Signalled when a job starts, or on shutdown
+    std::condition_variable done;                           // Signalled when the last worker finishes a job
+    const std::function<void(uint32_t)>* pJob = nullptr;
+    uint64_t generation = 0;                                // Bumped for every job, so workers run each one once
+    uint32_t busyWorkers = 0;
+    bool quit = false;
+
+public:
+    // 0 threads means one per hardware thread
+    explicit ThreadPool(uint32_t threadCount = 0)
+    {
+        if (threadCount == 0)
+        {
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        for (uint32_t i = 1; i < threadCount; i++)
+        {
+            workers.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Number of threads that run a job, including the caller
+    uint32_t GetThreadCount() const
+    {
+        return uint32_t(workers.size()) + 1;
+    }
+
+    // Run fn(threadIndex) once on every thread, and wait for all of them to finish
+    void Run(const std::function<void(uint32_t)>& fn)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pJob = &fn;
+            busyWorkers = uint32_t(workers.size());
+            generation++;
+        }
+        wake.notify_all();
+
+        fn(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return busyWorkers == 0; });
+        pJob = nullptr;
+    }
+
+    // Call fn(index) for every index in [0, count), spread across the threads
+    void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& fn)
+    {
+        std::atomic<uint32_t> next(0);
+        Run([&](uint32_t)
+        {
+            for (uint32_t index = next++; index < count; index = next++)
+            {
+                fn(index);
+            }
+        });
+    }
+
+    // Call fn(x, y, width, height) for each tile of an image, spread across the threads.  Edge tiles are clipped
+    void ParallelForTiles(int imageWidth, int imageHeight, int tileSize, const std::function<void(int, int, int, int)>& fn)
+    {
+        int tilesX = (imageWidth + tileSize - 1) / tileSize;
+        int tilesY = (imageHeight + tileSize - 1) / tileSize;
+        ParallelFor(uint32_t(tilesX * tilesY), [&](uint32_t tile)
+        {
+            int x = (int(tile) % tilesX) * tileSize;
+            int y = (int(tile) / tilesX) * tileSize;
+            fn(x, y, std::min(tileSize, imageWidth - x), std::min(tileSize, imageHeight - y));
+        });
+    }
+
+private:
+    void WorkerLoop(uint32_t threadIndex)
+    {
+        uint64_t lastGeneration = 0;
+        for (;;)
+        {
+            const std::function<void(uint32_t)>* pCurrentJob;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return quit || generation != lastGeneration; });
+                if (quit)
+                {
+                    return;
+                }
+                lastGeneration = generation;
+                pCurrentJob = pJob;
+            }
+
+            (*pCurrentJob)(threadIndex);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (--busyWorkers == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+};
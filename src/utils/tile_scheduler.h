@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+// A rectangle of the image to render
+struct Tile
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Split an image into tiles, in rows from the top left; edge tiles are clipped to the image
+inline std::vector<Tile> tiles_build(int imageWidth, int imageHeight, int tileSize)
+{
+    std::vector<Tile> tiles;
+    for (int y = 0; y < imageHeight; y += tileSize)
+    {
+        for (int x = 0; x < imageWidth; x += tileSize)
+        {
+            tiles.push_back(Tile{ x, y, std::min(tileSize, imageWidth - x), std::min(tileSize, imageHeight - y) });
+        }
+    }
+    return tiles;
+}
+
+// How long a tile took, and which thread drew it
+struct TileTiming
+{
+    uint32_t thread;
+    float milliseconds;
+};
+
+// Hands out tiles to the thread pool with work stealing.
+// Each thread starts with its own contiguous run of tiles, so neighbouring tiles tend to share caches.
+// It takes from the front of its own queue; when that is empty it steals from the back of another's,
+// so a thread stuck on expensive tiles is helped out instead of leaving the others idle.
+class TileScheduler
+{
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<uint32_t> tiles;
+    };
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<Tile> lastTiles;
+    std::vector<TileTiming> timings;
+    std::atomic<uint32_t> steals;
+    float frameMilliseconds = 0.0f;
+
+public:
+    TileScheduler()
+        : steals(0)
+    {
+    }
+
+    // Call fn(tile) for every tile, spread across the pool, and wait for them all
+    void Run(ThreadPool& pool, const std::vector<Tile>& tiles, const std::function<void(const Tile&)>& fn)
+    {
+        auto frameStart = std::chrono::high_resolution_clock::now();
+
+        uint32_t threadCount = pool.GetThreadCount();
+        while (queues.size() < threadCount)
+        {
+            queues.emplace_back(new WorkQueue());
+        }
+
+        uint32_t tileCount = uint32_t(tiles.size());
+        for (uint32_t thread = 0; thread < threadCount; thread++)
+        {
+            auto& queue = queues[thread]->tiles;
+            queue.clear();
+            for (uint32_t tile = tileCount * thread / threadCount; tile < tileCount * (thread + 1) / threadCount; tile++)
+            {
+                queue.push_back(tile);
+            }
+        }
+
+        lastTiles = tiles;
+        timings.resize(tileCount);
+        steals = 0;
+
+        pool.Run([&](uint32_t thread)
+        {
+            uint32_t tile;
+            while (PopOwn(thread, tile) || Steal(thread, threadCount, tile))
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                fn(tiles[tile]);
+                auto end = std::chrono::high_resolution_clock::now();
+                timings[tile] = TileTiming{ thread, std::chrono::duration<float, std::milli>(end - start).count() };
+            }
+        });
+
+        frameMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - frameStart).count();
+    }
+
+    // Timings from the last Run, one per tile in the order the tiles were given
+    const std::vector<TileTiming>& GetTimings() const
+    {
+        return timings;
+    }
+
+    uint32_t GetStealCount() const
+    {
+        return steals;
+    }
+
+    // A one line summary of the last Run, for tuning the tile size
+    std::string GetReport() const
+    {
+        if (timings.empty())
+        {
+            return "No tiles";
+        }
+
+        float total = 0.0f;
+        float minTime = timings[0].milliseconds;
+        float maxTime = 0.0f;
+        uint32_t slowest = 0;
+        std::vector<float> threadBusy;
+        for (uint32_t i = 0; i < uint32_t(timings.size()); i++)
+        {
+            const auto& timing = timings[i];
+            total += timing.milliseconds;
+            minTime = std::min(minTime, timing.milliseconds);
+            if (timing.milliseconds > maxTime)
+            {
+                maxTime = timing.milliseconds;
+                slowest = i;
+            }
+            threadBusy.resize(std::max(threadBusy.size(), size_t(timing.thread + 1)), 0.0f);
+            threadBusy[timing.thread] += timing.milliseconds;
+        }
+        auto busy = std::minmax_element(threadBusy.begin(), threadBusy.end());
+
+        char report[256];
+        snprintf(report, sizeof(report), "%u tiles of %dpx in %.2fms: tile min %.3f avg %.3f max %.3fms (at %d,%d), thread busy %.2f-%.2fms, %u steals",
+            uint32_t(timings.size()), lastTiles[0].width, frameMilliseconds,
+            minTime, total / timings.size(), maxTime, lastTiles[slowest].x, lastTiles[slowest].y,
+            *busy.first, *busy.second, uint32_t(steals));
+        return report;
+    }
+
+private:
+    bool PopOwn(uint32_t thread, uint32_t& tile)
+    {
+        auto& queue = *queues[thread];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tiles.empty())
+        {
+            return false;
+        }
+        tile = queue.tiles.front();
+        queue.tiles.pop_front();
+        return true;
+    }
+
+    // No work is added during a Run, so if every queue is empty we are done
+    bool Steal(uint32_t thread, uint32_t threadCount, uint32_t& tile)
+    {
+        for (uint32_t i = 1; i < threadCount; i++)
+        {
+            auto& victim = *queues[(thread + i) % threadCount];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tiles.empty())
+            {
+                tile = victim.tiles.back();
+                victim.tiles.pop_back();
+                steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+};